@@ -0,0 +1,373 @@
+/**
+ * @file alloc_tracker.cpp
+ * @brief An allocation tracker: replacements for the global operator new and
+ * operator delete that count allocations, bytes and peak memory, and sample
+ * the call stacks that allocate.
+ */
+
+// C++ lets a program replace the global operator new and operator delete by
+// defining functions with the same signatures, as small_vector.cpp does to
+// count allocations. This file does that once, for any executable that links
+// it: with the CMake option BOOTCAMP_TRACK_ALLOCATIONS=ON, that is every
+// executable in this repository, and each one prints a summary at exit.
+
+// operator delete is not always told the size of the memory it frees, so
+// every allocation gets a small header in front of it that holds its size.
+// Counters are relaxed atomics: they do not order anything, they only have
+// to add up. Each thread also keeps its own counts in thread_local
+// variables, which is what AllocationScope reads.
+
+// Sampling works like tcmalloc's heap profiler. Each thread counts down the
+// bytes it allocates, and when the count reaches zero, records the call
+// stack of that allocation and starts over. A call site that allocates twice
+// as many bytes is sampled about twice as often, no matter whether it does
+// that with many small allocations or a few big ones. Recording a stack is
+// slow, but it only happens once per sample interval.
+
+// Includes the allocation tracker's interface.
+#include "alloc_tracker.h"
+
+// Includes std::sort.
+#include <algorithm>
+// Includes std::atomic.
+#include <atomic>
+// Includes std::size_t.
+#include <cstddef>
+// Includes std::malloc, std::aligned_alloc, std::free and std::abort.
+#include <cstdlib>
+// Includes std::cerr.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::bad_alloc, std::align_val_t and std::get_new_handler.
+#include <new>
+// Includes std::ostringstream, for building reports.
+#include <sstream>
+// Includes std::string.
+#include <string>
+// Includes the vector container library header.
+#include <vector>
+
+#ifdef __linux__
+// Includes backtrace and backtrace_symbols, for sampled call stacks.
+#include <execinfo.h>
+#endif
+
+namespace {
+
+// Every allocation starts with a header this big, so that the memory after
+// it is still aligned for any type. The size is stored in its last 8 bytes.
+constexpr size_t kHeaderSize = alignof(std::max_align_t);
+
+std::atomic<uint64_t> total_allocations{0};
+std::atomic<uint64_t> total_deallocations{0};
+std::atomic<uint64_t> total_bytes{0};
+std::atomic<uint64_t> live_bytes{0};
+std::atomic<uint64_t> peak_live_bytes{0};
+std::atomic<uint64_t> sample_interval{512 * 1024};
+
+thread_local uint64_t thread_allocations = 0;
+thread_local uint64_t thread_deallocations = 0;
+thread_local uint64_t thread_bytes = 0;
+thread_local uint64_t bytes_until_sample = 512 * 1024;
+// The interval bytes_until_sample was counted down from. When another thread
+// changes sample_interval, this one notices on its next allocation, and
+// starts counting down from the new interval.
+thread_local uint64_t thread_sample_interval = 512 * 1024;
+// Set while the tracker itself is running on this thread, so that anything
+// it allocates (like the strings in a report) is not sampled.
+thread_local bool in_tracker = false;
+
+// The sampled call sites. It is a fixed-size hash table, since it is filled
+// from inside operator new, and must not allocate. Call sites that do not
+// fit are counted as dropped.
+constexpr int kMaxFrames = 24;
+constexpr size_t kMaxSites = 1024;
+
+struct CallSite {
+  uint64_t hash_;
+  int depth_;
+  void *frames_[kMaxFrames];
+  uint64_t samples_;
+  uint64_t bytes_;
+};
+
+std::mutex sites_latch;
+CallSite sites[kMaxSites];
+uint64_t dropped_samples = 0;
+
+// The call stack of a sample starts with three frames of the tracker's own:
+// RecordSample, CountAllocation and Allocate. They are marked noinline, so
+// that there are always exactly three, and RecordSample drops them. The
+// operator new that called Allocate may come next, unless the compiler
+// turned its call into a jump (which it does in optimized builds);
+// PrintReport drops that frame when it is there.
+constexpr int kTrackerFrames = 3;
+
+__attribute__((noinline)) void RecordSample(size_t size) {
+#ifdef __linux__
+  void *all_frames[kTrackerFrames + kMaxFrames];
+  int depth = backtrace(all_frames, kTrackerFrames + kMaxFrames) - kTrackerFrames;
+  if (depth <= 0) {
+    return;
+  }
+  void **frames = all_frames + kTrackerFrames;
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < depth; ++i) {
+    hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i])) * 1099511628211ULL;
+  }
+  hash |= 1;  // 0 marks an empty entry.
+  std::scoped_lock lk(sites_latch);
+  for (size_t probe = 0; probe < kMaxSites; ++probe) {
+    CallSite &site = sites[(hash + probe) % kMaxSites];
+    if (site.hash_ == 0) {
+      site.hash_ = hash;
+      site.depth_ = depth;
+      std::copy(frames, frames + depth, site.frames_);
+    }
+    if (site.hash_ == hash) {
+      site.samples_ += 1;
+      site.bytes_ += size;
+      return;
+    }
+  }
+  dropped_samples += 1;
+#else
+  (void)size;
+#endif
+}
+
+__attribute__((noinline)) void CountAllocation(size_t size) {
+  total_allocations.fetch_add(1, std::memory_order_relaxed);
+  total_bytes.fetch_add(size, std::memory_order_relaxed);
+  uint64_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+  uint64_t peak = peak_live_bytes.load(std::memory_order_relaxed);
+  while (live > peak && !peak_live_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+  }
+  thread_allocations += 1;
+  thread_bytes += size;
+
+  uint64_t interval = sample_interval.load(std::memory_order_relaxed);
+  if (interval != thread_sample_interval) {
+    thread_sample_interval = interval;
+    bytes_until_sample = interval;
+  }
+  if (interval == 0 || in_tracker) {
+    return;
+  }
+  if (size < bytes_until_sample) {
+    bytes_until_sample -= size;
+    return;
+  }
+  bytes_until_sample = interval;
+  in_tracker = true;
+  RecordSample(size);
+  in_tracker = false;
+}
+
+// Allocates size bytes aligned to alignment (at least kHeaderSize), with the
+// header right before the returned pointer. Like the standard operator new,
+// it calls the new handler until allocation succeeds, and throws
+// std::bad_alloc if there is none, or returns nullptr for the nothrow
+// versions.
+__attribute__((noinline)) void *Allocate(size_t size, size_t alignment, bool nothrow) {
+  size_t header = alignment > kHeaderSize ? alignment : kHeaderSize;
+  while (true) {
+    void *base;
+    if (alignment > kHeaderSize) {
+      // aligned_alloc wants the size to be a multiple of the alignment.
+      base = std::aligned_alloc(alignment, (header + size + alignment - 1) / alignment * alignment);
+    } else {
+      base = std::malloc(header + size);
+    }
+    if (base != nullptr) {
+      char *ptr = static_cast<char *>(base) + header;
+      reinterpret_cast<uint64_t *>(ptr)[-1] = size;
+      CountAllocation(size);
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      if (nothrow) {
+        return nullptr;
+      }
+      throw std::bad_alloc();
+    }
+    if (nothrow) {
+      try {
+        handler();
+      } catch (...) {
+        return nullptr;
+      }
+    } else {
+      handler();
+    }
+  }
+}
+
+void Deallocate(void *ptr, size_t alignment) {
+  if (ptr == nullptr) {
+    return;
+  }
+  size_t header = alignment > kHeaderSize ? alignment : kHeaderSize;
+  uint64_t size = reinterpret_cast<uint64_t *>(ptr)[-1];
+  total_deallocations.fetch_add(1, std::memory_order_relaxed);
+  live_bytes.fetch_sub(size, std::memory_order_relaxed);
+  thread_deallocations += 1;
+  std::free(static_cast<char *>(ptr) - header);
+}
+
+void AbortOnBudget(const std::string &report) {
+  std::cerr << report << std::flush;
+  std::abort();
+}
+
+std::atomic<BudgetHandler> budget_handler{&AbortOnBudget};
+
+// Prints the report when the program exits. Static objects are destroyed in
+// the opposite order of their construction, and this one is constructed
+// before main, so the report comes after function-local statics created
+// while main ran have been destroyed.
+struct ExitReport {
+  ~ExitReport() { AllocationTracker::PrintReport(std::cerr); }
+} exit_report;
+
+}  // namespace
+
+AllocationCounts AllocationTracker::Totals() {
+  return AllocationCounts{total_allocations.load(), total_deallocations.load(), total_bytes.load()};
+}
+
+uint64_t AllocationTracker::LiveBytes() { return live_bytes.load(); }
+
+uint64_t AllocationTracker::PeakLiveBytes() { return peak_live_bytes.load(); }
+
+void AllocationTracker::ResetPeak() { peak_live_bytes.store(live_bytes.load()); }
+
+// Every thread picks up the new interval on its next allocation.
+void AllocationTracker::SetSampleInterval(uint64_t interval) { sample_interval.store(interval); }
+
+void AllocationTracker::PrintReport(std::ostream &out) {
+  in_tracker = true;
+  AllocationCounts totals = Totals();
+  out << "Allocations: " << totals.allocations_ << ", deallocations: " << totals.deallocations_
+      << ", bytes allocated: " << totals.bytes_ << ", peak live bytes: " << PeakLiveBytes() << "\n";
+
+  std::vector<CallSite> top;
+  uint64_t dropped;
+  {
+    std::scoped_lock lk(sites_latch);
+    for (const CallSite &site : sites) {
+      if (site.hash_ != 0) {
+        top.push_back(site);
+      }
+    }
+    dropped = dropped_samples;
+  }
+  std::sort(top.begin(), top.end(), [](const CallSite &a, const CallSite &b) { return a.samples_ > b.samples_; });
+  if (top.size() > 5) {
+    top.resize(5);
+  }
+  uint64_t interval = sample_interval.load();
+  for (const CallSite &site : top) {
+    out << "Sampled " << site.samples_ << " times (about " << site.samples_ * interval
+        << " bytes allocated) at:\n";
+#ifdef __linux__
+    char **symbols = backtrace_symbols(site.frames_, site.depth_);
+    if (symbols != nullptr) {
+      // The first frame may be operator new or operator new[] (_Znw and
+      // _Zna in mangled form); see kTrackerFrames.
+      int first = 0;
+      std::string symbol = symbols[0];
+      if (symbol.find("(_Znw") != std::string::npos || symbol.find("(_Zna") != std::string::npos) {
+        first = 1;
+      }
+      for (int i = first; i < site.depth_; ++i) {
+        out << "    " << symbols[i] << "\n";
+      }
+      std::free(symbols);
+    }
+#endif
+  }
+  if (dropped > 0) {
+    out << dropped << " samples did not fit in the call site table\n";
+  }
+  out << std::flush;
+  in_tracker = false;
+}
+
+AllocationScope::AllocationScope() : start_{thread_allocations, thread_deallocations, thread_bytes} {}
+
+uint64_t AllocationScope::Allocations() const { return thread_allocations - start_.allocations_; }
+
+uint64_t AllocationScope::Bytes() const { return thread_bytes - start_.bytes_; }
+
+void SetBudgetHandler(BudgetHandler handler) { budget_handler.store(handler); }
+
+AllocationBudget::AllocationBudget(const char *label, uint64_t max_allocations, uint64_t max_bytes)
+    : label_(label), max_allocations_(max_allocations), max_bytes_(max_bytes) {}
+
+AllocationBudget::~AllocationBudget() {
+  uint64_t allocations = scope_.Allocations();
+  uint64_t bytes = scope_.Bytes();
+  if (allocations <= max_allocations_ && bytes <= max_bytes_) {
+    return;
+  }
+  std::ostringstream report;
+  report << "Allocation budget exceeded in \"" << label_ << "\": " << allocations << " allocations (budget "
+         << max_allocations_ << "), " << bytes << " bytes";
+  if (max_bytes_ != UINT64_MAX) {
+    report << " (budget " << max_bytes_ << ")";
+  }
+  report << "\n";
+  budget_handler.load()(report.str());
+}
+
+// The replaceable global allocation functions. The sized versions of
+// operator delete ignore the size, since the header has it anyway.
+
+void *operator new(std::size_t size) { return Allocate(size, kHeaderSize, false); }
+void *operator new[](std::size_t size) { return Allocate(size, kHeaderSize, false); }
+void *operator new(std::size_t size, const std::nothrow_t & /*tag*/) noexcept {
+  return Allocate(size, kHeaderSize, true);
+}
+void *operator new[](std::size_t size, const std::nothrow_t & /*tag*/) noexcept {
+  return Allocate(size, kHeaderSize, true);
+}
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return Allocate(size, static_cast<size_t>(alignment), false);
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return Allocate(size, static_cast<size_t>(alignment), false);
+}
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t & /*tag*/) noexcept {
+  return Allocate(size, static_cast<size_t>(alignment), true);
+}
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t & /*tag*/) noexcept {
+  return Allocate(size, static_cast<size_t>(alignment), true);
+}
+
+void operator delete(void *ptr) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete[](void *ptr) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete(void *ptr, std::size_t /*size*/) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete[](void *ptr, std::size_t /*size*/) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete(void *ptr, const std::nothrow_t & /*tag*/) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete[](void *ptr, const std::nothrow_t & /*tag*/) noexcept { Deallocate(ptr, kHeaderSize); }
+void operator delete(void *ptr, std::align_val_t alignment) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
+void operator delete(void *ptr, std::size_t /*size*/, std::align_val_t alignment) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
+void operator delete[](void *ptr, std::size_t /*size*/, std::align_val_t alignment) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
+void operator delete(void *ptr, std::align_val_t alignment, const std::nothrow_t & /*tag*/) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment, const std::nothrow_t & /*tag*/) noexcept {
+  Deallocate(ptr, static_cast<size_t>(alignment));
+}
@@ -0,0 +1,94 @@
+/**
+ * @file alloc_tracker.h
+ * @brief The interface of the allocation tracker in alloc_tracker.cpp, which
+ * replaces the global operator new and operator delete to count allocations.
+ */
+
+// A program that links alloc_tracker.cpp gets the tracking operator new and
+// operator delete, and prints an allocation summary when it exits. This
+// header is only needed to look at the numbers from inside the program, or
+// to check allocation budgets; see alloc_tracking.cpp for examples.
+
+#pragma once
+
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::ostream.
+#include <ostream>
+// Includes std::string.
+#include <string>
+
+// Allocation counts, for the whole program or for one thread.
+struct AllocationCounts {
+  uint64_t allocations_;
+  uint64_t deallocations_;
+  // Bytes requested by all allocations, including ones freed since.
+  uint64_t bytes_;
+};
+
+// The AllocationTracker class reads the tracker's program-wide numbers.
+class AllocationTracker {
+ public:
+  static AllocationCounts Totals();
+
+  // Bytes allocated and not freed yet, and the highest that has ever been.
+  static uint64_t LiveBytes();
+  static uint64_t PeakLiveBytes();
+
+  // Sets the peak to the current live bytes, to measure the peak of one
+  // part of the program.
+  static void ResetPeak();
+
+  // The tracker records the call stack of about one allocation per
+  // sample_interval bytes, so call sites show up in proportion to how many
+  // bytes they allocate. 0 turns sampling off. The default is 512 KiB.
+  static void SetSampleInterval(uint64_t sample_interval);
+
+  // Prints the totals, and the sampled call sites that allocated the most.
+  static void PrintReport(std::ostream &out);
+};
+
+// The AllocationScope class counts the allocations the calling thread makes
+// while the scope exists. Allocations made by other threads are not counted,
+// so scopes work in multithreaded programs too.
+class AllocationScope {
+ public:
+  AllocationScope();
+
+  uint64_t Allocations() const;
+  uint64_t Bytes() const;
+
+ private:
+  AllocationCounts start_;
+};
+
+// A function that receives each budget violation. The default handler prints
+// the report to std::cerr and aborts, like a failed assert.
+using BudgetHandler = void (*)(const std::string &report);
+
+void SetBudgetHandler(BudgetHandler handler);
+
+// The AllocationBudget class checks, when it is destroyed, that the calling
+// thread made at most max_allocations allocations and allocated at most
+// max_bytes bytes while it existed, and reports a violation otherwise:
+//
+//   {
+//     AllocationBudget budget("parse one row", 0);
+//     ParseRow(line, &row);  // Must not allocate.
+//   }
+class AllocationBudget {
+ public:
+  explicit AllocationBudget(const char *label, uint64_t max_allocations, uint64_t max_bytes = UINT64_MAX);
+  ~AllocationBudget();
+
+  AllocationBudget(const AllocationBudget &) = delete;
+  AllocationBudget &operator=(const AllocationBudget &) = delete;
+
+  const AllocationScope &Scope() const { return scope_; }
+
+ private:
+  const char *label_;
+  uint64_t max_allocations_;
+  uint64_t max_bytes_;
+  AllocationScope scope_;
+};
@@ -0,0 +1,173 @@
+/**
+ * @file alloc_tracking.cpp
+ * @brief Tutorial code for the allocation tracker in alloc_tracker.cpp: how
+ * to count the allocations a piece of code makes, and how to check them
+ * against a budget.
+ */
+
+// Allocations are easy to add by accident and hard to see: a std::vector
+// that grows one push_back at a time, a std::string copied where a reference
+// would do, or a linked list that allocates a node per element all look
+// harmless in the source. This executable is always linked with the
+// allocation tracker (see alloc_tracker.h), which replaces the global
+// operator new and operator delete. With the CMake option
+// BOOTCAMP_TRACK_ALLOCATIONS=ON, every other executable is linked with it
+// too, and prints a summary of its allocations when it exits.
+
+// An AllocationScope counts the calling thread's allocations while it
+// exists. An AllocationBudget does the same, and reports if the count goes
+// over a limit, which is how a benchmark or test can make sure that an
+// allocation-free code path stays that way.
+
+// Includes the allocation tracker's interface.
+#include "alloc_tracker.h"
+
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the vector container library header.
+#include <vector>
+
+// The Node struct and a minimal version of the DLL from iterator.cpp.
+struct Node {
+  Node(int val) : next_(nullptr), prev_(nullptr), value_(val) {}
+  Node *next_;
+  Node *prev_;
+  int value_;
+};
+
+class DLL {
+ public:
+  ~DLL() {
+    while (head_ != nullptr) {
+      Node *next = head_->next_;
+      delete head_;
+      head_ = next;
+    }
+  }
+
+  void InsertAtHead(int val) {
+    Node *node = new Node(val);
+    node->next_ = head_;
+    if (head_ != nullptr) {
+      head_->prev_ = node;
+    }
+    head_ = node;
+  }
+
+ private:
+  Node *head_ = nullptr;
+};
+
+// Sums the lengths of the strings. Taking the vector by value copies every
+// string longer than the small string buffer, which is the kind of mistake
+// the tracker makes visible.
+size_t TotalLengthByValue(std::vector<std::string> strings) {
+  size_t total = 0;
+  for (const std::string &s : strings) {
+    total += s.size();
+  }
+  return total;
+}
+
+size_t TotalLengthByReference(const std::vector<std::string> &strings) {
+  size_t total = 0;
+  for (const std::string &s : strings) {
+    total += s.size();
+  }
+  return total;
+}
+
+int budget_reports = 0;
+
+void PrintBudgetReport(const std::string &report) {
+  budget_reports += 1;
+  std::cout << report;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 1000;
+
+  // std::vector growth, from vectors.cpp: push_back reallocates every time
+  // the vector runs out of capacity, which happens about log(n) times.
+  // Reserving the capacity first needs a single allocation.
+  {
+    AllocationScope scope;
+    std::vector<int> v;
+    for (size_t i = 0; i < n; ++i) {
+      v.push_back(static_cast<int>(i));
+    }
+    std::cout << "push_back of " << n << " ints: " << scope.Allocations() << " allocations, " << scope.Bytes()
+              << " bytes\n";
+  }
+  {
+    AllocationScope scope;
+    std::vector<int> v;
+    v.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      v.push_back(static_cast<int>(i));
+    }
+    std::cout << "reserve, then push_back of " << n << " ints: " << scope.Allocations() << " allocations, "
+              << scope.Bytes() << " bytes\n";
+  }
+
+  // The DLL from iterator.cpp allocates one node per insert.
+  {
+    AllocationScope scope;
+    DLL dll;
+    for (size_t i = 0; i < n; ++i) {
+      dll.InsertAtHead(static_cast<int>(i));
+    }
+    std::cout << n << " DLL inserts: " << scope.Allocations() << " allocations, " << scope.Bytes() << " bytes\n";
+  }
+
+  // String copies. Short strings fit in std::string's internal buffer, so
+  // copying them does not allocate, but long ones do.
+  std::vector<std::string> strings;
+  for (size_t i = 0; i < 100; ++i) {
+    strings.push_back(i % 2 == 0 ? "short" : "a string too long for the small string buffer " + std::to_string(i));
+  }
+  {
+    AllocationScope scope;
+    size_t total = TotalLengthByValue(strings);
+    std::cout << "Passing 100 strings by value (total length " << total << "): " << scope.Allocations()
+              << " allocations\n";
+  }
+  {
+    AllocationScope scope;
+    size_t total = TotalLengthByReference(strings);
+    std::cout << "Passing 100 strings by reference (total length " << total << "): " << scope.Allocations()
+              << " allocations\n";
+  }
+
+  // Budgets. The default handler aborts the program, like assert; here we
+  // only print the reports.
+  SetBudgetHandler(&PrintBudgetReport);
+  {
+    AllocationBudget budget("sum strings by reference", 0);
+    TotalLengthByReference(strings);
+  }
+  {
+    AllocationBudget budget("sum strings by value", 1);
+    TotalLengthByValue(strings);
+  }
+  std::cout << "Budget violations: " << budget_reports << "\n";
+
+  // Peak memory: the vector below briefly holds its old and its new buffer
+  // at the same time while it grows.
+  AllocationTracker::ResetPeak();
+  uint64_t live_before = AllocationTracker::LiveBytes();
+  {
+    std::vector<char> buffer;
+    for (size_t i = 0; i < n * 1000; ++i) {
+      buffer.push_back('x');
+    }
+  }
+  std::cout << "Peak extra memory while growing a vector to " << n * 1000
+            << " bytes: " << AllocationTracker::PeakLiveBytes() - live_before << " bytes\n";
+
+  // The summary, with the sampled call sites, is also printed to std::cerr
+  // at exit.
+  return 0;
+}
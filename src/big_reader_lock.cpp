@@ -0,0 +1,272 @@
+/**
+ * @file big_reader_lock.cpp
+ * @brief Tutorial code for a reader-writer lock where readers do not share a
+ * cache line.
+ */
+
+// rwlock.cpp showed how to use std::shared_mutex as a reader-writer lock.
+// Readers can hold it at the same time, but to get there, every reader still
+// has to update the reader count inside the shared_mutex. That count lives in
+// one cache line, so with many readers on many cores, that cache line moves
+// from core to core on every lock_shared and unlock_shared, and read-only
+// code ends up waiting on the memory system.
+
+// A "big-reader lock" (brlock, from the Linux kernel) splits the reader count
+// into many slots, one cache line each, and each thread uses its own slot.
+// Taking the lock in shared mode only touches the thread's own slot and reads
+// a writer flag that rarely changes, so readers on different cores no longer
+// interfere with each other. The price is paid by writers: a writer has to
+// check every slot to know that all readers are gone. This is a good trade
+// for data that is read very often and written rarely, such as
+// configuration or a catalog of tables.
+
+// BigReaderLock provides the same lock, unlock, lock_shared and
+// unlock_shared methods as std::shared_mutex, so it works with
+// std::shared_lock, std::unique_lock and std::scoped_lock.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes the shared mutex library header.
+#include <shared_mutex>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the vector container library header.
+#include <vector>
+
+// Decides who goes first when a writer is waiting for readers to finish.
+enum class LockPreference {
+  // Once a writer is waiting, new readers wait for it. Writers can never be
+  // starved, but readers can be delayed by a steady stream of writers.
+  kWriter,
+  // A writer only gets in when there are no readers at all. Readers never
+  // wait for a waiting writer, but a steady stream of readers can starve
+  // writers.
+  kReader,
+};
+
+class BigReaderLock {
+ public:
+  explicit BigReaderLock(LockPreference preference = LockPreference::kWriter, size_t num_slots = 64)
+      : preference_(preference), slots_(num_slots) {}
+
+  // Takes the lock in shared (read) mode. The reader first announces itself
+  // in its slot, and then checks for a writer. A writer does the same in the
+  // opposite order: it announces itself with writer_, then checks the slots.
+  // Both use sequentially consistent operations, so at least one of them is
+  // guaranteed to see the other, and they can never both get in.
+  void lock_shared() {
+    std::atomic<int> &readers = MySlot();
+    while (true) {
+      readers.fetch_add(1);
+      if (!writer_.load()) {
+        return;
+      }
+      // A writer is active or waiting. Step back out of its way, and wait
+      // for it to finish before trying again.
+      readers.fetch_sub(1);
+      WaitWhile([this] { return writer_.load(); });
+    }
+  }
+
+  bool try_lock_shared() {
+    std::atomic<int> &readers = MySlot();
+    readers.fetch_add(1);
+    if (!writer_.load()) {
+      return true;
+    }
+    readers.fetch_sub(1);
+    return false;
+  }
+
+  void unlock_shared() { MySlot().fetch_sub(1, std::memory_order_release); }
+
+  // Takes the lock in exclusive (write) mode. writer_latch_ makes writers go
+  // one at a time, so only readers need to be waited for here.
+  void lock() {
+    writer_latch_.lock();
+    if (preference_ == LockPreference::kWriter) {
+      // Announce ourselves first, so that new readers hold back, then wait
+      // for the readers that are already inside.
+      writer_.store(true);
+      WaitWhile([this] { return HasReaders(); });
+      return;
+    }
+    // With reader preference, we only announce ourselves once there are no
+    // readers, and step back again if a reader slipped in at the same time.
+    while (true) {
+      WaitWhile([this] { return HasReaders(); });
+      writer_.store(true);
+      if (!HasReaders()) {
+        return;
+      }
+      writer_.store(false);
+    }
+  }
+
+  bool try_lock() {
+    if (!writer_latch_.try_lock()) {
+      return false;
+    }
+    writer_.store(true);
+    if (HasReaders()) {
+      writer_.store(false);
+      writer_latch_.unlock();
+      return false;
+    }
+    return true;
+  }
+
+  void unlock() {
+    writer_.store(false, std::memory_order_release);
+    writer_latch_.unlock();
+  }
+
+ private:
+  // Each slot takes a whole cache line, so that readers using different slots
+  // do not slow each other down (false sharing). A slot counts readers
+  // rather than being a flag, because threads share a slot when there are
+  // more threads than slots.
+  struct alignas(64) Slot {
+    std::atomic<int> readers_{0};
+  };
+
+  // Returns a small number that identifies the calling thread. Each thread
+  // gets the next number the first time it calls this function.
+  static size_t ThreadId() {
+    static std::atomic<size_t> next_id{0};
+    thread_local size_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  std::atomic<int> &MySlot() { return slots_[ThreadId() % slots_.size()].readers_; }
+
+  bool HasReaders() const {
+    for (const Slot &slot : slots_) {
+      if (slot.readers_.load() != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Waits until condition returns false. It spins briefly first, since locks
+  // are usually held for a short time, and then yields the CPU to other
+  // threads, which matters when there are more threads than cores.
+  template <typename Condition>
+  static void WaitWhile(Condition condition) {
+    for (int spins = 0; condition(); ++spins) {
+      if (spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  const LockPreference preference_;
+  std::vector<Slot> slots_;
+  // writer_ is read by every lock_shared call and only written by writers,
+  // so it gets its own cache line, which stays cached on every reader's core
+  // until a writer comes along.
+  alignas(64) std::atomic<bool> writer_{false};
+  std::mutex writer_latch_;
+};
+
+// Runs num_readers reader threads and one writer thread against a count
+// protected by the lock, in the read_value/write_value pattern from
+// rwlock.cpp. Each reader reads reads_per_thread times and the writer writes
+// writes times, adding 3 each time. It returns how many milliseconds it took,
+// and checks that the readers only ever saw multiples of 3.
+template <typename Lock>
+long long RunReadersAndWriter(Lock *lock, size_t num_readers, size_t reads_per_thread, size_t writes) {
+  int count = 0;
+  std::atomic<bool> torn{false};
+  auto read_value = [&] {
+    for (size_t i = 0; i < reads_per_thread; ++i) {
+      std::shared_lock lk(*lock);
+      if (count % 3 != 0) {
+        torn = true;
+      }
+    }
+  };
+  auto write_value = [&] {
+    for (size_t i = 0; i < writes; ++i) {
+      std::unique_lock lk(*lock);
+      // Two steps, so that a reader that got in at the same time as the
+      // writer would see a count that is not a multiple of 3.
+      count += 1;
+      count += 2;
+    }
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_readers; ++i) {
+    threads.emplace_back(read_value);
+  }
+  threads.emplace_back(write_value);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  long long ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if (torn || count != static_cast<int>(3 * writes)) {
+    std::cout << "The lock let a reader and a writer in at the same time!\n";
+  }
+  return ms;
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from rwlock.cpp with a BigReaderLock.
+  int count = 0;
+  BigReaderLock m;
+  auto read_value = [&] {
+    std::shared_lock lk(m);
+    std::cout << "Reading value " + std::to_string(count) + "\n" << std::flush;
+  };
+  auto write_value = [&] {
+    std::unique_lock lk(m);
+    count += 3;
+  };
+  std::thread t1(read_value);
+  std::thread t2(write_value);
+  std::thread t3(read_value);
+  std::thread t4(read_value);
+  std::thread t5(write_value);
+  std::thread t6(read_value);
+  t1.join();
+  t2.join();
+  t3.join();
+  t4.join();
+  t5.join();
+  t6.join();
+
+  // Now the benchmark. Each reader thread takes the read lock the number of
+  // times passed as the first argument, and one writer takes the write lock
+  // a thousand times less often in total.
+  size_t reads = argc > 1 ? std::stoul(argv[1]) : 100000;
+  size_t writes = reads / 1000 + 1;
+  std::cout << "Each reader reads " << reads << " times, and the writer writes " << writes
+            << " times (times in ms):\n";
+  std::cout << "readers  shared_mutex  brlock(writer)  brlock(reader)\n";
+  for (size_t num_readers = 1; num_readers <= 64; num_readers *= 2) {
+    std::shared_mutex shared_mutex;
+    BigReaderLock writer_preferred(LockPreference::kWriter);
+    BigReaderLock reader_preferred(LockPreference::kReader);
+    long long shared_ms = RunReadersAndWriter(&shared_mutex, num_readers, reads, writes);
+    long long writer_ms = RunReadersAndWriter(&writer_preferred, num_readers, reads, writes);
+    long long reader_ms = RunReadersAndWriter(&reader_preferred, num_readers, reads, writes);
+    std::cout << num_readers << "\t " << shared_ms << "\t\t" << writer_ms << "\t\t" << reader_ms << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,335 @@
+/**
+ * @file bloom_filter.cpp
+ * @brief Tutorial code for a cache-line-blocked Bloom filter in front of
+ * std::set and std::unordered_map lookups.
+ */
+
+// In sets.cpp and unordered_maps.cpp, every call to find walks the whole data
+// structure: a few levels of a tree, or a hash bucket and its chain. That is
+// true even when the key is not there at all. If most of your lookups are
+// misses (for example, checking whether a row ID has been deleted, or probing
+// a hash join with keys that mostly don't match), that work is wasted.
+
+// A Bloom filter is a compact bit array that answers "is this key in the
+// set?" with either "definitely not" or "maybe". To add a key, we hash it a
+// few times and set one bit per hash. To check a key, we look at the same
+// bits: if any of them is 0, the key was never added. If they are all 1, the
+// key is probably there, but the bits might have been set by other keys (a
+// false positive), so the caller still has to check the real structure.
+// There are never false negatives. Putting a filter in front of a set means
+// most misses are answered without touching the set at all.
+
+// A classic Bloom filter spreads a key's bits over the whole array, so one
+// check can cost several cache misses. A blocked Bloom filter first picks one
+// small block for the key and puts all of its bits there. This file uses the
+// "split block" design from Apache Parquet and Impala: each block is 256 bits,
+// split into eight 32-bit words, and a key sets exactly one bit in each word.
+// A check reads 32 bytes, which is half a cache line, and the eight bit
+// positions can be computed and tested with a handful of AVX2 instructions.
+
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::log, std::pow, std::exp, std::lgamma and std::sqrt.
+#include <cmath>
+// Includes fixed-width integer types like uint32_t and uint64_t.
+#include <cstdint>
+// Includes std::memcpy.
+#include <cstring>
+// Includes std::hash.
+#include <functional>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::mt19937 for generating random keys.
+#include <random>
+// Includes the set container library header.
+#include <set>
+// Includes std::invalid_argument and std::runtime_error.
+#include <stdexcept>
+// Includes std::string.
+#include <string>
+// Includes the unordered_map container library header.
+#include <unordered_map>
+// Includes the vector container library header.
+#include <vector>
+
+// The SIMD intrinsics are only available on x86 CPUs. On other CPUs (such as
+// Apple Silicon), we fall back to a plain loop over the eight words.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BLOOM_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+// The BlockedBloomFilter class is a split block Bloom filter. Keys are given
+// to it as 64-bit hashes; the upper 32 bits choose the block, and the lower
+// 32 bits choose the bit in each of the block's eight words.
+class BlockedBloomFilter {
+ public:
+  // A block is eight 32-bit words. The alignment makes sure that a block
+  // never straddles two cache lines.
+  struct alignas(32) Block {
+    uint32_t words_[8];
+  };
+
+  // Sizes the filter so that, after expected_keys keys have been added, the
+  // expected chance of a false positive is at most false_positive_rate.
+  //
+  // The Parquet specification for split block Bloom filters sizes them with
+  // the formula for a classic Bloom filter, as if every block got exactly the
+  // average number of keys. But keys are spread over blocks at random, so
+  // some blocks get more, and an overfull block has many more false
+  // positives than an underfull one has fewer. With that formula, a filter
+  // built for 1% comes out at about 1.4%. So we start from its estimate, and
+  // add blocks until ExpectedFalsePositiveRate, which accounts for the
+  // uneven spread, is low enough.
+  BlockedBloomFilter(size_t expected_keys, double false_positive_rate) {
+    if (expected_keys == 0 || false_positive_rate <= 0.0 || false_positive_rate >= 1.0) {
+      throw std::invalid_argument("BlockedBloomFilter: need expected_keys > 0 and 0 < false_positive_rate < 1");
+    }
+    double bits = -8.0 * static_cast<double>(expected_keys) / std::log(1.0 - std::pow(false_positive_rate, 1.0 / 8));
+    size_t num_blocks = static_cast<size_t>(bits / 256) + 1;
+    // The rate falls as blocks are added, so we can double until it is low
+    // enough, and then binary search between the last two sizes.
+    size_t too_few = num_blocks - 1;
+    while (ExpectedFalsePositiveRate(expected_keys, num_blocks) > false_positive_rate) {
+      too_few = num_blocks;
+      num_blocks *= 2;
+    }
+    while (num_blocks - too_few > 1) {
+      size_t mid = too_few + (num_blocks - too_few) / 2;
+      if (ExpectedFalsePositiveRate(expected_keys, mid) > false_positive_rate) {
+        too_few = mid;
+      } else {
+        num_blocks = mid;
+      }
+    }
+    blocks_.assign(num_blocks, Block{});
+  }
+
+  // The expected false positive rate of a filter with num_blocks blocks
+  // after num_keys keys have been added. The number of keys in a block
+  // follows a Poisson distribution with mean num_keys / num_blocks. A block
+  // with k keys has each bit of a word set with chance 1 - (31/32)^k, and a
+  // lookup in it is a false positive if all eight of its bits are set. We
+  // add those chances up over every k that is likely enough to matter.
+  static double ExpectedFalsePositiveRate(size_t num_keys, size_t num_blocks) {
+    double mean = static_cast<double>(num_keys) / static_cast<double>(num_blocks);
+    double spread = 10 * std::sqrt(mean) + 10;
+    size_t first = mean > spread ? static_cast<size_t>(mean - spread) : 0;
+    size_t last = static_cast<size_t>(mean + spread);
+    double rate = 0;
+    for (size_t k = first; k <= last; ++k) {
+      double kd = static_cast<double>(k);
+      // The Poisson probability of k, computed with logarithms so that it
+      // does not underflow when the mean is large.
+      double probability = std::exp(kd * std::log(mean) - mean - std::lgamma(kd + 1));
+      rate += probability * std::pow(1.0 - std::pow(31.0 / 32.0, kd), 8);
+    }
+    return rate;
+  }
+
+  // Adds a key, given its hash.
+  void Insert(uint64_t hash) {
+    Block &block = blocks_[BlockIndex(hash)];
+    uint32_t masks[8];
+    MakeMasks(static_cast<uint32_t>(hash), masks);
+    for (int i = 0; i < 8; ++i) {
+      block.words_[i] |= masks[i];
+    }
+  }
+
+  // Returns false if the key was definitely never added, and true if it may
+  // have been.
+  bool MayContain(uint64_t hash) const {
+    const Block &block = blocks_[BlockIndex(hash)];
+#ifdef BLOOM_HAS_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+      return MayContainAvx2(block, static_cast<uint32_t>(hash));
+    }
+#endif
+    uint32_t masks[8];
+    MakeMasks(static_cast<uint32_t>(hash), masks);
+    for (int i = 0; i < 8; ++i) {
+      if ((block.words_[i] & masks[i]) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Adds every key of another filter to this one. The two filters must have
+  // the same size, which is the case if they were created with the same
+  // arguments. Merging is a bitwise OR of the two bit arrays.
+  void Merge(const BlockedBloomFilter &other) {
+    if (other.blocks_.size() != blocks_.size()) {
+      throw std::invalid_argument("BlockedBloomFilter: cannot merge filters of different sizes");
+    }
+    for (size_t b = 0; b < blocks_.size(); ++b) {
+      for (int i = 0; i < 8; ++i) {
+        blocks_[b].words_[i] |= other.blocks_[b].words_[i];
+      }
+    }
+  }
+
+  // Serializes the filter as the number of blocks (a uint64_t) followed by the
+  // raw blocks, in the machine's byte order.
+  std::string Serialize() const {
+    uint64_t num_blocks = blocks_.size();
+    std::string out(sizeof(num_blocks) + num_blocks * sizeof(Block), '\0');
+    std::memcpy(&out[0], &num_blocks, sizeof(num_blocks));
+    std::memcpy(&out[sizeof(num_blocks)], blocks_.data(), num_blocks * sizeof(Block));
+    return out;
+  }
+
+  // Rebuilds a filter from the output of Serialize. It throws
+  // std::runtime_error if the data has the wrong length.
+  static BlockedBloomFilter Deserialize(const std::string &in) {
+    uint64_t num_blocks = 0;
+    if (in.size() < sizeof(num_blocks)) {
+      throw std::runtime_error("BlockedBloomFilter: serialized data is truncated");
+    }
+    std::memcpy(&num_blocks, in.data(), sizeof(num_blocks));
+    if (num_blocks == 0 || (in.size() - sizeof(num_blocks)) / sizeof(Block) != num_blocks
+        || (in.size() - sizeof(num_blocks)) % sizeof(Block) != 0) {
+      throw std::runtime_error("BlockedBloomFilter: serialized data has the wrong length");
+    }
+    BlockedBloomFilter filter;
+    filter.blocks_.resize(num_blocks);
+    std::memcpy(filter.blocks_.data(), in.data() + sizeof(num_blocks), num_blocks * sizeof(Block));
+    return filter;
+  }
+
+  size_t SizeInBytes() const { return blocks_.size() * sizeof(Block); }
+
+ private:
+  // Used by Deserialize, which fills in the blocks itself.
+  BlockedBloomFilter() = default;
+
+  // Odd constants used to derive eight bit positions from one 32-bit hash.
+  // They are the "salt" values from the Parquet specification.
+  static constexpr uint32_t kSalts[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                         0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+  // Maps the upper 32 bits of the hash onto [0, num_blocks) with a multiply
+  // and a shift, which is much cheaper than a modulo.
+  size_t BlockIndex(uint64_t hash) const { return static_cast<size_t>(((hash >> 32) * blocks_.size()) >> 32); }
+
+  // Each word gets the bit given by the top 5 bits of key * salt.
+  static void MakeMasks(uint32_t key, uint32_t masks[8]) {
+    for (int i = 0; i < 8; ++i) {
+      masks[i] = 1U << ((key * kSalts[i]) >> 27);
+    }
+  }
+
+#ifdef BLOOM_HAS_AVX2
+  // The same check as the scalar loop in MayContain, on all eight words at
+  // once: multiply by the salts, shift to get the bit numbers, shift 1 left by
+  // each bit number, and test that every one of those bits is set in the
+  // block. _mm256_testc_si256(a, b) returns 1 if every bit of b is set in a.
+  __attribute__((target("avx2"))) static bool MayContainAvx2(const Block &block, uint32_t key) {
+    const __m256i salts = _mm256_setr_epi32(kSalts[0], kSalts[1], kSalts[2], kSalts[3], kSalts[4], kSalts[5],
+                                            kSalts[6], kSalts[7]);
+    __m256i bit_numbers = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salts), 27);
+    __m256i masks = _mm256_sllv_epi32(_mm256_set1_epi32(1), bit_numbers);
+    __m256i words = _mm256_load_si256(reinterpret_cast<const __m256i *>(block.words_));
+    return _mm256_testc_si256(words, masks);
+  }
+#endif
+
+  std::vector<Block> blocks_;
+};
+
+// std::hash for integers is often the identity function, which would put
+// consecutive keys in consecutive blocks with almost the same bit patterns.
+// We run the result through the SplitMix64 finalizer to spread it out.
+template <typename T>
+uint64_t BloomHash(const T &key) {
+  uint64_t x = std::hash<T>{}(key);
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+int main() {
+  // First, we put a filter in front of the unordered map from
+  // unordered_maps.cpp. Every key goes into both the map and the filter.
+  std::unordered_map<std::string, int> map = {{"foo", 2}, {"jignesh", 445}, {"spam", 1}, {"eggs", 2}};
+  BlockedBloomFilter map_filter(map.size(), 0.01);
+  for (const auto &[key, value] : map) {
+    map_filter.Insert(BloomHash(key));
+  }
+
+  // A lookup checks the filter first, and only searches the map if the filter
+  // says the key might be there.
+  for (const std::string key : {"jignesh", "bacon", "spam", "garlic rice"}) {
+    if (!map_filter.MayContain(BloomHash(key))) {
+      std::cout << key << ": rejected by the Bloom filter without touching the map.\n";
+      continue;
+    }
+    auto it = map.find(key);
+    if (it != map.end()) {
+      std::cout << key << ": found in the map with value " << it->second << ".\n";
+    } else {
+      std::cout << key << ": false positive; the map does not contain it.\n";
+    }
+  }
+
+  // Now a larger example with a std::set<int>, as in sets.cpp. We insert one
+  // million even numbers, and then look up two million random numbers, most
+  // of which are not in the set.
+  constexpr int kNumKeys = 1000000;
+  constexpr int kNumProbes = 2000000;
+  std::mt19937 rng(445);
+  std::set<int> int_set;
+  BlockedBloomFilter filter(kNumKeys, 0.01);
+  for (int i = 0; i < kNumKeys; ++i) {
+    int key = static_cast<int>(rng() % (100 * kNumKeys)) * 2;
+    int_set.insert(key);
+    filter.Insert(BloomHash(key));
+  }
+  std::vector<int> probes(kNumProbes);
+  for (int &probe : probes) {
+    probe = static_cast<int>(rng() % (200 * kNumKeys));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t set_hits = 0;
+  for (int probe : probes) {
+    set_hits += int_set.find(probe) != int_set.end();
+  }
+  auto set_time = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  size_t filtered_hits = 0;
+  size_t maybes = 0;
+  for (int probe : probes) {
+    if (filter.MayContain(BloomHash(probe))) {
+      ++maybes;
+      filtered_hits += int_set.find(probe) != int_set.end();
+    }
+  }
+  auto filtered_time = std::chrono::steady_clock::now() - start;
+
+  std::cout << "Filter size: " << filter.SizeInBytes() / 1024 << " KB for " << int_set.size() << " keys.\n";
+  std::cout << "std::set only:          " << std::chrono::duration_cast<std::chrono::milliseconds>(set_time).count()
+            << " ms (" << set_hits << " hits)\n";
+  std::cout << "Bloom filter + std::set: "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(filtered_time).count() << " ms ("
+            << filtered_hits << " hits, " << maybes - filtered_hits << " false positives, measured rate "
+            << static_cast<double>(maybes - filtered_hits) / static_cast<double>(kNumProbes - filtered_hits)
+            << ")\n";
+
+  // Filters built separately (for example, one per thread or per partition)
+  // can be merged, and a filter can be saved and loaded again.
+  BlockedBloomFilter left(1000, 0.01);
+  BlockedBloomFilter right(1000, 0.01);
+  left.Insert(BloomHash(15));
+  right.Insert(BloomHash(445));
+  left.Merge(right);
+  BlockedBloomFilter restored = BlockedBloomFilter::Deserialize(left.Serialize());
+  std::cout << "After merging and reloading, the filter "
+            << (restored.MayContain(BloomHash(15)) && restored.MayContain(BloomHash(445)) ? "contains" : "is missing")
+            << " both 15 and 445.\n";
+
+  return 0;
+}
@@ -0,0 +1,686 @@
+/**
+ * @file bplus_tree.cpp
+ * @brief Tutorial code for an in-memory B+ tree ordered map and set.
+ */
+
+// In sets.cpp, we used std::set<int>, which is usually a red-black tree. A
+// red-black tree stores one key per node, and every node is a separate heap
+// allocation holding the key, three pointers and a color. For an int set,
+// that is roughly 40 bytes of memory for 4 bytes of key, and every step of a
+// lookup jumps to a new node somewhere else in memory, which is very likely a
+// cache miss.
+
+// A B+ tree stores many keys per node instead. Inner nodes hold only
+// separator keys and child pointers, and all of the actual entries live in
+// the leaves. Since a node holds dozens of keys in a contiguous array, a
+// lookup touches a few cache lines per level, and the tree is only three or
+// four levels deep even for tens of millions of keys. The leaves are also
+// linked together in key order, so a range scan just walks from one leaf to
+// the next without going back up the tree. You will see B+ trees again in
+// 15-445/645, where they are the most common index structure in databases.
+
+// This file implements a B+ tree map with the operations that sets.cpp shows
+// for std::set: insert, find, erase of one key, and erase of a range of keys.
+// It also supports building a tree directly from sorted input (bulk loading),
+// which is far faster than inserting keys one at a time. main ends with a
+// benchmark against std::set.
+
+// To keep the code short, the tree does not merge nodes that become less than
+// half full after an erase. Nodes that become completely empty are removed,
+// so lookups stay correct; the tree just may use a bit more memory than
+// necessary after many erases.
+
+// Includes std::max, std::move (for arrays) and std::shuffle.
+#include <algorithm>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::iota.
+#include <numeric>
+// Includes std::mt19937 for generating random keys.
+#include <random>
+// Includes the set container library header for the benchmark.
+#include <set>
+// Includes std::invalid_argument.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes std::pair.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// An empty value type, used to turn the map into a set.
+struct Empty {};
+
+// The BPlusTreeMap class is an ordered map from keys of type K to values of
+// type V. Keys must be default-constructible and comparable with operator<.
+template <typename K, typename V>
+class BPlusTreeMap {
+ public:
+  // Node capacities are chosen so that the keys of a node fill about four
+  // cache lines (256 bytes). For int keys, that is 64 keys per node.
+  static constexpr int kLeafCapacity = std::max<int>(8, 256 / sizeof(K));
+  static constexpr int kMaxChildren = std::max<int>(8, 256 / sizeof(K));
+
+ private:
+  // Every node starts with this header. For leaves, count_ is the number of
+  // keys. For inner nodes, count_ is the number of children, and there is
+  // one fewer separator key than children. A node is empty if count_ is 0.
+  struct Node {
+    bool is_leaf_;
+    int count_{0};
+  };
+
+  // keys_[i] is the smallest key that can appear in children_[i + 1], so
+  // children_[i] holds keys in the range [keys_[i - 1], keys_[i]).
+  struct alignas(64) Inner : Node {
+    K keys_[kMaxChildren - 1];
+    Node *children_[kMaxChildren];
+  };
+
+  // Leaves are linked in both directions so that a leaf can be unlinked from
+  // the list in O(1) time when it is removed.
+  struct alignas(64) Leaf : Node {
+    K keys_[kLeafCapacity];
+    V values_[kLeafCapacity];
+    Leaf *prev_{nullptr};
+    Leaf *next_{nullptr};
+  };
+
+ public:
+  // The Iterator class walks the entries in key order by following the leaf
+  // links. Dereferencing it gives the key; Value() gives the value.
+  class Iterator {
+   public:
+    Iterator(Leaf *leaf, int index) : leaf_(leaf), index_(index) {}
+    const K &operator*() const { return leaf_->keys_[index_]; }
+    V &Value() const { return leaf_->values_[index_]; }
+    Iterator &operator++() {
+      if (++index_ == leaf_->count_) {
+        leaf_ = leaf_->next_;
+        index_ = 0;
+      }
+      return *this;
+    }
+    bool operator==(const Iterator &other) const { return leaf_ == other.leaf_ && index_ == other.index_; }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+   private:
+    Leaf *leaf_;
+    int index_;
+  };
+
+  BPlusTreeMap() = default;
+  ~BPlusTreeMap() { Clear(); }
+
+  // We delete the copy constructor and the copy assignment operator, since the
+  // tree owns its nodes (see wrapper_class.cpp).
+  BPlusTreeMap(const BPlusTreeMap &) = delete;
+  BPlusTreeMap &operator=(const BPlusTreeMap &) = delete;
+
+  // Inserts a key-value pair, or overwrites the value if the key is already
+  // present. It returns true if a new key was inserted.
+  bool Insert(const K &key, const V &value = V{}) {
+    if (root_ == nullptr) {
+      Leaf *leaf = NewLeaf();
+      root_ = leaf;
+      head_ = leaf;
+      tail_ = leaf;
+    }
+    K split_key;
+    Node *split_node = nullptr;
+    bool inserted = InsertInto(root_, key, value, &split_key, &split_node);
+    if (split_node != nullptr) {
+      // The root split, so the tree grows one level taller.
+      Inner *new_root = NewInner();
+      new_root->children_[0] = root_;
+      new_root->children_[1] = split_node;
+      new_root->keys_[0] = split_key;
+      new_root->count_ = 2;
+      root_ = new_root;
+    }
+    size_ += inserted ? 1 : 0;
+    return inserted;
+  }
+
+  // Looks up a key. It returns a pointer to the value if the key is present,
+  // and nullptr otherwise.
+  V *Find(const K &key) const {
+    if (root_ == nullptr) {
+      return nullptr;
+    }
+    Leaf *leaf = FindLeaf(key);
+    int pos = LeafLowerBound(leaf, key);
+    if (pos < leaf->count_ && !(key < leaf->keys_[pos])) {
+      return &leaf->values_[pos];
+    }
+    return nullptr;
+  }
+
+  bool Contains(const K &key) const { return Find(key) != nullptr; }
+
+  // Returns an iterator to the first key that is not less than `key`.
+  Iterator LowerBound(const K &key) const {
+    if (root_ == nullptr) {
+      return end();
+    }
+    Leaf *leaf = FindLeaf(key);
+    int pos = LeafLowerBound(leaf, key);
+    if (pos == leaf->count_) {
+      return Iterator(leaf->next_, 0);
+    }
+    return Iterator(leaf, pos);
+  }
+
+  Iterator begin() const { return Iterator(head_, 0); }
+  Iterator end() const { return Iterator(nullptr, 0); }
+
+  // Removes a single key. It returns whether the key was present.
+  bool Erase(const K &key) {
+    if (root_ == nullptr) {
+      return false;
+    }
+    // We remember the path from the root, so that we can remove nodes that
+    // become empty on the way back up.
+    std::vector<std::pair<Inner *, int>> path;
+    Node *node = root_;
+    while (!node->is_leaf_) {
+      Inner *inner = static_cast<Inner *>(node);
+      int index = ChildIndex(inner, key);
+      path.emplace_back(inner, index);
+      node = inner->children_[index];
+    }
+    Leaf *leaf = static_cast<Leaf *>(node);
+    int pos = LeafLowerBound(leaf, key);
+    if (pos == leaf->count_ || key < leaf->keys_[pos]) {
+      return false;
+    }
+    std::move(leaf->keys_ + pos + 1, leaf->keys_ + leaf->count_, leaf->keys_ + pos);
+    std::move(leaf->values_ + pos + 1, leaf->values_ + leaf->count_, leaf->values_ + pos);
+    --leaf->count_;
+    --size_;
+
+    // Remove empty nodes, from the leaf upwards.
+    while (node->count_ == 0 && !path.empty()) {
+      auto [parent, index] = path.back();
+      path.pop_back();
+      FreeSubtree(node);
+      RemoveChild(parent, index);
+      node = parent;
+    }
+    ShrinkRoot();
+    return true;
+  }
+
+  // Removes every key in the range [lo, hi). This is the B+ tree version of
+  // `int_set.erase(int_set.find(lo), int_set.find(hi))`. Subtrees and leaves
+  // that lie completely inside the range are freed as a whole, without
+  // looking at their keys one by one.
+  size_t EraseRange(const K &lo, const K &hi) { return EraseRangeImpl(lo, &hi); }
+
+  // Removes every key that is not less than `lo`. This is the B+ tree version
+  // of `int_set.erase(int_set.find(lo), int_set.end())` in sets.cpp.
+  size_t EraseFrom(const K &lo) { return EraseRangeImpl(lo, nullptr); }
+
+  // Builds the tree from keys and values that are already sorted by key, with
+  // no duplicates. Instead of inserting the entries one at a time, we fill
+  // the leaves from left to right, and then build each level of inner nodes
+  // on top of the one below. fill_factor controls how full the leaves are;
+  // leaving some room makes later inserts cheaper. It must be in (0, 1], or
+  // std::invalid_argument is thrown and the tree is left unchanged.
+  template <typename Iter>
+  void BulkLoad(Iter first, Iter last, double fill_factor = 1.0) {
+    // Written this way round so that NaN is rejected too.
+    if (!(fill_factor > 0.0 && fill_factor <= 1.0)) {
+      throw std::invalid_argument("BulkLoad needs a fill_factor in (0, 1]");
+    }
+    Clear();
+    int per_leaf = std::max(1, static_cast<int>(kLeafCapacity * fill_factor));
+    std::vector<Node *> level;
+    std::vector<K> level_min_keys;
+    Leaf *prev = nullptr;
+    while (first != last) {
+      Leaf *leaf = NewLeaf();
+      for (; first != last && leaf->count_ < per_leaf; ++first) {
+        leaf->keys_[leaf->count_] = first->first;
+        leaf->values_[leaf->count_] = first->second;
+        ++leaf->count_;
+        ++size_;
+      }
+      leaf->prev_ = prev;
+      if (prev != nullptr) {
+        prev->next_ = leaf;
+      } else {
+        head_ = leaf;
+      }
+      prev = leaf;
+      level.push_back(leaf);
+      level_min_keys.push_back(leaf->keys_[0]);
+    }
+    tail_ = prev;
+
+    // Build inner levels until only the root is left.
+    while (level.size() > 1) {
+      std::vector<Node *> parents;
+      std::vector<K> parent_min_keys;
+      for (size_t i = 0; i < level.size(); i += kMaxChildren) {
+        Inner *inner = NewInner();
+        size_t end = std::min(level.size(), i + kMaxChildren);
+        for (size_t j = i; j < end; ++j) {
+          if (j > i) {
+            inner->keys_[inner->count_ - 1] = level_min_keys[j];
+          }
+          inner->children_[inner->count_++] = level[j];
+        }
+        parents.push_back(inner);
+        parent_min_keys.push_back(level_min_keys[i]);
+      }
+      level = std::move(parents);
+      level_min_keys = std::move(parent_min_keys);
+    }
+    root_ = level.empty() ? nullptr : level[0];
+  }
+
+  // Removes every entry and frees every node.
+  void Clear() {
+    if (root_ != nullptr) {
+      FreeSubtree(root_);
+    }
+    root_ = nullptr;
+    size_ = 0;
+  }
+
+  // Getter functions.
+  size_t Size() const { return size_; }
+  size_t MemoryUsage() const { return num_leaves_ * sizeof(Leaf) + num_inners_ * sizeof(Inner); }
+
+ private:
+  Leaf *NewLeaf() {
+    ++num_leaves_;
+    Leaf *leaf = new Leaf;
+    leaf->is_leaf_ = true;
+    return leaf;
+  }
+
+  Inner *NewInner() {
+    ++num_inners_;
+    Inner *inner = new Inner;
+    inner->is_leaf_ = false;
+    return inner;
+  }
+
+  // Returns the index of the child whose range contains `key`, which is the
+  // number of separator keys that are less than or equal to `key`. Instead
+  // of a binary search, we compare against every key in the node and add up
+  // the results. This has no unpredictable branches, the compiler can turn
+  // it into SIMD instructions, and the keys are all in a few cache lines.
+  static int ChildIndex(const Inner *inner, const K &key) {
+    int index = 0;
+    for (int i = 0; i < inner->count_ - 1; ++i) {
+      index += !(key < inner->keys_[i]);
+    }
+    return index;
+  }
+
+  // Returns the position of the first key in the leaf that is not less than
+  // `key`, using the same counting trick as ChildIndex.
+  static int LeafLowerBound(const Leaf *leaf, const K &key) {
+    int pos = 0;
+    for (int i = 0; i < leaf->count_; ++i) {
+      pos += leaf->keys_[i] < key;
+    }
+    return pos;
+  }
+
+  Leaf *FindLeaf(const K &key) const {
+    Node *node = root_;
+    while (!node->is_leaf_) {
+      Inner *inner = static_cast<Inner *>(node);
+      node = inner->children_[ChildIndex(inner, key)];
+    }
+    return static_cast<Leaf *>(node);
+  }
+
+  // Inserts into the subtree rooted at `node`. If the node had to split, the
+  // new right sibling is returned through *split_node, and the smallest key
+  // it can hold through *split_key, so that the caller can add it.
+  bool InsertInto(Node *node, const K &key, const V &value, K *split_key, Node **split_node) {
+    if (node->is_leaf_) {
+      Leaf *leaf = static_cast<Leaf *>(node);
+      int pos = LeafLowerBound(leaf, key);
+      if (pos < leaf->count_ && !(key < leaf->keys_[pos])) {
+        leaf->values_[pos] = value;
+        return false;
+      }
+      if (leaf->count_ < kLeafCapacity) {
+        InsertIntoLeaf(leaf, pos, key, value);
+        return true;
+      }
+
+      // The leaf is full. Move its upper half into a new leaf, link the new
+      // leaf in after this one, and insert into whichever half fits.
+      Leaf *right = NewLeaf();
+      int mid = kLeafCapacity / 2;
+      std::move(leaf->keys_ + mid, leaf->keys_ + kLeafCapacity, right->keys_);
+      std::move(leaf->values_ + mid, leaf->values_ + kLeafCapacity, right->values_);
+      right->count_ = kLeafCapacity - mid;
+      leaf->count_ = mid;
+      right->next_ = leaf->next_;
+      right->prev_ = leaf;
+      if (leaf->next_ != nullptr) {
+        leaf->next_->prev_ = right;
+      } else {
+        tail_ = right;
+      }
+      leaf->next_ = right;
+      if (pos < mid) {
+        InsertIntoLeaf(leaf, pos, key, value);
+      } else {
+        InsertIntoLeaf(right, pos - mid, key, value);
+      }
+      *split_key = right->keys_[0];
+      *split_node = right;
+      return true;
+    }
+
+    Inner *inner = static_cast<Inner *>(node);
+    int index = ChildIndex(inner, key);
+    K child_split_key;
+    Node *child_split_node = nullptr;
+    bool inserted = InsertInto(inner->children_[index], key, value, &child_split_key, &child_split_node);
+    if (child_split_node == nullptr) {
+      return inserted;
+    }
+    if (inner->count_ < kMaxChildren) {
+      InsertIntoInner(inner, index, child_split_key, child_split_node);
+      return inserted;
+    }
+
+    // This inner node is full too. Its left half keeps children [0, mid),
+    // the right half gets children [mid, kMaxChildren), and the separator
+    // between them moves up to the parent.
+    Inner *right = NewInner();
+    int mid = kMaxChildren / 2;
+    *split_key = inner->keys_[mid - 1];
+    std::move(inner->keys_ + mid, inner->keys_ + kMaxChildren - 1, right->keys_);
+    std::move(inner->children_ + mid, inner->children_ + kMaxChildren, right->children_);
+    right->count_ = kMaxChildren - mid;
+    inner->count_ = mid;
+    if (index < mid) {
+      InsertIntoInner(inner, index, child_split_key, child_split_node);
+    } else {
+      InsertIntoInner(right, index - mid, child_split_key, child_split_node);
+    }
+    *split_node = right;
+    return inserted;
+  }
+
+  static void InsertIntoLeaf(Leaf *leaf, int pos, const K &key, const V &value) {
+    std::move_backward(leaf->keys_ + pos, leaf->keys_ + leaf->count_, leaf->keys_ + leaf->count_ + 1);
+    std::move_backward(leaf->values_ + pos, leaf->values_ + leaf->count_, leaf->values_ + leaf->count_ + 1);
+    leaf->keys_[pos] = key;
+    leaf->values_[pos] = value;
+    ++leaf->count_;
+  }
+
+  // Adds `child` right after children_[index], with `key` as the separator
+  // between them.
+  static void InsertIntoInner(Inner *inner, int index, const K &key, Node *child) {
+    std::move_backward(inner->keys_ + index, inner->keys_ + inner->count_ - 1, inner->keys_ + inner->count_);
+    std::move_backward(inner->children_ + index + 1, inner->children_ + inner->count_,
+                       inner->children_ + inner->count_ + 1);
+    inner->keys_[index] = key;
+    inner->children_[index + 1] = child;
+    ++inner->count_;
+  }
+
+  // Removes children_[index] from an inner node (the child itself must be
+  // freed separately). Removing the separator to the child's left keeps the
+  // remaining separators valid: the one to its right now separates its two
+  // former neighbors. The first child has no separator to its left, so we
+  // remove the one to its right instead.
+  static void RemoveChild(Inner *inner, int index) {
+    if (inner->count_ > 1) {
+      int key_index = index > 0 ? index - 1 : 0;
+      std::move(inner->keys_ + key_index + 1, inner->keys_ + inner->count_ - 1, inner->keys_ + key_index);
+    }
+    std::move(inner->children_ + index + 1, inner->children_ + inner->count_, inner->children_ + index);
+    --inner->count_;
+  }
+
+  // After erasing, the root may have been left with a single child (or no
+  // children at all). In that case, the tree becomes one level shorter.
+  void ShrinkRoot() {
+    while (root_ != nullptr && !root_->is_leaf_ && root_->count_ <= 1) {
+      Inner *old_root = static_cast<Inner *>(root_);
+      root_ = old_root->count_ == 1 ? old_root->children_[0] : nullptr;
+      old_root->count_ = 0;
+      FreeSubtree(old_root);
+    }
+    if (root_ != nullptr && root_->count_ == 0) {
+      FreeSubtree(root_);
+      root_ = nullptr;
+    }
+  }
+
+  // Frees a node and everything below it, unlinking each freed leaf from the
+  // leaf list. It returns the number of keys that were in the subtree.
+  size_t FreeSubtree(Node *node) {
+    if (node->is_leaf_) {
+      Leaf *leaf = static_cast<Leaf *>(node);
+      (leaf->prev_ != nullptr ? leaf->prev_->next_ : head_) = leaf->next_;
+      (leaf->next_ != nullptr ? leaf->next_->prev_ : tail_) = leaf->prev_;
+      size_t count = leaf->count_;
+      --num_leaves_;
+      delete leaf;
+      return count;
+    }
+    Inner *inner = static_cast<Inner *>(node);
+    size_t count = 0;
+    for (int i = 0; i < inner->count_; ++i) {
+      count += FreeSubtree(inner->children_[i]);
+    }
+    --num_inners_;
+    delete inner;
+    return count;
+  }
+
+  size_t EraseRangeImpl(const K &lo, const K *hi) {
+    if (root_ == nullptr || (hi != nullptr && !(lo < *hi))) {
+      return 0;
+    }
+    size_t erased = EraseRangeIn(root_, lo, hi, nullptr, nullptr);
+    size_ -= erased;
+    ShrinkRoot();
+    return erased;
+  }
+
+  // Erases the keys in [lo, hi) from the subtree rooted at `node`, whose keys
+  // are known to lie in [node_lo, node_hi). A null bound means unbounded.
+  size_t EraseRangeIn(Node *node, const K &lo, const K *hi, const K *node_lo, const K *node_hi) {
+    if (node->is_leaf_) {
+      Leaf *leaf = static_cast<Leaf *>(node);
+      int first = LeafLowerBound(leaf, lo);
+      int last = hi == nullptr ? leaf->count_ : LeafLowerBound(leaf, *hi);
+      std::move(leaf->keys_ + last, leaf->keys_ + leaf->count_, leaf->keys_ + first);
+      std::move(leaf->values_ + last, leaf->values_ + leaf->count_, leaf->values_ + first);
+      leaf->count_ -= last - first;
+      return last - first;
+    }
+
+    // First decide what to do with each child, using the separators as they
+    // are before we change anything. A child is either untouched, dropped as
+    // a whole, or partially erased by recursing into it.
+    Inner *inner = static_cast<Inner *>(node);
+    size_t erased = 0;
+    bool drop[kMaxChildren];
+    for (int i = 0; i < inner->count_; ++i) {
+      const K *child_lo = i == 0 ? node_lo : &inner->keys_[i - 1];
+      const K *child_hi = i == inner->count_ - 1 ? node_hi : &inner->keys_[i];
+      bool below = child_hi != nullptr && !(lo < *child_hi);
+      bool above = hi != nullptr && child_lo != nullptr && !(*child_lo < *hi);
+      bool inside = child_lo != nullptr && !(*child_lo < lo)
+                    && (hi == nullptr || (child_hi != nullptr && !(*hi < *child_hi)));
+      drop[i] = inside;
+      if (!below && !above && !inside) {
+        erased += EraseRangeIn(inner->children_[i], lo, hi, child_lo, child_hi);
+        drop[i] = inner->children_[i]->count_ == 0;
+      }
+    }
+
+    // Then free the dropped and emptied children, from right to left.
+    for (int i = inner->count_ - 1; i >= 0; --i) {
+      if (drop[i]) {
+        erased += FreeSubtree(inner->children_[i]);
+        RemoveChild(inner, i);
+      }
+    }
+    return erased;
+  }
+
+  Node *root_{nullptr};
+  Leaf *head_{nullptr};
+  Leaf *tail_{nullptr};
+  size_t size_{0};
+  size_t num_leaves_{0};
+  size_t num_inners_{0};
+};
+
+// A B+ tree set is simply a B+ tree map whose values are empty.
+template <typename K>
+using BPlusTreeSet = BPlusTreeMap<K, Empty>;
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the std::set example from sets.cpp with a B+ tree set.
+  BPlusTreeSet<int> int_set;
+  for (int i = 1; i <= 10; ++i) {
+    int_set.Insert(i);
+  }
+
+  if (int_set.Contains(5)) {
+    std::cout << "Element 5 is in the set." << std::endl;
+  }
+
+  int_set.Erase(5);
+  if (!int_set.Contains(5)) {
+    std::cout << "Element 5 is not in the set." << std::endl;
+  }
+
+  // This is the equivalent of int_set.erase(int_set.find(9), int_set.end()).
+  int_set.EraseFrom(9);
+  std::cout << "Printing the elements of the B+ tree set:\n";
+  for (BPlusTreeSet<int>::Iterator it = int_set.begin(); it != int_set.end(); ++it) {
+    std::cout << *it << " ";
+  }
+  std::cout << "\n";
+
+  // A B+ tree map works the same way, but also stores a value per key. Range
+  // scans start at LowerBound and follow the leaf links.
+  BPlusTreeMap<int, int> map;
+  for (int i = 0; i < 1000; ++i) {
+    map.Insert(i, i * i);
+  }
+  long long squares = 0;
+  for (auto it = map.LowerBound(10); it != map.end() && *it < 20; ++it) {
+    squares += it.Value();
+  }
+  std::cout << "Sum of the squares of 10 through 19: " << squares << "\n";
+
+  // Now the benchmark. The number of keys can be passed as the first
+  // argument, and defaults to ten million.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 10000000;
+  std::vector<int> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937 rng(445);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  std::cout << "Benchmarking with " << n << " keys:\n";
+
+  std::set<int> std_set;
+  BPlusTreeSet<int> tree;
+  long long std_ms = TimeMs([&] {
+    for (int key : keys) {
+      std_set.insert(key);
+    }
+  });
+  long long tree_ms = TimeMs([&] {
+    for (int key : keys) {
+      tree.Insert(key);
+    }
+  });
+  std::cout << "Random inserts:   std::set " << std_ms << " ms, B+ tree " << tree_ms << " ms\n";
+
+  // Two thirds of these lookups hit, and one third miss.
+  size_t std_hits = 0;
+  size_t tree_hits = 0;
+  std_ms = TimeMs([&] {
+    for (int key : keys) {
+      std_hits += std_set.count(key / 2 * 3);
+    }
+  });
+  tree_ms = TimeMs([&] {
+    for (int key : keys) {
+      tree_hits += tree.Contains(key / 2 * 3);
+    }
+  });
+  std::cout << "Random finds:     std::set " << std_ms << " ms, B+ tree " << tree_ms << " ms (hits " << std_hits
+            << " vs " << tree_hits << ")\n";
+
+  long long std_sum = 0;
+  long long tree_sum = 0;
+  std_ms = TimeMs([&] {
+    for (int key : std_set) {
+      std_sum += key;
+    }
+  });
+  tree_ms = TimeMs([&] {
+    for (int key : tree) {
+      tree_sum += key;
+    }
+  });
+  std::cout << "Full scan:        std::set " << std_ms << " ms, B+ tree " << tree_ms << " ms (sums " << std_sum
+            << " vs " << tree_sum << ")\n";
+
+  // Each std::set node holds the key, three pointers and a color, and malloc
+  // adds its own header, so this is a lower bound on what std::set uses.
+  std::cout << "Memory:           std::set at least " << n * 40 / (1024 * 1024) << " MB, B+ tree "
+            << tree.MemoryUsage() / (1024 * 1024) << " MB\n";
+
+  int mid = static_cast<int>(n / 2);
+  std_ms = TimeMs([&] { std_set.erase(std_set.find(mid), std_set.end()); });
+  tree_ms = TimeMs([&] { tree.EraseFrom(mid); });
+  std::cout << "Erase upper half: std::set " << std_ms << " ms, B+ tree " << tree_ms << " ms (sizes "
+            << std_set.size() << " vs " << tree.Size() << ")\n";
+
+  // Finally, build both structures from sorted input. std::set's range
+  // constructor is already linear for sorted input, but it still allocates
+  // one node per key.
+  std::vector<int> sorted_keys(n);
+  std::iota(sorted_keys.begin(), sorted_keys.end(), 0);
+  std::vector<std::pair<int, Empty>> sorted_entries(n);
+  for (size_t i = 0; i < n; ++i) {
+    sorted_entries[i].first = sorted_keys[i];
+  }
+  std::set<int> loaded_set;
+  BPlusTreeSet<int> loaded_tree;
+  std_ms = TimeMs([&] { loaded_set = std::set<int>(sorted_keys.begin(), sorted_keys.end()); });
+  tree_ms = TimeMs([&] { loaded_tree.BulkLoad(sorted_entries.begin(), sorted_entries.end()); });
+  std::cout << "Bulk load:        std::set " << std_ms << " ms, B+ tree " << tree_ms << " ms\n";
+  try {
+    loaded_tree.BulkLoad(sorted_entries.begin(), sorted_entries.end(), 1.5);
+  } catch (const std::invalid_argument &e) {
+    std::cout << "Caught: " << e.what() << " (the tree still has " << loaded_tree.Size() << " keys)\n";
+  }
+
+  return 0;
+}
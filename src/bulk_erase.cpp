@@ -0,0 +1,250 @@
+/**
+ * @file bulk_erase.cpp
+ * @brief Tutorial code for erasing many elements from a vector in a single
+ * pass, optionally with several threads.
+ */
+
+// In vectors.cpp, we erased elements one position at a time with
+// int_vector.erase(int_vector.begin() + 2). Erasing one element moves every
+// element after it one slot to the left, so it costs O(n). Erasing k elements
+// this way costs O(n * k), which gets slow very quickly: erasing 10% of a
+// vector with a million elements moves about 50 billion elements in total.
+
+// The fix is to do all of the erasing in one pass. We walk the vector once
+// with two positions: a read position that visits every element, and a write
+// position where the next element we keep goes. Every kept element is moved
+// at most once, so the whole operation is O(n), no matter how many elements
+// are erased. This is what the erase-remove idiom (std::remove_if followed
+// by erase) from vectors.cpp does for predicates. In this file, we also
+// provide the same for a sorted list of positions, and a multithreaded
+// version for very large vectors.
+
+// Includes std::min and std::is_sorted.
+#include <algorithm>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::invalid_argument.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes std::thread for the parallel version.
+#include <thread>
+// Includes std::move.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// Erases the elements at the given positions. The positions must be sorted in
+// increasing order, without duplicates, and all less than vector->size();
+// otherwise this throws std::invalid_argument and leaves the vector
+// unchanged. The remaining elements keep their order.
+template <typename T>
+void EraseIndices(std::vector<T> *vector, const std::vector<size_t> &indices) {
+  for (size_t i = 0; i < indices.size(); ++i) {
+    if (indices[i] >= vector->size() || (i > 0 && indices[i] <= indices[i - 1])) {
+      throw std::invalid_argument("EraseIndices needs sorted, unique, in-range positions");
+    }
+  }
+  if (indices.empty()) {
+    return;
+  }
+  // Everything before the first erased position stays where it is. After
+  // that, each run of kept elements between two erased positions is moved
+  // left in one std::move call.
+  auto write = vector->begin() + indices[0];
+  for (size_t i = 0; i < indices.size(); ++i) {
+    auto run_begin = vector->begin() + indices[i] + 1;
+    auto run_end = i + 1 < indices.size() ? vector->begin() + indices[i + 1] : vector->end();
+    write = std::move(run_begin, run_end, write);
+  }
+  vector->erase(write, vector->end());
+}
+
+// Moves the elements of [begin, end) for which pred returns false to the
+// front of the range, keeping their order, and returns the new end.
+template <typename Iter, typename Pred>
+Iter CompactRange(Iter begin, Iter end, Pred &pred) {
+  Iter write = begin;
+  for (Iter read = begin; read != end; ++read) {
+    if (!pred(*read)) {
+      if (write != read) {
+        *write = std::move(*read);
+      }
+      ++write;
+    }
+  }
+  return write;
+}
+
+// Erases every element for which pred returns true, in one pass. The
+// remaining elements keep their order. It returns the number of erased
+// elements.
+template <typename T, typename Pred>
+size_t EraseIf(std::vector<T> *vector, Pred pred) {
+  size_t old_size = vector->size();
+  vector->erase(CompactRange(vector->begin(), vector->end(), pred), vector->end());
+  return old_size - vector->size();
+}
+
+// Vectors shorter than this are handled by EraseIf, because starting threads
+// takes longer than erasing from a small vector.
+constexpr size_t kParallelEraseThreshold = 1 << 16;
+
+// Like EraseIf, but splits the vector into one block per thread. pred is
+// called from several threads at once, so it must be safe to call
+// concurrently.
+//
+// The work happens in two phases:
+// 1. Each thread compacts its own block, exactly like EraseIf. The blocks do
+//    not overlap, so the threads never touch the same elements. This phase
+//    calls pred on every element, and is where most of the time goes.
+// 2. The kept part of each block is moved left to sit right after the kept
+//    part of the previous block. This is done by the calling thread, because
+//    the destination of one block can overlap the source of an earlier one.
+//    It only moves the kept elements, once each.
+template <typename T, typename Pred>
+size_t ParallelEraseIf(std::vector<T> *vector, Pred pred, size_t num_threads = std::thread::hardware_concurrency()) {
+  size_t n = vector->size();
+  if (num_threads <= 1 || n < kParallelEraseThreshold) {
+    return EraseIf(vector, pred);
+  }
+  size_t block_size = (n + num_threads - 1) / num_threads;
+  size_t num_blocks = (n + block_size - 1) / block_size;
+  std::vector<size_t> kept(num_blocks);
+  auto compact_block = [&](size_t block) {
+    auto begin = vector->begin() + block * block_size;
+    auto end = vector->begin() + std::min(n, (block + 1) * block_size);
+    kept[block] = CompactRange(begin, end, pred) - begin;
+  };
+  std::vector<std::thread> threads;
+  for (size_t block = 1; block < num_blocks; ++block) {
+    threads.emplace_back(compact_block, block);
+  }
+  // The calling thread compacts the first block instead of just waiting.
+  compact_block(0);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // The first block's kept elements are already in place.
+  auto write = vector->begin() + kept[0];
+  for (size_t block = 1; block < num_blocks; ++block) {
+    auto begin = vector->begin() + block * block_size;
+    // If every earlier block kept all its elements, this block is already in
+    // place. std::move must not be called then, since its destination may
+    // not start inside its source range.
+    if (write == begin) {
+      write += kept[block];
+    } else {
+      write = std::move(begin, begin + kept[block], write);
+    }
+  }
+  vector->erase(write, vector->end());
+  return n - vector->size();
+}
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A row of a table, as in a database. Deleted rows are marked with a
+// tombstone and cleaned up later in bulk.
+struct Row {
+  int id_;
+  bool deleted_;
+  std::string name_;
+};
+
+// Checks that two tables hold the same rows, names included.
+bool SameRows(const std::vector<Row> &a, const std::vector<Row> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].id_ != b[i].id_ || a[i].name_ != b[i].name_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  // We erase the elements at positions 1, 2 and 4 from the vector in
+  // vectors.cpp's style, but in a single pass.
+  std::vector<int> int_vector = {0, 1, 2, 3, 4, 5, 6};
+  EraseIndices(&int_vector, {1, 2, 4});
+  std::cout << "Printing the elements of int_vector after erasing positions 1, 2 and 4:\n";
+  for (int value : int_vector) {
+    std::cout << value << " ";
+  }
+  std::cout << "\n";
+  try {
+    EraseIndices(&int_vector, {3, 1});
+  } catch (const std::invalid_argument &e) {
+    std::cout << "Caught: " << e.what() << "\n";
+  }
+  size_t erased = EraseIf(&int_vector, [](int value) { return value % 2 == 1; });
+  std::cout << "EraseIf removed " << erased << " odd elements, leaving " << int_vector.size() << "\n";
+
+  // Benchmark 1: erasing every tenth position, one erase call at a time
+  // versus EraseIndices. The repeated erase is O(n * k), so this uses a
+  // fairly small vector, whose size can be passed as the first argument.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 200000;
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < n; i += 10) {
+    positions.push_back(i);
+  }
+  std::vector<int> repeated(n);
+  for (size_t i = 0; i < n; ++i) {
+    repeated[i] = static_cast<int>(i);
+  }
+  std::vector<int> bulk = repeated;
+  long long repeated_ms = TimeMs([&] {
+    // Erase from the back, so that the earlier positions are still correct.
+    for (size_t i = positions.size(); i > 0; --i) {
+      repeated.erase(repeated.begin() + positions[i - 1]);
+    }
+  });
+  long long bulk_ms = TimeMs([&] { EraseIndices(&bulk, positions); });
+  std::cout << "Erasing " << positions.size() << " of " << n << " ints: repeated erase " << repeated_ms
+            << " ms, EraseIndices " << bulk_ms << " ms (results " << (repeated == bulk ? "match" : "differ") << ")\n";
+
+  // Benchmark 2: cleaning up tombstones in a much larger table, with one
+  // thread and with every available thread.
+  size_t rows = n * 50;
+  std::vector<Row> table(rows);
+  for (size_t i = 0; i < rows; ++i) {
+    table[i] = Row{static_cast<int>(i), i % 3 == 0, "row " + std::to_string(i)};
+  }
+  std::vector<Row> parallel_table = table;
+  auto is_deleted = [](const Row &row) { return row.deleted_; };
+  size_t sequential_erased = 0;
+  size_t parallel_erased = 0;
+  long long sequential_ms = TimeMs([&] { sequential_erased = EraseIf(&table, is_deleted); });
+  long long parallel_ms = TimeMs([&] { parallel_erased = ParallelEraseIf(&parallel_table, is_deleted); });
+  bool same = SameRows(table, parallel_table);
+  std::cout << "Erasing " << sequential_erased << " tombstones from " << rows << " rows: EraseIf " << sequential_ms
+            << " ms, ParallelEraseIf (" << std::thread::hardware_concurrency() << " threads) " << parallel_ms
+            << " ms (" << parallel_erased << " erased, results " << (same ? "match" : "differ") << ")\n";
+
+  // ParallelEraseIf with four threads, on a table whose tombstones are all in
+  // the last block, so the blocks before it are already in place.
+  std::vector<Row> tail_table(rows);
+  for (size_t i = 0; i < rows; ++i) {
+    tail_table[i] = Row{static_cast<int>(i), i >= rows - rows / 8 && i % 2 == 0, "row " + std::to_string(i)};
+  }
+  std::vector<Row> tail_expected = tail_table;
+  EraseIf(&tail_expected, is_deleted);
+  ParallelEraseIf(&tail_table, is_deleted, 4);
+  std::cout << "ParallelEraseIf with tombstones only in the last block: results "
+            << (SameRows(tail_expected, tail_table) ? "match" : "differ") << "\n";
+
+  return 0;
+}
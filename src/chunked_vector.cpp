@@ -0,0 +1,391 @@
+/**
+ * @file chunked_vector.cpp
+ * @brief Tutorial code for a segmented vector whose elements never move when
+ * it grows.
+ */
+
+// When a std::vector runs out of capacity, push_back allocates a new array
+// (usually twice as large), moves every element into it, and frees the old
+// one. This keeps push_back fast on average, but it has three costs that
+// matter for very large vectors:
+// 1. While the elements are being moved, both arrays exist, so the peak
+//    memory use is about three times the old size.
+// 2. The push_back that triggers the growth has to move every element, so it
+//    takes much longer than the others (a latency spike).
+// 3. Every pointer or reference to an element becomes invalid, because the
+//    element now lives somewhere else.
+
+// A segmented (or chunked) vector avoids all three. It stores elements in
+// fixed-size chunks, and keeps a small table of pointers to the chunks.
+// Growing only allocates one more chunk; the existing elements stay where
+// they are. If the chunk size is a power of two, finding element i is just a
+// shift and a mask: chunk i >> kShift, slot i & kMask. std::deque works in a
+// similar way, but its chunk size is chosen by the standard library (only 512
+// bytes with libstdc++), and it does not let you work on a chunk at a time.
+// Because the chunks are independent arrays, they are also a natural unit of
+// work for processing the vector with several threads.
+
+// Includes std::max.
+#include <algorithm>
+// Includes std::atomic, used to hand out chunks to threads.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::uintptr_t, for checking alignment in main.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes placement new and std::align_val_t.
+#include <new>
+// Includes std::out_of_range, thrown by at.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes std::thread for the parallel iteration.
+#include <thread>
+// Includes std::conditional_t.
+#include <type_traits>
+// Includes std::move, std::forward and std::swap.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// The ChunkedVector class is a dynamic array of T stored in chunks of
+// kChunkSize elements each. kChunkSize must be a power of two. Elements never
+// move once they are added, so pointers and references to them stay valid
+// until the element is removed.
+template <typename T, size_t kChunkSize = 4096>
+class ChunkedVector {
+  static_assert(kChunkSize > 0 && (kChunkSize & (kChunkSize - 1)) == 0, "kChunkSize must be a power of two");
+
+ public:
+  ChunkedVector() = default;
+
+  // Like unique_ptr, a ChunkedVector can be moved but not copied. Moving only
+  // moves the chunk table.
+  ChunkedVector(const ChunkedVector &) = delete;
+  ChunkedVector &operator=(const ChunkedVector &) = delete;
+  ChunkedVector(ChunkedVector &&other) noexcept { Swap(other); }
+  ChunkedVector &operator=(ChunkedVector &&other) noexcept {
+    if (this != &other) {
+      ChunkedVector empty;
+      Swap(empty);
+      Swap(other);
+    }
+    return *this;
+  }
+
+  ~ChunkedVector() {
+    clear();
+    for (T *chunk : chunks_) {
+      ::operator delete(chunk, std::align_val_t{alignof(T)});
+    }
+  }
+
+  T &operator[](size_t i) { return chunks_[i >> kShift][i & kMask]; }
+  const T &operator[](size_t i) const { return chunks_[i >> kShift][i & kMask]; }
+  T &at(size_t i) {
+    CheckIndex(i);
+    return (*this)[i];
+  }
+  const T &at(size_t i) const {
+    CheckIndex(i);
+    return (*this)[i];
+  }
+  T &back() { return (*this)[size_ - 1]; }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t NumChunks() const { return chunks_.size(); }
+  static constexpr size_t ChunkSize() { return kChunkSize; }
+
+  // Allocates enough chunks for n elements up front.
+  void reserve(size_t n) {
+    while (chunks_.size() * kChunkSize < n) {
+      AddChunk();
+    }
+  }
+
+  void push_back(const T &value) { emplace_back(value); }
+  void push_back(T &&value) { emplace_back(std::move(value)); }
+
+  // Adds a new element at the end. When the last chunk is full, this
+  // allocates one new chunk. No existing element is moved.
+  template <typename... Args>
+  T &emplace_back(Args &&...args) {
+    if (size_ == chunks_.size() * kChunkSize) {
+      AddChunk();
+    }
+    T *slot = &chunks_[size_ >> kShift][size_ & kMask];
+    new (slot) T(std::forward<Args>(args)...);
+    ++size_;
+    return *slot;
+  }
+
+  // Removes the last element. The chunk stays allocated for later use.
+  void pop_back() {
+    --size_;
+    (*this)[size_].~T();
+  }
+
+  // Destroys all elements. The chunks stay allocated, like the capacity of a
+  // std::vector.
+  void clear() {
+    while (size_ > 0) {
+      pop_back();
+    }
+  }
+
+  // Calls fn(data, count) once for each chunk that holds elements, where data
+  // points to the first element of the chunk and count is the number of
+  // elements in it. Processing a chunk at a time lets the compiler treat each
+  // chunk as a plain array.
+  template <typename Fn>
+  void ForEachChunk(Fn fn) {
+    for (size_t chunk = 0; chunk * kChunkSize < size_; ++chunk) {
+      fn(chunks_[chunk], ChunkLength(chunk));
+    }
+  }
+
+  // Like ForEachChunk, but splits the chunks among num_threads threads. The
+  // threads take the next unprocessed chunk from a shared atomic counter, so
+  // a thread that finishes early just takes more chunks. fn is called from
+  // several threads at once and must be safe to call concurrently; each
+  // chunk is passed to exactly one call.
+  template <typename Fn>
+  void ParallelForEachChunk(Fn fn, size_t num_threads = std::thread::hardware_concurrency()) {
+    size_t num_chunks = (size_ + kChunkSize - 1) / kChunkSize;
+    if (num_threads <= 1 || num_chunks <= 1) {
+      ForEachChunk(fn);
+      return;
+    }
+    std::atomic<size_t> next_chunk{0};
+    auto worker = [&] {
+      for (size_t chunk = next_chunk.fetch_add(1); chunk < num_chunks; chunk = next_chunk.fetch_add(1)) {
+        fn(chunks_[chunk], ChunkLength(chunk));
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads && i < num_chunks; ++i) {
+      threads.emplace_back(worker);
+    }
+    // The calling thread works too, instead of just waiting.
+    worker();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  // A forward iterator, so that ChunkedVector works with range-based for
+  // loops. It keeps a pointer to the current element and to the end of the
+  // current chunk, and only looks at the chunk table when it crosses into the
+  // next chunk. With kConst set, it only gives out const references, for
+  // iterating over a const ChunkedVector.
+  template <bool kConst>
+  class BasicIterator {
+    using Vector = std::conditional_t<kConst, const ChunkedVector, ChunkedVector>;
+    using Element = std::conditional_t<kConst, const T, T>;
+
+   public:
+    BasicIterator(Vector *vector, size_t index) : vector_(vector), index_(index) { Load(); }
+    Element &operator*() const { return *element_; }
+    Element *operator->() const { return element_; }
+    BasicIterator &operator++() {
+      ++index_;
+      if (++element_ == chunk_end_) {
+        Load();
+      }
+      return *this;
+    }
+    bool operator==(const BasicIterator &other) const { return index_ == other.index_; }
+    bool operator!=(const BasicIterator &other) const { return index_ != other.index_; }
+
+   private:
+    void Load() {
+      if (index_ < vector_->size_) {
+        Element *chunk = vector_->chunks_[index_ >> kShift];
+        element_ = chunk + (index_ & kMask);
+        chunk_end_ = chunk + kChunkSize;
+      }
+    }
+
+    Vector *vector_;
+    size_t index_;
+    Element *element_ = nullptr;
+    Element *chunk_end_ = nullptr;
+  };
+
+  using Iterator = BasicIterator<false>;
+  using ConstIterator = BasicIterator<true>;
+
+  Iterator begin() { return Iterator(this, 0); }
+  Iterator end() { return Iterator(this, size_); }
+  ConstIterator begin() const { return ConstIterator(this, 0); }
+  ConstIterator end() const { return ConstIterator(this, size_); }
+
+ private:
+  // kShift is log2(kChunkSize), computed at compile time.
+  static constexpr size_t Log2(size_t n) { return n <= 1 ? 0 : 1 + Log2(n / 2); }
+  static constexpr size_t kShift = Log2(kChunkSize);
+  static constexpr size_t kMask = kChunkSize - 1;
+
+  // Chunks are allocated with T's alignment, since plain operator new only
+  // guarantees __STDCPP_DEFAULT_NEW_ALIGNMENT__ (16 bytes), and types can ask
+  // for more with alignas.
+  void AddChunk() {
+    chunks_.push_back(static_cast<T *>(::operator new(kChunkSize * sizeof(T), std::align_val_t{alignof(T)})));
+  }
+
+  // The number of elements in the given chunk. Every chunk is full except
+  // possibly the last one.
+  size_t ChunkLength(size_t chunk) const {
+    size_t start = chunk * kChunkSize;
+    return size_ - start < kChunkSize ? size_ - start : kChunkSize;
+  }
+
+  void CheckIndex(size_t i) const {
+    if (i >= size_) {
+      throw std::out_of_range("ChunkedVector index " + std::to_string(i) + " is out of range");
+    }
+  }
+
+  void Swap(ChunkedVector &other) noexcept {
+    std::swap(chunks_, other.chunks_);
+    std::swap(size_, other.size_);
+  }
+
+  // The chunk table. Growing it may move the table itself, but that only
+  // copies pointers; the chunks they point to stay where they are.
+  std::vector<T *> chunks_;
+  size_t size_ = 0;
+};
+
+// The Point class from vectors.cpp, without the printing in the constructors.
+class Point {
+ public:
+  Point() : x_(0), y_(0) {}
+  Point(int x, int y) : x_(x), y_(y) {}
+
+  inline int GetX() const { return x_; }
+  inline int GetY() const { return y_; }
+  inline void SetX(int x) { x_ = x; }
+  inline void SetY(int y) { y_ = y; }
+
+ private:
+  int x_;
+  int y_;
+};
+
+// Appends n points to an empty container and returns the slowest single
+// push_back in microseconds. peak_bytes is set to the most memory the
+// container's element storage used at any moment, counting both arrays
+// while a std::vector is growing.
+template <typename Container, typename CapacityBytes>
+long long FillAndMeasure(Container *points, size_t n, CapacityBytes capacity_bytes, size_t *peak_bytes) {
+  long long worst_us = 0;
+  *peak_bytes = 0;
+  for (size_t i = 0; i < n; ++i) {
+    size_t before = capacity_bytes(*points);
+    auto start = std::chrono::steady_clock::now();
+    points->emplace_back(static_cast<int>(i), static_cast<int>(i * 2));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    size_t after = capacity_bytes(*points);
+    // When a std::vector grows, the old array is only freed after every
+    // element has been moved to the new one.
+    size_t in_use = after != before ? before + after : after;
+    *peak_bytes = std::max(*peak_bytes, in_use);
+    worst_us = std::max(worst_us, static_cast<long long>(
+                                      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+  }
+  return worst_us;
+}
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We use a ChunkedVector just like the std::vector<Point> in vectors.cpp.
+  // Here we use tiny chunks of 4 points so that the demo crosses a few chunk
+  // boundaries.
+  ChunkedVector<Point, 4> point_vector;
+  point_vector.push_back(Point(35, 36));
+  point_vector.emplace_back(37, 38);
+  // Unlike with std::vector, this pointer stays valid no matter how many more
+  // points we add.
+  Point *first = &point_vector[0];
+  for (int i = 0; i < 10; ++i) {
+    point_vector.emplace_back(i, i);
+  }
+  std::cout << "After adding 10 more points, first still points to (" << first->GetX() << ", " << first->GetY()
+            << "), and the vector uses " << point_vector.NumChunks() << " chunks.\n";
+  for (Point &item : point_vector) {
+    item.SetY(445);
+  }
+  // Iterating through a const reference uses the const begin and end.
+  const ChunkedVector<Point, 4> &const_points = point_vector;
+  std::cout << "Printing the items in point_vector:\n";
+  for (const Point &item : const_points) {
+    std::cout << "(" << item.GetX() << ", " << item.GetY() << ") ";
+  }
+  std::cout << "\n";
+
+  // Chunks are aligned for T, even for a type that wants its own cache line.
+  struct alignas(64) PaddedCounter {
+    long long value_;
+  };
+  ChunkedVector<PaddedCounter, 4> counters;
+  counters.emplace_back();
+  counters.emplace_back();
+  std::cout << "A ChunkedVector<PaddedCounter> element is "
+            << (reinterpret_cast<uintptr_t>(&counters[1]) % 64 == 0 ? "" : "not ") << "64-byte aligned.\n";
+
+  // Now the benchmark. The number of points can be passed as the first
+  // argument, and defaults to 20 million.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 20000000;
+  std::cout << "Appending " << n << " points:\n";
+  size_t vector_peak = 0;
+  size_t chunked_peak = 0;
+  std::vector<Point> std_points;
+  ChunkedVector<Point> chunked_points;
+  long long vector_worst = FillAndMeasure(
+      &std_points, n, [](const std::vector<Point> &v) { return v.capacity() * sizeof(Point); }, &vector_peak);
+  long long chunked_worst = FillAndMeasure(
+      &chunked_points, n,
+      [](const ChunkedVector<Point> &v) { return v.NumChunks() * ChunkedVector<Point>::ChunkSize() * sizeof(Point); },
+      &chunked_peak);
+  std::cout << "std::vector:   slowest push_back " << vector_worst << " us, peak memory " << vector_peak / (1 << 20)
+            << " MiB\n";
+  std::cout << "ChunkedVector: slowest push_back " << chunked_worst << " us, peak memory "
+            << chunked_peak / (1 << 20) << " MiB\n";
+
+  // Sum the coordinates with one thread and then with every available
+  // thread, one chunk at a time.
+  long long sequential_sum = 0;
+  std::atomic<long long> parallel_sum{0};
+  long long sequential_ms = TimeMs([&] {
+    chunked_points.ForEachChunk([&](const Point *chunk, size_t count) {
+      for (size_t i = 0; i < count; ++i) {
+        sequential_sum += chunk[i].GetX() + chunk[i].GetY();
+      }
+    });
+  });
+  long long parallel_ms = TimeMs([&] {
+    chunked_points.ParallelForEachChunk([&](const Point *chunk, size_t count) {
+      long long local = 0;
+      for (size_t i = 0; i < count; ++i) {
+        local += chunk[i].GetX() + chunk[i].GetY();
+      }
+      parallel_sum += local;
+    });
+  });
+  std::cout << "Sum of coordinates: one thread " << sequential_ms << " ms, " << std::thread::hardware_concurrency()
+            << " threads " << parallel_ms << " ms (sums " << sequential_sum << " and " << parallel_sum << ")\n";
+
+  return 0;
+}
@@ -0,0 +1,414 @@
+/**
+ * @file cuckoo_hash.cpp
+ * @brief Tutorial code for a bucketized cuckoo hash table with optimistic
+ * concurrent readers.
+ */
+
+// std::unordered_map (see unordered_maps.cpp) resolves collisions by chaining:
+// each bucket points to a linked list of heap-allocated nodes. A lookup for an
+// unlucky key may walk a long chain, and when the map grows it rehashes every
+// element at once. Both of these hurt the slowest lookups (the "tail
+// latency") far more than the average ones.
+
+// A cuckoo hash table makes a much stronger promise. Every key has exactly two
+// candidate buckets, chosen by two different hash functions, and a key is
+// always stored in one of them. A lookup therefore inspects at most two
+// buckets, no matter how full the table is. In this file, each bucket holds
+// four slots and is exactly one cache line (64 bytes) wide, so a lookup reads
+// at most two cache lines.
+
+// Inserting is where the work happens. If both candidate buckets are full, the
+// insert "kicks out" an existing key into that key's other bucket (like a
+// cuckoo chick pushing eggs out of the nest), which may in turn kick out
+// another key, and so on. We search for the shortest such chain of moves with
+// a breadth-first search, and then perform the moves one at a time.
+
+// Finally, the table lets many reader threads run at the same time as a
+// writer, without readers taking any lock. Each bucket has a version counter.
+// A writer makes the version odd before it modifies a bucket and even again
+// afterwards. A reader records both bucket versions, reads the buckets, and
+// then checks that neither version changed. If one did, the reader simply
+// retries. Readers never write to shared memory, so they do not fight over
+// cache lines with each other. The same idea appears as a standalone
+// primitive called a seqlock.
+
+// Includes std::atomic and std::atomic_thread_fence.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes the thread library header.
+#include <thread>
+// Includes std::is_trivially_copyable.
+#include <type_traits>
+// Includes the unordered_map container library header for the benchmark.
+#include <unordered_map>
+// Includes the vector container library header.
+#include <vector>
+
+// A fast 64-bit integer mixer (from SplitMix64). Different seeds give us the
+// two independent hash functions that cuckoo hashing needs.
+inline uint64_t MixHash(uint64_t key, uint64_t seed) {
+  uint64_t x = key + seed;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// The CuckooHashMap class maps integer-like keys to small values. Keys and
+// values must be trivially copyable and lock-free as std::atomic, because
+// readers copy them out of a bucket while a writer may be changing it. The
+// capacity is fixed when the table is constructed, so the table never pauses
+// to rehash. Insert returns false if the table is too full to place a key;
+// a 4-way cuckoo table can usually be filled to about 95% before that
+// happens.
+//
+// Any number of threads may call Find at the same time. Calls to Insert and
+// Erase are serialized by an internal writer mutex, so there is at most one
+// writer at a time.
+template <typename K, typename V>
+class CuckooHashMap {
+  static_assert(std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>,
+                "Keys and values are copied by concurrent readers, so they must be trivially copyable.");
+
+ public:
+  static constexpr int kSlotsPerBucket = 4;
+
+  // The constructor allocates enough buckets for `capacity` keys at a load
+  // factor of at most 90%. The number of buckets is rounded up to a power of
+  // two, so that we can pick a bucket with a bit mask.
+  explicit CuckooHashMap(size_t capacity) {
+    size_t wanted = capacity * 10 / 9 / kSlotsPerBucket + 1;
+    size_t num_buckets = 2;
+    while (num_buckets < wanted) {
+      num_buckets <<= 1;
+    }
+    mask_ = num_buckets - 1;
+    buckets_ = std::vector<Bucket>(num_buckets);
+  }
+
+  // Looks up a key. If the key is present, it copies the value into *value
+  // and returns true. This function never blocks: it only retries if a writer
+  // changed one of the two buckets while we were reading it.
+  bool Find(K key, V *value) const {
+    const Bucket &b1 = buckets_[Index1(key)];
+    const Bucket &b2 = buckets_[Index2(key)];
+    while (true) {
+      uint32_t v1 = b1.version_.load(std::memory_order_acquire);
+      uint32_t v2 = b2.version_.load(std::memory_order_acquire);
+      if ((v1 | v2) & 1) {
+        // A writer is in the middle of changing one of the buckets.
+        std::this_thread::yield();
+        continue;
+      }
+      bool found = SearchBucket(b1, key, value) || SearchBucket(b2, key, value);
+      // The fence keeps the reads of the bucket contents above from being
+      // reordered after the version checks below.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (b1.version_.load(std::memory_order_relaxed) == v1 && b2.version_.load(std::memory_order_relaxed) == v2) {
+        return found;
+      }
+    }
+  }
+
+  // Inserts a key-value pair, or overwrites the value if the key is already
+  // present. It returns false only if no chain of moves could make room.
+  bool Insert(K key, V value) {
+    std::scoped_lock lk(writer_latch_);
+    size_t i1 = Index1(key);
+    size_t i2 = Index2(key);
+
+    // If the key already exists, update its value in place.
+    for (size_t index : {i1, i2}) {
+      Bucket &bucket = buckets_[index];
+      for (int slot = 0; slot < kSlotsPerBucket; ++slot) {
+        if (IsOccupied(bucket, slot) && bucket.keys_[slot].load(std::memory_order_relaxed) == key) {
+          BeginWrite(bucket);
+          bucket.values_[slot].store(value, std::memory_order_relaxed);
+          EndWrite(bucket);
+          return true;
+        }
+      }
+    }
+
+    // Find a chain of moves that ends in a free slot, and perform it. After
+    // that, the first bucket in the chain has a free slot for our key.
+    int path_length = FindCuckooPath(i1, i2);
+    if (path_length < 0) {
+      return false;
+    }
+    size_t target = ExecuteCuckooPath(path_length);
+    Bucket &bucket = buckets_[target];
+    int slot = FreeSlot(bucket);
+    BeginWrite(bucket);
+    bucket.keys_[slot].store(key, std::memory_order_relaxed);
+    bucket.values_[slot].store(value, std::memory_order_relaxed);
+    bucket.occupied_.store(bucket.occupied_.load(std::memory_order_relaxed) | (1U << slot), std::memory_order_relaxed);
+    EndWrite(bucket);
+    size_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Removes a key. It returns whether the key was present.
+  bool Erase(K key) {
+    std::scoped_lock lk(writer_latch_);
+    for (size_t index : {Index1(key), Index2(key)}) {
+      Bucket &bucket = buckets_[index];
+      for (int slot = 0; slot < kSlotsPerBucket; ++slot) {
+        if (IsOccupied(bucket, slot) && bucket.keys_[slot].load(std::memory_order_relaxed) == key) {
+          BeginWrite(bucket);
+          bucket.occupied_.store(bucket.occupied_.load(std::memory_order_relaxed) & ~(1U << slot),
+                                 std::memory_order_relaxed);
+          EndWrite(bucket);
+          size_.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Getter functions.
+  size_t Size() const { return size_.load(std::memory_order_relaxed); }
+  size_t Capacity() const { return buckets_.size() * kSlotsPerBucket; }
+  size_t BucketCount() const { return buckets_.size(); }
+
+ private:
+  // A bucket is exactly one cache line: a version counter, a bitmap of which
+  // slots are in use, and four keys and values stored as separate arrays.
+  struct alignas(64) Bucket {
+    std::atomic<uint32_t> version_{0};
+    std::atomic<uint8_t> occupied_{0};
+    std::atomic<K> keys_[kSlotsPerBucket]{};
+    std::atomic<V> values_[kSlotsPerBucket]{};
+  };
+  static_assert(sizeof(Bucket) == 64, "A bucket must fit in exactly one cache line.");
+
+  // One step of the breadth-first search over buckets. parent_ is the index
+  // of the previous step in the search (or -1 for the two starting buckets),
+  // and parent_slot_ is the slot in the parent's bucket whose key would move
+  // into this bucket.
+  struct PathNode {
+    size_t bucket_;
+    int parent_;
+    int parent_slot_;
+  };
+  static constexpr size_t kMaxSearchNodes = 512;
+
+  size_t Index1(K key) const { return MixHash(static_cast<uint64_t>(key), 0x243F6A8885A308D3ULL) & mask_; }
+
+  // The second bucket must differ from the first, otherwise the key would
+  // have only one candidate bucket.
+  size_t Index2(K key) const {
+    size_t index = MixHash(static_cast<uint64_t>(key), 0x13198A2E03707344ULL) & mask_;
+    return index == Index1(key) ? (index + 1) & mask_ : index;
+  }
+
+  // Returns the bucket that a key in `index` would move to.
+  size_t AlternateIndex(K key, size_t index) const {
+    size_t i1 = Index1(key);
+    return index == i1 ? Index2(key) : i1;
+  }
+
+  static bool IsOccupied(const Bucket &bucket, int slot) {
+    return (bucket.occupied_.load(std::memory_order_relaxed) >> slot) & 1U;
+  }
+
+  static int FreeSlot(const Bucket &bucket) {
+    for (int slot = 0; slot < kSlotsPerBucket; ++slot) {
+      if (!IsOccupied(bucket, slot)) {
+        return slot;
+      }
+    }
+    return -1;
+  }
+
+  static bool SearchBucket(const Bucket &bucket, K key, V *value) {
+    uint8_t occupied = bucket.occupied_.load(std::memory_order_relaxed);
+    for (int slot = 0; slot < kSlotsPerBucket; ++slot) {
+      if (((occupied >> slot) & 1U) && bucket.keys_[slot].load(std::memory_order_relaxed) == key) {
+        *value = bucket.values_[slot].load(std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The writer makes the version odd before touching a bucket. The release
+  // fence keeps the writes to the bucket from being reordered before it.
+  static void BeginWrite(Bucket &bucket) {
+    bucket.version_.store(bucket.version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  // The writer makes the version even again once the bucket is consistent.
+  static void EndWrite(Bucket &bucket) {
+    bucket.version_.store(bucket.version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Runs a breadth-first search from the key's two buckets, looking for the
+  // nearest bucket with a free slot. It fills path_ and returns the index of
+  // the node with the free slot, or -1 if the search gave up.
+  int FindCuckooPath(size_t i1, size_t i2) {
+    path_.clear();
+    path_.push_back({i1, -1, -1});
+    path_.push_back({i2, -1, -1});
+    for (size_t next = 0; next < path_.size(); ++next) {
+      const Bucket &bucket = buckets_[path_[next].bucket_];
+      if (FreeSlot(bucket) >= 0) {
+        return static_cast<int>(next);
+      }
+      for (int slot = 0; slot < kSlotsPerBucket && path_.size() < kMaxSearchNodes; ++slot) {
+        K displaced = bucket.keys_[slot].load(std::memory_order_relaxed);
+        size_t alternate = AlternateIndex(displaced, path_[next].bucket_);
+        if (!OnPath(static_cast<int>(next), alternate)) {
+          path_.push_back({alternate, static_cast<int>(next), slot});
+        }
+      }
+    }
+    return -1;
+  }
+
+  // Returns whether a bucket already appears on the chain ending at `node`. A
+  // chain that visits the same bucket twice would move keys in a circle, so
+  // the search never extends a chain back into one of its own buckets.
+  bool OnPath(int node, size_t bucket) const {
+    for (; node >= 0; node = path_[node].parent_) {
+      if (path_[node].bucket_ == bucket) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Performs the moves found by FindCuckooPath, starting from the end of the
+  // chain. Each key is first copied into its other bucket and only then
+  // removed from its old one, so every key stays reachable the whole time.
+  // It returns the bucket where the new key should go.
+  size_t ExecuteCuckooPath(int node) {
+    while (path_[node].parent_ >= 0) {
+      const PathNode &step = path_[node];
+      Bucket &from = buckets_[path_[step.parent_].bucket_];
+      Bucket &to = buckets_[step.bucket_];
+      int to_slot = FreeSlot(to);
+
+      BeginWrite(to);
+      to.keys_[to_slot].store(from.keys_[step.parent_slot_].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      to.values_[to_slot].store(from.values_[step.parent_slot_].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+      to.occupied_.store(to.occupied_.load(std::memory_order_relaxed) | (1U << to_slot), std::memory_order_relaxed);
+      EndWrite(to);
+
+      BeginWrite(from);
+      from.occupied_.store(from.occupied_.load(std::memory_order_relaxed) & ~(1U << step.parent_slot_),
+                           std::memory_order_relaxed);
+      EndWrite(from);
+
+      node = step.parent_;
+    }
+    return path_[node].bucket_;
+  }
+
+  size_t mask_;
+  std::vector<Bucket> buckets_;
+  std::atomic<size_t> size_{0};
+  std::mutex writer_latch_;
+  std::vector<PathNode> path_;
+};
+
+int main() {
+  // We declare a table that can hold about one million keys. Keys are row IDs
+  // and values are 32-bit offsets, which keeps every bucket in one cache line.
+  constexpr uint64_t kNumKeys = 1000000;
+  CuckooHashMap<uint64_t, uint32_t> map(kNumKeys);
+  std::cout << "Cuckoo table with " << map.BucketCount() << " buckets and " << map.Capacity() << " slots.\n";
+
+  // Insert, Find and Erase work much like their std::unordered_map versions.
+  map.Insert(445, 645);
+  uint32_t value = 0;
+  if (map.Find(445, &value)) {
+    std::cout << "Found key 445 with value " << value << std::endl;
+  }
+  map.Erase(445);
+  if (!map.Find(445, &value)) {
+    std::cout << "Key 445 does not exist in the cuckoo table anymore.\n";
+  }
+
+  // Now let's fill the table while four reader threads look keys up at the
+  // same time. The writer always stores key * 2 as the value, so any reader
+  // that finds a key can check that it read a consistent key-value pair.
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> torn_reads{0};
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; ++r) {
+    readers.emplace_back([&map, &done, &torn_reads, r] {
+      uint64_t key = r;
+      while (!done.load(std::memory_order_relaxed)) {
+        uint32_t found = 0;
+        if (map.Find(key, &found) && found != static_cast<uint32_t>(key * 2)) {
+          torn_reads.fetch_add(1);
+        }
+        key = (key + 7919) % kNumKeys;
+      }
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t inserted = 0;
+  for (uint64_t key = 0; key < kNumKeys; ++key) {
+    inserted += map.Insert(key, static_cast<uint32_t>(key * 2)) ? 1 : 0;
+  }
+  auto insert_time = std::chrono::steady_clock::now() - start;
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+
+  std::cout << "Inserted " << inserted << " keys (load factor "
+            << static_cast<double>(map.Size()) / static_cast<double>(map.Capacity()) << ") in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(insert_time).count() << " ms.\n";
+  std::cout << "Inconsistent reads observed by concurrent readers: " << torn_reads.load() << "\n";
+
+  // Finally, a small benchmark comparing lookups against std::unordered_map.
+  // Every cuckoo lookup reads at most two cache lines, whereas the
+  // std::unordered_map lookup chases bucket and node pointers.
+  std::unordered_map<uint64_t, uint32_t> std_map;
+  std_map.reserve(kNumKeys);
+  for (uint64_t key = 0; key < kNumKeys; ++key) {
+    std_map[key] = static_cast<uint32_t>(key * 2);
+  }
+
+  start = std::chrono::steady_clock::now();
+  uint64_t cuckoo_sum = 0;
+  for (uint64_t i = 0; i < 4 * kNumKeys; ++i) {
+    uint32_t found = 0;
+    if (map.Find(MixHash(i, 1) % (2 * kNumKeys), &found)) {
+      cuckoo_sum += found;
+    }
+  }
+  auto cuckoo_time = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  uint64_t std_sum = 0;
+  for (uint64_t i = 0; i < 4 * kNumKeys; ++i) {
+    auto it = std_map.find(MixHash(i, 1) % (2 * kNumKeys));
+    if (it != std_map.end()) {
+      std_sum += it->second;
+    }
+  }
+  auto std_time = std::chrono::steady_clock::now() - start;
+
+  std::cout << "CuckooHashMap lookups:      "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(cuckoo_time).count() << " ms (sum "
+            << cuckoo_sum << ")\n";
+  std::cout << "std::unordered_map lookups: "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std_time).count() << " ms (sum " << std_sum
+            << ")\n";
+
+  return 0;
+}
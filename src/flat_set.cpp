@@ -0,0 +1,273 @@
+/**
+ * @file flat_set.cpp
+ * @brief Tutorial code for a sorted-vector set with batched inserts and an
+ * Eytzinger (BFS) search layout.
+ */
+
+// sets.cpp introduced std::set, a balanced tree with one heap-allocated node
+// per element. Many sets are built once and then only searched, often
+// millions of times. For those, a tree is a poor fit: the nodes are scattered
+// all over memory, so every step of a search is likely a cache miss.
+
+// A much simpler structure is a sorted std::vector, searched with binary
+// search. The elements are contiguous, there is no per-element overhead, and
+// iterating is as fast as it gets. The catch is inserting: putting one
+// element in the middle of a vector shifts everything after it. The fix is
+// to not insert one element at a time. FlatSet collects new elements in a
+// small unsorted buffer, and once the buffer is full it sorts the buffer and
+// merges it into the main vector in a single linear pass.
+
+// Binary search on a sorted array has its own problem: the first few probes
+// jump around the whole array, and each probe depends on the previous one,
+// so the CPU cannot start the next memory load early. The Eytzinger layout
+// (named after a 16th-century genealogist) stores the same elements in the
+// order of a breadth-first walk of the binary search tree: the root at index
+// 1, its children at 2 and 3, their children at 4 through 7, and so on. The
+// children of index k are always at 2k and 2k + 1, so the search becomes a
+// tight loop with no branches, and the next few levels of the tree sit next
+// to each other in memory, which means we can prefetch them ahead of time.
+// See https://algorithmica.org/en/eytzinger for a detailed explanation.
+
+// Includes std::sort, std::unique, std::merge and std::lower_bound.
+#include <algorithm>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::back_inserter.
+#include <iterator>
+// Includes std::mt19937 for generating random keys.
+#include <random>
+// Includes the set container library header for the benchmark.
+#include <set>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the vector container library header.
+#include <vector>
+
+// The FlatSet class is a set of T stored as a sorted std::vector. T must be
+// copyable and comparable with operator<.
+template <typename T>
+class FlatSet {
+ public:
+  // batch_size is how many inserted elements are buffered before they are
+  // merged into the sorted vector. Larger batches mean fewer merges.
+  explicit FlatSet(size_t batch_size = 1024) : batch_size_(batch_size) {}
+
+  // Adds a value. The value goes into the pending buffer, which is merged into
+  // the sorted vector once it holds batch_size elements.
+  void Insert(const T &value) {
+    pending_.push_back(value);
+    eytzinger_.clear();
+    if (pending_.size() >= batch_size_) {
+      Flush();
+    }
+  }
+
+  // Adds every value in [first, last) with a single merge.
+  template <typename Iter>
+  void InsertBatch(Iter first, Iter last) {
+    pending_.insert(pending_.end(), first, last);
+    eytzinger_.clear();
+    Flush();
+  }
+
+  // Merges the pending buffer into the sorted vector. The buffer is sorted
+  // and deduplicated on its own, and then std::merge combines the two sorted
+  // sequences in one linear pass. Iterating over the set (begin and end)
+  // only sees flushed elements.
+  void Flush() {
+    if (pending_.empty()) {
+      return;
+    }
+    std::sort(pending_.begin(), pending_.end());
+    std::vector<T> merged;
+    merged.reserve(sorted_.size() + pending_.size());
+    std::merge(sorted_.begin(), sorted_.end(), pending_.begin(), pending_.end(), std::back_inserter(merged));
+    merged.erase(std::unique(merged.begin(), merged.end(), [](const T &a, const T &b) { return !(a < b) && !(b < a); }),
+                 merged.end());
+    sorted_ = std::move(merged);
+    pending_.clear();
+  }
+
+  // Removes a value. It returns whether the value was present.
+  bool Erase(const T &value) {
+    Flush();
+    auto it = std::lower_bound(sorted_.begin(), sorted_.end(), value);
+    if (it == sorted_.end() || value < *it) {
+      return false;
+    }
+    sorted_.erase(it);
+    eytzinger_.clear();
+    return true;
+  }
+
+  // Builds the Eytzinger copy of the set, which Contains will use until the
+  // set is modified again. This doubles the memory used by the set, so only
+  // do it for sets that are searched much more often than they change.
+  void OptimizeForReads() {
+    Flush();
+    eytzinger_.assign(sorted_.size() + 1, T{});
+    size_t next = 0;
+    FillEytzinger(1, &next);
+  }
+
+  // Returns whether the value is in the set.
+  bool Contains(const T &value) const {
+    if (!eytzinger_.empty()) {
+      return ContainsEytzinger(value);
+    }
+    if (ContainsSorted(value)) {
+      return true;
+    }
+    // The pending buffer is small and unsorted, so we scan it linearly.
+    for (const T &item : pending_) {
+      if (!(item < value) && !(value < item)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Pending elements are not deduplicated yet, so Size may overcount until
+  // the next Flush.
+  size_t Size() const { return sorted_.size() + pending_.size(); }
+  typename std::vector<T>::const_iterator begin() const { return sorted_.begin(); }
+  typename std::vector<T>::const_iterator end() const { return sorted_.end(); }
+
+ private:
+  // The number of elements in one cache line. The Eytzinger search prefetches
+  // the node this many positions ahead, which is four levels further down
+  // the tree for 4-byte elements.
+  static constexpr size_t kPrefetchStride = 64 / sizeof(T) > 0 ? 64 / sizeof(T) : 1;
+
+  // A branchless binary search. Instead of an if statement that the CPU has
+  // to predict, each step picks the next half with a conditional move. The
+  // loop always runs about log2(n) times.
+  bool ContainsSorted(const T &value) const {
+    if (sorted_.empty()) {
+      return false;
+    }
+    const T *base = sorted_.data();
+    size_t length = sorted_.size();
+    while (length > 1) {
+      size_t half = length / 2;
+      base = base[half - 1] < value ? base + half : base;
+      length -= half;
+    }
+    return !(*base < value) && !(value < *base);
+  }
+
+  // Fills eytzinger_ with an in-order walk of the implicit tree rooted at k:
+  // left subtree, then node k, then right subtree. Since sorted_ is visited
+  // in order, the tree ends up being a binary search tree.
+  void FillEytzinger(size_t k, size_t *next) {
+    if (k >= eytzinger_.size()) {
+      return;
+    }
+    FillEytzinger(2 * k, next);
+    eytzinger_[k] = sorted_[(*next)++];
+    FillEytzinger(2 * k + 1, next);
+  }
+
+  // Walks down the implicit tree: go to 2k if the value is smaller than the
+  // node and 2k + 1 otherwise. When k falls off the bottom, the path we took
+  // encodes where the search ended. Each time we went right then left, we
+  // passed a candidate for lower_bound; shifting off the trailing 1 bits
+  // (the final run of right turns) and one more bit gives us the last node
+  // where we went left, which is the lower bound.
+  bool ContainsEytzinger(const T &value) const {
+    const T *tree = eytzinger_.data();
+    size_t n = eytzinger_.size() - 1;
+    size_t k = 1;
+    while (k <= n) {
+      __builtin_prefetch(tree + std::min(k * kPrefetchStride, n));
+      k = 2 * k + (tree[k] < value);
+    }
+    k >>= __builtin_ffsll(static_cast<long long>(~k));
+    return k != 0 && !(value < tree[k]);
+  }
+
+  size_t batch_size_;
+  std::vector<T> sorted_;
+  std::vector<T> pending_;
+  std::vector<T> eytzinger_;
+};
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the std::set example from sets.cpp with a FlatSet.
+  FlatSet<int> int_set;
+  for (int i = 10; i >= 1; --i) {
+    int_set.Insert(i);
+  }
+  if (int_set.Contains(5)) {
+    std::cout << "Element 5 is in the set (still in the pending buffer)." << std::endl;
+  }
+  int_set.Erase(5);
+  if (!int_set.Contains(5)) {
+    std::cout << "Element 5 is not in the set." << std::endl;
+  }
+  std::cout << "Printing the elements of the flat set:\n";
+  for (int value : int_set) {
+    std::cout << value << " ";
+  }
+  std::cout << "\n";
+
+  // Now the benchmark. The number of elements can be passed as the first
+  // argument, and defaults to one million. The probes are half hits and half
+  // misses.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  std::mt19937 rng(445);
+  std::vector<int> values(n);
+  for (int &value : values) {
+    value = static_cast<int>(rng() % (4 * n)) * 2;
+  }
+  std::vector<int> probes(4 * n);
+  for (size_t i = 0; i < probes.size(); ++i) {
+    probes[i] = static_cast<int>(rng() % (8 * n));
+  }
+  std::cout << "Benchmarking with " << n << " elements and " << probes.size() << " lookups:\n";
+
+  std::set<int> std_set;
+  FlatSet<int> flat_set;
+  long long std_ms = TimeMs([&] {
+    for (int value : values) {
+      std_set.insert(value);
+    }
+  });
+  long long flat_ms = TimeMs([&] { flat_set.InsertBatch(values.begin(), values.end()); });
+  std::cout << "Build:   std::set " << std_ms << " ms, FlatSet (one batch) " << flat_ms << " ms\n";
+
+  size_t std_hits = 0;
+  size_t sorted_hits = 0;
+  size_t eytzinger_hits = 0;
+  std_ms = TimeMs([&] {
+    for (int probe : probes) {
+      std_hits += std_set.count(probe);
+    }
+  });
+  long long sorted_ms = TimeMs([&] {
+    for (int probe : probes) {
+      sorted_hits += flat_set.Contains(probe);
+    }
+  });
+  flat_set.OptimizeForReads();
+  long long eytzinger_ms = TimeMs([&] {
+    for (int probe : probes) {
+      eytzinger_hits += flat_set.Contains(probe);
+    }
+  });
+  std::cout << "Lookups: std::set " << std_ms << " ms, sorted vector " << sorted_ms << " ms, Eytzinger "
+            << eytzinger_ms << " ms (hits " << std_hits << ", " << sorted_hits << ", " << eytzinger_hits << ")\n";
+
+  return 0;
+}
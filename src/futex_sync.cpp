@@ -0,0 +1,372 @@
+/**
+ * @file futex_sync.cpp
+ * @brief Tutorial code for latch, barrier and event primitives built directly
+ * on futexes.
+ */
+
+// In condition_variable.cpp, waiter_thread waits until count reaches 2 with a
+// std::mutex, a std::condition_variable and a predicate, and each
+// add_count_and_notify takes the mutex to bump the count. This pattern,
+// "wait until N things have happened", comes up all the time, for example
+// when a parallel operator waits for all of its worker threads to finish
+// their part (fork/join). It has dedicated names:
+// - A latch counts down from N. Wait blocks until the count reaches zero.
+//   A latch can only be used once.
+// - A barrier makes N threads wait for each other. Once all N have arrived,
+//   they all continue, and the barrier resets itself for the next round
+//   (called a phase).
+// - An event is a one-shot flag. Wait blocks until some thread sets it.
+// C++20 added std::latch and std::barrier, but this repository uses C++17.
+
+// Building these on a mutex and condition variable works, but every count
+// down takes the mutex, even when nobody is waiting. Here we build them on
+// the Linux futex system call instead, which HybridMutex in hybrid_mutex.cpp
+// uses too: a thread can sleep until a 32-bit integer changes, and another
+// thread can wake the sleepers. Each primitive also counts its sleeping
+// threads, so the thread that counts down, arrives or sets only makes a
+// system call when someone is actually asleep. On other systems, waiting
+// falls back to std::this_thread::yield in a loop.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes INT_MAX.
+#include <climits>
+// Includes the condition variable library header.
+#include <condition_variable>
+// Includes fixed-width integer types like uint32_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the vector container library header.
+#include <vector>
+
+#ifdef __linux__
+// Includes the futex operation constants.
+#include <linux/futex.h>
+// Includes SYS_futex, the futex system call number.
+#include <sys/syscall.h>
+// Includes syscall, since glibc has no wrapper function for futex.
+#include <unistd.h>
+#endif
+
+// The futex system call works on a plain 32-bit integer, so the futex words
+// below must have exactly that layout.
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32-bit word");
+
+// Sleeps until *word is woken, but only if *word still equals expected. It
+// may also return early for no reason, so callers check again in a loop.
+inline void FutexWait(std::atomic<uint32_t> *word, uint32_t expected) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+  (void)word;
+  (void)expected;
+  std::this_thread::yield();
+#endif
+}
+
+// Wakes every thread sleeping in FutexWait on word.
+inline void FutexWakeAll(std::atomic<uint32_t> *word) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+  (void)word;
+#endif
+}
+
+// Waits until *word is different from value. It spins briefly first, since
+// the change often comes within a few microseconds, and then sleeps. While
+// asleep, the thread is counted in *sleepers, so that the thread making the
+// change knows to wake it.
+//
+// A sleeper is never missed: it increments *sleepers before the futex call
+// checks *word, and the thread making the change updates *word before it
+// reads *sleepers, all with sequentially consistent operations. So either
+// the changer sees the sleeper and wakes it, or the futex call sees the new
+// value of *word and does not sleep.
+//
+// Spinning only helps if the thread making the change is running on another
+// core at the same time, so on a single-core machine we go straight to sleep.
+inline void WaitWhileEqual(std::atomic<uint32_t> *word, uint32_t value, std::atomic<uint32_t> *sleepers) {
+  static const int max_spins = std::thread::hardware_concurrency() > 1 ? 128 : 0;
+  for (int spins = 0; spins < max_spins; ++spins) {
+    if (word->load(std::memory_order_acquire) != value) {
+      return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  while (word->load() == value) {
+    sleepers->fetch_add(1);
+    FutexWait(word, value);
+    sleepers->fetch_sub(1);
+  }
+}
+
+// Wakes every sleeper on word, if there is any. word must already have been
+// changed with a sequentially consistent operation.
+inline void WakeSleepers(std::atomic<uint32_t> *word, std::atomic<uint32_t> *sleepers) {
+  if (sleepers->load() > 0) {
+    FutexWakeAll(word);
+  }
+}
+
+// The Latch class counts down from an initial count. Threads that call Wait
+// block until the count reaches zero.
+class Latch {
+ public:
+  explicit Latch(uint32_t count) : count_(count) {}
+
+  // Decrements the count by n. Calling it more times than the initial count
+  // is a bug. When nobody is waiting yet, this is a single atomic
+  // instruction.
+  void CountDown(uint32_t n = 1) {
+    if (count_.fetch_sub(n) == n) {
+      WakeSleepers(&count_, &sleepers_);
+    }
+  }
+
+  bool TryWait() const { return count_.load(std::memory_order_acquire) == 0; }
+
+  void Wait() {
+    for (uint32_t count = count_.load(std::memory_order_acquire); count != 0;
+         count = count_.load(std::memory_order_acquire)) {
+      WaitWhileEqual(&count_, count, &sleepers_);
+    }
+  }
+
+  void ArriveAndWait(uint32_t n = 1) {
+    CountDown(n);
+    Wait();
+  }
+
+ private:
+  std::atomic<uint32_t> count_;
+  std::atomic<uint32_t> sleepers_{0};
+};
+
+// The Barrier class makes a fixed number of threads wait for each other, over
+// and over. Each round is a phase; phase_ counts them, and is the futex word
+// that waiting threads sleep on.
+class Barrier {
+ public:
+  explicit Barrier(uint32_t num_threads) : num_threads_(num_threads) {}
+
+  // Blocks until num_threads threads have called ArriveAndWait in this phase.
+  // The last thread to arrive does not block; it resets the arrival count
+  // and starts the next phase, which releases the others.
+  void ArriveAndWait() {
+    // Read the phase before arriving. Once we have arrived, the last thread
+    // may start the next phase at any time.
+    uint32_t phase = phase_.load(std::memory_order_acquire);
+    if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == num_threads_) {
+      // Nobody can arrive for the next phase until we bump phase_, so it is
+      // safe to reset the count first.
+      arrived_.store(0, std::memory_order_relaxed);
+      phase_.fetch_add(1);
+      WakeSleepers(&phase_, &sleepers_);
+      return;
+    }
+    WaitWhileEqual(&phase_, phase, &sleepers_);
+  }
+
+ private:
+  const uint32_t num_threads_;
+  std::atomic<uint32_t> arrived_{0};
+  std::atomic<uint32_t> phase_{0};
+  std::atomic<uint32_t> sleepers_{0};
+};
+
+// The Event class is a flag that starts unset. Once Set is called, it stays
+// set, and Wait returns immediately from then on.
+class Event {
+ public:
+  void Set() {
+    if (state_.exchange(1) == 0) {
+      WakeSleepers(&state_, &sleepers_);
+    }
+  }
+
+  bool IsSet() const { return state_.load(std::memory_order_acquire) != 0; }
+
+  void Wait() { WaitWhileEqual(&state_, 0, &sleepers_); }
+
+ private:
+  std::atomic<uint32_t> state_{0};
+  std::atomic<uint32_t> sleepers_{0};
+};
+
+// A latch and a barrier built with a mutex and a condition variable, in the
+// style of condition_variable.cpp, for comparison.
+class CondvarLatch {
+ public:
+  explicit CondvarLatch(uint32_t count) : count_(count) {}
+
+  void CountDown() {
+    std::scoped_lock slk(m_);
+    count_ -= 1;
+    if (count_ == 0) {
+      cv_.notify_all();
+    }
+  }
+
+  void Wait() {
+    std::unique_lock lk(m_);
+    cv_.wait(lk, [this] { return count_ == 0; });
+  }
+
+ private:
+  uint32_t count_;
+  std::mutex m_;
+  std::condition_variable cv_;
+};
+
+class CondvarBarrier {
+ public:
+  explicit CondvarBarrier(uint32_t num_threads) : num_threads_(num_threads) {}
+
+  void ArriveAndWait() {
+    std::unique_lock lk(m_);
+    uint32_t phase = phase_;
+    if (++arrived_ == num_threads_) {
+      arrived_ = 0;
+      ++phase_;
+      cv_.notify_all();
+      return;
+    }
+    cv_.wait(lk, [&] { return phase_ != phase; });
+  }
+
+ private:
+  const uint32_t num_threads_;
+  uint32_t arrived_ = 0;
+  uint32_t phase_ = 0;
+  std::mutex m_;
+  std::condition_variable cv_;
+};
+
+// Runs num_threads threads through num_phases fork/join phases. In each
+// phase, every thread adds its share to a per-thread total, then all threads
+// meet at the barrier. It returns how many milliseconds it took, and checks
+// that no thread ran ahead into the next phase.
+template <typename BarrierType>
+long long RunPhases(uint32_t num_threads, size_t num_phases) {
+  BarrierType barrier(num_threads);
+  std::atomic<size_t> finished{0};
+  std::atomic<bool> ran_ahead{false};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] {
+      for (size_t phase = 0; phase < num_phases; ++phase) {
+        finished.fetch_add(1);
+        barrier.ArriveAndWait();
+        // Every thread of this phase must have arrived before anyone leaves.
+        if (finished.load() < (phase + 1) * num_threads) {
+          ran_ahead = true;
+        }
+        barrier.ArriveAndWait();
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  long long ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if (ran_ahead) {
+    std::cout << "A thread left the barrier too early!\n";
+  }
+  return ms;
+}
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from condition_variable.cpp with a Latch: two
+  // threads each increment count and count the latch down, and the waiter
+  // prints count once both are done.
+  std::atomic<int> count{0};
+  Latch done(2);
+  auto add_count_and_notify = [&] {
+    count += 1;
+    done.CountDown();
+  };
+  auto waiter_thread = [&] {
+    done.Wait();
+    std::cout << "Printing count: " << count << std::endl;
+  };
+  std::thread t1(add_count_and_notify);
+  std::thread t2(add_count_and_notify);
+  std::thread t3(waiter_thread);
+  t1.join();
+  t2.join();
+  t3.join();
+
+  // An Event releases any number of waiters at once.
+  Event start;
+  std::vector<std::thread> runners;
+  std::atomic<int> started{0};
+  for (int i = 0; i < 3; ++i) {
+    runners.emplace_back([&] {
+      start.Wait();
+      started += 1;
+    });
+  }
+  start.Set();
+  for (std::thread &runner : runners) {
+    runner.join();
+  }
+  std::cout << started << " threads started after the event was set\n";
+
+  // Benchmark 1: counting down a latch while nobody is waiting. This is the
+  // common case in fork/join, where workers finish before the coordinator
+  // starts waiting. The number of count downs can be passed as the first
+  // argument.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 2000000;
+  Latch latch(static_cast<uint32_t>(n));
+  CondvarLatch condvar_latch(static_cast<uint32_t>(n));
+  long long latch_ms = TimeMs([&] {
+    for (size_t i = 0; i < n; ++i) {
+      latch.CountDown();
+    }
+  });
+  long long condvar_latch_ms = TimeMs([&] {
+    for (size_t i = 0; i < n; ++i) {
+      condvar_latch.CountDown();
+    }
+  });
+  latch.Wait();
+  condvar_latch.Wait();
+  std::cout << n << " count downs with no waiters: Latch " << latch_ms << " ms, mutex+condvar " << condvar_latch_ms
+            << " ms\n";
+
+  // Benchmark 2: fork/join phases, where every thread waits at a barrier
+  // twice per phase.
+  size_t num_phases = n / 100;
+  std::cout << num_phases << " fork/join phases (times in ms):\n";
+  std::cout << "threads  Barrier  mutex+condvar\n";
+  for (uint32_t num_threads = 2; num_threads <= 8; num_threads *= 2) {
+    long long futex_ms = RunPhases<Barrier>(num_threads, num_phases);
+    long long condvar_ms = RunPhases<CondvarBarrier>(num_threads, num_phases);
+    std::cout << num_threads << "\t " << futex_ms << "\t  " << condvar_ms << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,297 @@
+/**
+ * @file hybrid_mutex.cpp
+ * @brief Tutorial code for a mutex that spins briefly before sleeping, and
+ * keeps statistics about how contended it is.
+ */
+
+// mutex.cpp and scoped_lock.cpp protect a shared count with a std::mutex.
+// std::mutex works well, but it does not tell you anything: when a program
+// is slow, you cannot ask a std::mutex how often threads had to wait for it,
+// or for how long.
+
+// There are two basic ways to wait for a lock that someone else holds:
+// - Spinning: keep checking in a loop. This is the fastest way to get the
+//   lock when it is released soon, but it wastes a CPU core while waiting,
+//   and it is terrible when the lock holder is not running (for example,
+//   with more threads than cores).
+// - Sleeping: ask the operating system to put the thread to sleep until the
+//   lock is released. This does not waste CPU, but going to sleep and being
+//   woken up are system calls, which take microseconds.
+// A hybrid mutex spins for a short while first, since critical sections like
+// `count += 1` are usually over in nanoseconds, and only sleeps if the lock
+// is still taken after that. When no other thread holds the lock, taking and
+// releasing it is a single atomic instruction each, with no system call.
+
+// On Linux, the sleeping part uses a futex ("fast userspace mutex"): the
+// futex system call puts a thread to sleep only if a given memory location
+// still holds an expected value, and wakes threads sleeping on that
+// location. The lock follows mutex #3 from Ulrich Drepper's paper "Futexes
+// Are Tricky": https://akkadia.org/drepper/futex.pdf. On other systems, the
+// sleeping part falls back to std::this_thread::yield.
+
+// HybridMutex has the same lock, unlock and try_lock methods as std::mutex,
+// so it works with std::scoped_lock and std::unique_lock.
+
+// Includes std::min.
+#include <algorithm>
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the spin and wait phases.
+#include <chrono>
+// Includes fixed-width integer types like uint32_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the vector container library header.
+#include <vector>
+
+#ifdef __linux__
+// Includes the futex operation constants.
+#include <linux/futex.h>
+// Includes SYS_futex, the futex system call number.
+#include <sys/syscall.h>
+// Includes syscall, since glibc has no wrapper function for futex.
+#include <unistd.h>
+#endif
+
+// Counters describing how a HybridMutex has been used.
+struct MutexStats {
+  // How many times the lock was taken.
+  uint64_t acquisitions_;
+  // How many of those found the lock already taken, and had to spin or sleep.
+  uint64_t contended_;
+  // How many times a thread went to sleep in the kernel.
+  uint64_t sleeps_;
+  // The total time contended acquisitions spent spinning and sleeping.
+  uint64_t spin_ns_;
+  uint64_t wait_ns_;
+};
+
+class HybridMutex {
+ public:
+  void lock() {
+    // The fast path: the lock is free, and we take it with one instruction.
+    uint32_t expected = kUnlocked;
+    if (state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+      RecordAcquisition(false, 0, 0, 0);
+      return;
+    }
+    LockContended();
+  }
+
+  bool try_lock() {
+    uint32_t expected = kUnlocked;
+    if (state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+      RecordAcquisition(false, 0, 0, 0);
+      return true;
+    }
+    return false;
+  }
+
+  void unlock() {
+    // If the state was kLockedWithSleepers, some thread may be asleep in the
+    // kernel waiting for this lock, so we wake one of them up. Otherwise,
+    // unlocking needs no system call.
+    if (state_.exchange(kUnlocked, std::memory_order_release) == kLockedWithSleepers) {
+      FutexWake();
+    }
+  }
+
+  // Returns a copy of the statistics. It can be called at any time, but the
+  // counters are read one at a time, so they may not all be from the same
+  // moment if other threads are taking the lock.
+  MutexStats GetStats() const {
+    return MutexStats{acquisitions_.load(std::memory_order_relaxed), contended_.load(std::memory_order_relaxed),
+                      sleeps_.load(std::memory_order_relaxed), spin_ns_.load(std::memory_order_relaxed),
+                      wait_ns_.load(std::memory_order_relaxed)};
+  }
+
+ private:
+  // The three states of the lock word. Keeping "locked, and nobody is asleep"
+  // separate from "locked, and someone may be asleep" is what lets unlock
+  // skip the wake-up system call in the common case.
+  static constexpr uint32_t kUnlocked = 0;
+  static constexpr uint32_t kLocked = 1;
+  static constexpr uint32_t kLockedWithSleepers = 2;
+
+  // The most spin iterations before going to sleep, and the longest pause
+  // between two checks of the lock word.
+  static constexpr int kMaxSpins = 100;
+  static constexpr int kMaxBackoff = 64;
+
+  void LockContended() {
+    auto start = std::chrono::steady_clock::now();
+    // Spin, checking the lock word with an exponentially growing number of
+    // pause instructions in between, so that many spinning threads do not
+    // flood the cache line with requests. The spin limit adapts like glibc's
+    // adaptive mutex: it drifts toward the number of spins it took to get
+    // the lock recently, so a lock that is usually released quickly spins a
+    // little longer, and a lock that is held for long stops wasting time
+    // spinning.
+    int max_spins = std::min(kMaxSpins, spin_limit_.load(std::memory_order_relaxed) * 2 + 10);
+    int backoff = 1;
+    for (int spins = 0; spins < max_spins; ++spins) {
+      if (state_.load(std::memory_order_relaxed) == kUnlocked) {
+        uint32_t expected = kUnlocked;
+        if (state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+          int limit = spin_limit_.load(std::memory_order_relaxed);
+          spin_limit_.store(limit + (spins - limit) / 8, std::memory_order_relaxed);
+          RecordAcquisition(true, 0, ElapsedNs(start), 0);
+          return;
+        }
+      }
+      for (int i = 0; i < backoff; ++i) {
+        Pause();
+      }
+      backoff = std::min(backoff * 2, kMaxBackoff);
+    }
+    int limit = spin_limit_.load(std::memory_order_relaxed);
+    spin_limit_.store(limit + (max_spins - limit) / 8, std::memory_order_relaxed);
+
+    // Sleep. We set the state to kLockedWithSleepers before sleeping, so
+    // that the thread holding the lock knows to wake us up. If the exchange
+    // returns kUnlocked, the lock was free and we now hold it (in the
+    // kLockedWithSleepers state, which only costs an unnecessary wake-up
+    // later, since we cannot tell whether other threads are still asleep).
+    auto wait_start = std::chrono::steady_clock::now();
+    uint64_t spin_ns = ElapsedNs(start);
+    uint64_t sleeps = 0;
+    while (state_.exchange(kLockedWithSleepers, std::memory_order_acquire) != kUnlocked) {
+      FutexWait(kLockedWithSleepers);
+      ++sleeps;
+    }
+    RecordAcquisition(true, sleeps, spin_ns, ElapsedNs(wait_start));
+  }
+
+  // The statistics are only updated by the thread that holds the lock, so
+  // they do not need atomic read-modify-write instructions. They are atomics
+  // only so that GetStats can read them from other threads safely.
+  void RecordAcquisition(bool contended, uint64_t sleeps, uint64_t spin_ns, uint64_t wait_ns) {
+    Bump(&acquisitions_, 1);
+    if (contended) {
+      Bump(&contended_, 1);
+      Bump(&sleeps_, sleeps);
+      Bump(&spin_ns_, spin_ns);
+      Bump(&wait_ns_, wait_ns);
+    }
+  }
+
+  static void Bump(std::atomic<uint64_t> *counter, uint64_t delta) {
+    counter->store(counter->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  static uint64_t ElapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Tells the CPU that we are in a spin loop. On x86, the pause instruction
+  // saves power and lets the other hyperthread on the same core run faster.
+  static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  // Sleeps until woken, but only if state_ still equals expected. The check
+  // and the sleep happen atomically in the kernel, so a wake-up between our
+  // last check and the sleep cannot be lost. It may also return early for no
+  // reason (a spurious wake-up), which is why the caller loops.
+  void FutexWait(uint32_t expected) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+    (void)expected;
+    std::this_thread::yield();
+#endif
+  }
+
+  void FutexWake() {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+  // The futex system call works on a plain 32-bit integer, so the lock word
+  // must have exactly that layout.
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32-bit lock word");
+  std::atomic<uint32_t> state_{kUnlocked};
+  std::atomic<int> spin_limit_{0};
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  std::atomic<uint64_t> sleeps_{0};
+  std::atomic<uint64_t> spin_ns_{0};
+  std::atomic<uint64_t> wait_ns_{0};
+};
+
+// Has num_threads threads each increment count increments times, in the
+// add_count style from mutex.cpp, and returns how many milliseconds it took.
+template <typename Mutex>
+long long RunAddCount(Mutex *m, size_t num_threads, size_t increments, int *count) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&] {
+      for (size_t j = 0; j < increments; ++j) {
+        std::scoped_lock slk(*m);
+        *count += 1;
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from scoped_lock.cpp with a HybridMutex.
+  int count = 0;
+  HybridMutex m;
+  auto add_count = [&] {
+    std::scoped_lock slk(m);
+    count += 1;
+  };
+  std::thread t1(add_count);
+  std::thread t2(add_count);
+  t1.join();
+  t2.join();
+  {
+    // std::unique_lock works too.
+    std::unique_lock lk(m, std::try_to_lock);
+    if (lk.owns_lock()) {
+      count += 1;
+    }
+  }
+  MutexStats stats = m.GetStats();
+  std::cout << "Printing count: " << count << " (" << stats.acquisitions_ << " acquisitions, " << stats.contended_
+            << " contended)" << std::endl;
+
+  // Now the benchmark. Each thread increments the count the number of times
+  // passed as the first argument.
+  size_t increments = argc > 1 ? std::stoul(argv[1]) : 200000;
+  std::cout << "Each thread increments " << increments << " times:\n";
+  std::cout << "threads  std::mutex ms  HybridMutex ms  contended  sleeps  spin ms  wait ms\n";
+  for (size_t num_threads = 1; num_threads <= 16; num_threads *= 2) {
+    int std_count = 0;
+    int hybrid_count = 0;
+    std::mutex std_mutex;
+    HybridMutex hybrid_mutex;
+    long long std_ms = RunAddCount(&std_mutex, num_threads, increments, &std_count);
+    long long hybrid_ms = RunAddCount(&hybrid_mutex, num_threads, increments, &hybrid_count);
+    if (std_count != hybrid_count) {
+      std::cout << "Count mismatch with " << num_threads << " threads!\n";
+      return 1;
+    }
+    MutexStats s = hybrid_mutex.GetStats();
+    std::cout << num_threads << "\t " << std_ms << "\t\t" << hybrid_ms << "\t\t" << s.contended_ << "\t   " << s.sleeps_
+              << "\t   " << s.spin_ns_ / 1000000 << "\t    " << s.wait_ns_ / 1000000 << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,324 @@
+/**
+ * @file incremental_rehash.cpp
+ * @brief Tutorial code for a hash map that grows by rehashing incrementally.
+ */
+
+// When a std::unordered_map (see unordered_maps.cpp) runs out of buckets, the
+// insert that crossed the limit allocates a bigger bucket array and moves
+// every single element into it before returning. Most inserts are fast, but
+// that one insert is not: for a map with tens of millions of entries it can
+// take hundreds of milliseconds. If your program has a latency target for
+// every request, that pause is exactly the kind of outlier that breaks it.
+
+// The fix, used by systems like Redis, is to spread the rehash out over time.
+// When the map needs to grow, it allocates the new bucket array but keeps the
+// old one around. From then on, every insert and lookup migrates a small,
+// bounded number of buckets from the old array to the new one before doing
+// its own work. While the migration is in progress, a lookup checks both
+// arrays, and new keys always go into the new array. Once the old array is
+// empty, it is freed and the map goes back to using a single array. The total
+// amount of work is the same as before, but no single operation pays for all
+// of it.
+
+// This file implements such a map, with a mode switch so that the same code
+// can also rehash all at once. At the bottom of main, a benchmark measures the
+// latency of every insert into std::unordered_map and both modes of our map,
+// and prints the percentiles. Look at the p999 and max columns!
+
+// Includes std::sort and std::max.
+#include <algorithm>
+// Includes std::chrono for timing each insert.
+#include <chrono>
+// Includes std::calloc and std::free.
+#include <cstdlib>
+// Includes std::hash.
+#include <functional>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::bad_alloc.
+#include <new>
+// Includes std::string.
+#include <string>
+// Includes the unordered_map container library header for the benchmark.
+#include <unordered_map>
+// Includes the vector container library header.
+#include <vector>
+
+// The two ways that our map can grow.
+enum class RehashMode { kAllAtOnce, kIncremental };
+
+// The IncrementalHashMap class is a hash map that uses separate chaining, just
+// like std::unordered_map: each bucket is a singly linked list of nodes. It
+// keeps up to two bucket arrays. tables_[0] is the main array. While a rehash
+// is in progress, tables_[1] is the new, larger array, and rehash_index_ is
+// the first bucket of tables_[0] that has not been migrated yet.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class IncrementalHashMap {
+ public:
+  // Every insert or lookup moves at most this many non-empty buckets.
+  static constexpr size_t kBucketsPerStep = 4;
+
+  explicit IncrementalHashMap(RehashMode mode = RehashMode::kIncremental) : mode_(mode) {
+    tables_[0] = AllocateTable(kInitialBuckets);
+  }
+
+  // Destructor for the map. Every node and every bucket array was allocated
+  // by this class, so the destructor must free all of them.
+  ~IncrementalHashMap() {
+    for (Table &table : tables_) {
+      for (size_t i = 0; i < table.num_buckets_; ++i) {
+        Node *node = table.buckets_[i];
+        while (node != nullptr) {
+          Node *next = node->next_;
+          delete node;
+          node = next;
+        }
+      }
+      std::free(table.buckets_);
+    }
+  }
+
+  // We delete the copy constructor and the copy assignment operator, since the
+  // map owns its nodes (see wrapper_class.cpp).
+  IncrementalHashMap(const IncrementalHashMap &) = delete;
+  IncrementalHashMap &operator=(const IncrementalHashMap &) = delete;
+
+  // Inserts a key-value pair, or overwrites the value if the key already
+  // exists. It returns true if a new key was inserted.
+  bool Insert(const K &key, const V &value) {
+    RehashStep();
+    size_t hash = hasher_(key);
+    if (V *existing = FindWithHash(key, hash); existing != nullptr) {
+      *existing = value;
+      return false;
+    }
+
+    // New keys always go into the newest table, so the old table only ever
+    // shrinks while a rehash is in progress.
+    Table &table = IsRehashing() ? tables_[1] : tables_[0];
+    Node *&head = table.buckets_[hash & (table.num_buckets_ - 1)];
+    head = new Node{key, value, hash, head};
+    ++table.size_;
+
+    if (!IsRehashing() && tables_[0].size_ > tables_[0].num_buckets_) {
+      StartRehash();
+    }
+    return true;
+  }
+
+  // Looks up a key. It returns a pointer to the value if the key exists, and
+  // nullptr otherwise. Lookups also help with the migration, which is why
+  // this function is not const.
+  V *Find(const K &key) {
+    RehashStep();
+    return FindWithHash(key, hasher_(key));
+  }
+
+  // Removes a key. It returns whether the key existed.
+  bool Erase(const K &key) {
+    RehashStep();
+    size_t hash = hasher_(key);
+    for (Table &table : tables_) {
+      if (table.buckets_ == nullptr) {
+        continue;
+      }
+      Node **link = &table.buckets_[hash & (table.num_buckets_ - 1)];
+      for (; *link != nullptr; link = &(*link)->next_) {
+        if ((*link)->hash_ == hash && (*link)->key_ == key) {
+          Node *victim = *link;
+          *link = victim->next_;
+          delete victim;
+          --table.size_;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Getter functions.
+  size_t Size() const { return tables_[0].size_ + tables_[1].size_; }
+  bool IsRehashing() const { return tables_[1].buckets_ != nullptr; }
+  size_t BucketCount() const { return IsRehashing() ? tables_[1].num_buckets_ : tables_[0].num_buckets_; }
+
+ private:
+  static constexpr size_t kInitialBuckets = 16;
+
+  struct Node {
+    K key_;
+    V value_;
+    size_t hash_;
+    Node *next_;
+  };
+
+  struct Table {
+    Node **buckets_{nullptr};
+    size_t num_buckets_{0};
+    size_t size_{0};
+  };
+
+  // We allocate bucket arrays with std::calloc rather than new[]. Large
+  // calloc'd blocks come straight from the operating system, which hands out
+  // pages that are already zero, so allocating a huge new array does not
+  // require touching all of its memory up front.
+  static Table AllocateTable(size_t num_buckets) {
+    Table table;
+    table.buckets_ = static_cast<Node **>(std::calloc(num_buckets, sizeof(Node *)));
+    if (table.buckets_ == nullptr) {
+      throw std::bad_alloc();
+    }
+    table.num_buckets_ = num_buckets;
+    return table;
+  }
+
+  V *FindWithHash(const K &key, size_t hash) {
+    for (Table &table : tables_) {
+      if (table.buckets_ == nullptr) {
+        continue;
+      }
+      for (Node *node = table.buckets_[hash & (table.num_buckets_ - 1)]; node != nullptr; node = node->next_) {
+        if (node->hash_ == hash && node->key_ == key) {
+          return &node->value_;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Allocates the new, twice as large bucket array. In kAllAtOnce mode, we
+  // then migrate every bucket right away, just like std::unordered_map does.
+  void StartRehash() {
+    tables_[1] = AllocateTable(tables_[0].num_buckets_ * 2);
+    rehash_index_ = 0;
+    if (mode_ == RehashMode::kAllAtOnce) {
+      while (IsRehashing()) {
+        MigrateBuckets(tables_[0].num_buckets_);
+      }
+    }
+  }
+
+  void RehashStep() {
+    if (IsRehashing()) {
+      MigrateBuckets(kBucketsPerStep);
+    }
+  }
+
+  // Moves up to `count` non-empty buckets from the old table to the new one.
+  // Runs of empty buckets also cost time to skip over, so we stop after
+  // visiting ten empty buckets per bucket we were asked to move. This keeps
+  // the work done by a single call bounded.
+  void MigrateBuckets(size_t count) {
+    Table &old_table = tables_[0];
+    Table &new_table = tables_[1];
+    size_t empty_visits = count * 10;
+    while (count > 0 && rehash_index_ < old_table.num_buckets_) {
+      Node *node = old_table.buckets_[rehash_index_];
+      if (node == nullptr) {
+        ++rehash_index_;
+        if (--empty_visits == 0) {
+          break;
+        }
+        continue;
+      }
+      // We reuse the nodes and only relink them, so migrating a key never
+      // allocates or copies the key and value.
+      while (node != nullptr) {
+        Node *next = node->next_;
+        Node *&head = new_table.buckets_[node->hash_ & (new_table.num_buckets_ - 1)];
+        node->next_ = head;
+        head = node;
+        --old_table.size_;
+        ++new_table.size_;
+        node = next;
+      }
+      old_table.buckets_[rehash_index_++] = nullptr;
+      --count;
+    }
+
+    // Once every bucket has been migrated, the new table becomes the main one.
+    if (rehash_index_ == old_table.num_buckets_) {
+      std::free(old_table.buckets_);
+      tables_[0] = new_table;
+      tables_[1] = Table{};
+      rehash_index_ = 0;
+    }
+  }
+
+  RehashMode mode_;
+  Hash hasher_;
+  Table tables_[2];
+  size_t rehash_index_{0};
+};
+
+// Inserts keys 0 through n - 1 into a map, timing each insert individually,
+// and prints the latency percentiles. InsertFn is any callable that inserts
+// one key, so we can use the same function for every map type.
+template <typename InsertFn>
+void BenchmarkInserts(const std::string &name, size_t n, InsertFn insert) {
+  std::vector<int64_t> latencies(n);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    auto before = std::chrono::steady_clock::now();
+    insert(static_cast<int64_t>(i));
+    latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before)
+                       .count();
+  }
+  auto total = std::chrono::steady_clock::now() - start;
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) { return latencies[static_cast<size_t>(p * (latencies.size() - 1))]; };
+  std::cout << name << ": total " << std::chrono::duration_cast<std::chrono::milliseconds>(total).count()
+            << " ms, p50 " << percentile(0.50) << " ns, p99 " << percentile(0.99) << " ns, p999 "
+            << percentile(0.999) << " ns, max " << latencies.back() / 1000 << " us\n";
+}
+
+int main(int argc, char *argv[]) {
+  // First, the basics. The interface is similar to std::unordered_map, except
+  // that Find returns a pointer to the value rather than an iterator.
+  IncrementalHashMap<std::string, int> map;
+  map.Insert("foo", 2);
+  map.Insert("jignesh", 445);
+  map.Insert("spam", 1);
+  map.Insert("spam", 15);
+  if (int *value = map.Find("jignesh"); value != nullptr) {
+    std::cout << "Found key jignesh with value " << *value << std::endl;
+  }
+  map.Erase("foo");
+  if (map.Find("foo") == nullptr) {
+    std::cout << "Key foo does not exist in the map anymore.\n";
+  }
+
+  // Now let's watch a migration happen. We insert keys until the map starts
+  // rehashing, and then count how many more operations it takes to finish.
+  IncrementalHashMap<int, int> small_map;
+  int key = 0;
+  while (!small_map.IsRehashing()) {
+    small_map.Insert(key, key);
+    ++key;
+  }
+  std::cout << "Started rehashing into " << small_map.BucketCount() << " buckets after " << key << " inserts.\n";
+  int operations = 0;
+  while (small_map.IsRehashing()) {
+    small_map.Find(operations++);
+  }
+  std::cout << "The migration finished after " << operations << " more lookups.\n";
+
+  // Finally, the benchmark. You can pass the number of keys as the first
+  // argument; the default is ten million, which grows each map many times.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 10000000;
+  std::cout << "Timing " << n << " inserts into each map:\n";
+  {
+    std::unordered_map<int64_t, int64_t> std_map;
+    BenchmarkInserts("std::unordered_map    ", n, [&std_map](int64_t k) { std_map.emplace(k, k); });
+  }
+  {
+    IncrementalHashMap<int64_t, int64_t> all_at_once(RehashMode::kAllAtOnce);
+    BenchmarkInserts("kAllAtOnce rehashing  ", n, [&all_at_once](int64_t k) { all_at_once.Insert(k, k); });
+  }
+  {
+    IncrementalHashMap<int64_t, int64_t> incremental(RehashMode::kIncremental);
+    BenchmarkInserts("kIncremental rehashing", n, [&incremental](int64_t k) { incremental.Insert(k, k); });
+  }
+
+  return 0;
+}
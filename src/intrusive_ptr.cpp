@@ -0,0 +1,278 @@
+/**
+ * @file intrusive_ptr.cpp
+ * @brief Tutorial code for an intrusive reference-counted pointer, which keeps
+ * the reference count inside the object, and can skip atomic operations in
+ * single-threaded code.
+ */
+
+// shared_ptr.cpp shows how std::shared_ptrs share ownership of one object by
+// counting references. std::shared_ptr pays for its flexibility in two ways:
+// - The reference count lives in a separate "control block". std::make_shared
+//   puts the control block and the object in one allocation, but each
+//   std::shared_ptr is still two pointers wide (one to the object, one to the
+//   control block), and std::shared_ptr<Point>(new Point) needs two
+//   allocations.
+// - Once a program has started a second thread, the reference count is
+//   always updated with atomic instructions, since std::shared_ptr cannot
+//   know whether another thread holds a copy. An atomic increment costs
+//   several times as much as a plain one, even when only one thread ever
+//   touches the pointer.
+
+// An intrusive pointer (like boost::intrusive_ptr) keeps the count inside the
+// object itself: the object's class derives from RefCounted, which holds the
+// count. The pointer is then just one raw pointer, there is nothing extra to
+// allocate, and a raw T* (even `this`) can always be turned back into an
+// owning pointer, since the count is found through the object.
+
+// Since the object's class picks its own count type, a class that is only
+// ever used by one thread can pick a plain integer count (LocalRefCount), and
+// skip the atomic operations. Classes shared between threads pick
+// AtomicRefCount. Using a LocalRefCount object from several threads at once
+// is a data race, so the choice has to be made carefully.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint32_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::shared_ptr functionality.
+#include <memory>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes std::is_convertible and std::enable_if_t.
+#include <type_traits>
+// Includes the utility header for std::move, std::forward and std::swap.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// A reference count that may be changed by several threads at once.
+// Incrementing can be relaxed, since a thread can only add a reference if it
+// already holds one. Decrementing must be acq_rel, so that the thread that
+// drops the last reference sees every other thread's writes to the object
+// before deleting it.
+class AtomicRefCount {
+ public:
+  void Increment() { count_.fetch_add(1, std::memory_order_relaxed); }
+  // Returns true if this dropped the last reference.
+  bool Decrement() { return count_.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+  uint32_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint32_t> count_{0};
+};
+
+// A reference count for objects that only one thread uses at a time.
+class LocalRefCount {
+ public:
+  void Increment() { ++count_; }
+  bool Decrement() { return --count_ == 0; }
+  uint32_t Count() const { return count_; }
+
+ private:
+  uint32_t count_ = 0;
+};
+
+// Classes that IntrusivePtr can point to derive from RefCounted, with
+// AtomicRefCount or LocalRefCount. If an IntrusivePtr to a base class may own
+// a derived object, the base class needs a virtual destructor, just like with
+// delete.
+template <typename CountPolicy>
+class RefCounted {
+ public:
+  uint32_t UseCount() const { return ref_count_.Count(); }
+
+  void AddRef() const { ref_count_.Increment(); }
+
+  // Drops a reference, and returns true if it was the last one, in which
+  // case the caller deletes the object.
+  bool Release() const { return ref_count_.Decrement(); }
+
+ protected:
+  RefCounted() = default;
+  // A copy of an object is a new object, with no references yet.
+  RefCounted(const RefCounted & /*other*/) {}
+  RefCounted &operator=(const RefCounted & /*other*/) { return *this; }
+  ~RefCounted() = default;
+
+ private:
+  // mutable, so that IntrusivePtr<const T> works too.
+  mutable CountPolicy ref_count_;
+};
+
+// The IntrusivePtr class works like std::shared_ptr, for classes that derive
+// from RefCounted.
+template <typename T>
+class IntrusivePtr {
+ public:
+  IntrusivePtr() = default;
+
+  // Takes a reference to ptr. Unlike std::shared_ptr, this is safe to do
+  // more than once for the same object, since all IntrusivePtrs to an object
+  // share the count inside it.
+  explicit IntrusivePtr(T *ptr) : ptr_(ptr) {
+    if (ptr_ != nullptr) {
+      ptr_->AddRef();
+    }
+  }
+
+  IntrusivePtr(const IntrusivePtr &other) : IntrusivePtr(other.ptr_) {}
+  IntrusivePtr(IntrusivePtr &&other) noexcept : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+
+  // Converts from IntrusivePtr<Derived> to IntrusivePtr<Base>.
+  template <typename U, typename = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+  IntrusivePtr(const IntrusivePtr<U> &other) : IntrusivePtr(other.get()) {}  // NOLINT
+
+  ~IntrusivePtr() { reset(); }
+
+  // Copy-and-swap handles self-assignment, and releases our old object only
+  // after taking the new reference.
+  IntrusivePtr &operator=(IntrusivePtr other) noexcept {
+    std::swap(ptr_, other.ptr_);
+    return *this;
+  }
+
+  void reset() {
+    if (ptr_ != nullptr && ptr_->Release()) {
+      delete ptr_;
+    }
+    ptr_ = nullptr;
+  }
+
+  T *get() const { return ptr_; }
+  T &operator*() const { return *ptr_; }
+  T *operator->() const { return ptr_; }
+  explicit operator bool() const { return ptr_ != nullptr; }
+  uint32_t use_count() const { return ptr_ == nullptr ? 0 : ptr_->UseCount(); }
+
+  bool operator==(const IntrusivePtr &other) const { return ptr_ == other.ptr_; }
+  bool operator!=(const IntrusivePtr &other) const { return ptr_ != other.ptr_; }
+
+ private:
+  T *ptr_ = nullptr;
+};
+
+// Creates a T, like std::make_shared.
+template <typename T, typename... Args>
+IntrusivePtr<T> make_intrusive(Args &&...args) {
+  return IntrusivePtr<T>(new T(std::forward<Args>(args)...));
+}
+
+// The point class from shared_ptr.cpp, with a reference count built in. The
+// count policy is a template parameter, so the benchmark can compare both.
+template <typename CountPolicy>
+class CountedPoint : public RefCounted<CountPolicy> {
+ public:
+  CountedPoint() : x_(0), y_(0) {}
+  CountedPoint(int x, int y) : x_(x), y_(y) {}
+  inline int GetX() const { return x_; }
+  inline int GetY() const { return y_; }
+  inline void SetX(int x) { x_ = x; }
+  inline void SetY(int y) { y_ = y; }
+
+ private:
+  int x_;
+  int y_;
+};
+
+using Point = CountedPoint<AtomicRefCount>;
+using LocalPoint = CountedPoint<LocalRefCount>;
+
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Simulates a pipeline stage: copies pointers to batch_size distinct objects
+// into a batch, reads through them, and destroys the batch, rounds times.
+// Each round is batch_size copies and batch_size destructions. It returns the
+// sum of the x coordinates, so that the compiler cannot skip the work.
+template <typename Ptr>
+long long CopyAndDestroy(const std::vector<Ptr> &objects, size_t rounds) {
+  long long sum = 0;
+  std::vector<Ptr> batch;
+  batch.reserve(objects.size());
+  for (size_t round = 0; round < rounds; ++round) {
+    for (const Ptr &object : objects) {
+      batch.push_back(object);
+    }
+    for (const Ptr &copy : batch) {
+      sum += copy->GetX();
+    }
+    batch.clear();
+  }
+  return sum;
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the use_count part of shared_ptr.cpp with IntrusivePtr.
+  IntrusivePtr<Point> s1;
+  IntrusivePtr<Point> s3 = make_intrusive<Point>(2, 3);
+  std::cout << "Pointer s1 is " << (s1 ? "not empty" : "empty") << std::endl;
+  std::cout << "Number of intrusive pointers to s3's data: " << s3.use_count() << std::endl;
+  IntrusivePtr<Point> s4 = s3;
+  IntrusivePtr<Point> s5(s4);
+  std::cout << "After two copies: " << s3.use_count() << std::endl;
+  IntrusivePtr<Point> s6 = std::move(s5);
+  std::cout << "After two copies and a move: " << s3.use_count() << std::endl;
+
+  // Since the count is inside the object, an owning pointer can be made from
+  // a raw pointer again. With std::shared_ptr, this would create a second
+  // control block, and the object would be deleted twice.
+  Point *raw = s3.get();
+  IntrusivePtr<Point> s7(raw);
+  std::cout << "After adopting the raw pointer again: " << s3.use_count() << std::endl;
+  s3->SetX(445);
+  std::cout << "Printing x in s7: " << s7->GetX() << std::endl;
+
+  std::cout << "sizeof(std::shared_ptr<Point>) = " << sizeof(std::shared_ptr<Point>)
+            << ", sizeof(IntrusivePtr<Point>) = " << sizeof(IntrusivePtr<Point>) << std::endl;
+
+  // Now the benchmark. The number of copy/destroy rounds over 1024 objects
+  // can be passed as the first argument.
+  size_t rounds = argc > 1 ? std::stoul(argv[1]) : 10000;
+  const size_t batch_size = 1024;
+  std::vector<std::shared_ptr<Point>> shared_objects;
+  std::vector<IntrusivePtr<Point>> atomic_objects;
+  std::vector<IntrusivePtr<LocalPoint>> local_objects;
+  for (size_t i = 0; i < batch_size; ++i) {
+    shared_objects.push_back(std::make_shared<Point>(static_cast<int>(i), 0));
+    atomic_objects.push_back(make_intrusive<Point>(static_cast<int>(i), 0));
+    local_objects.push_back(make_intrusive<LocalPoint>(static_cast<int>(i), 0));
+  }
+
+  // libstdc++'s std::shared_ptr already skips atomic instructions while the
+  // process has only ever had one thread. Real pipelines usually have other
+  // threads around (a logger, a thread pool), so we measure both before and
+  // after starting a thread. IntrusivePtr's cost does not change.
+  std::cout << rounds * batch_size << " copies and destructions (times in ms):\n";
+  std::cout << "                               one thread  after starting a thread\n";
+  long long shared_ms[2];
+  long long atomic_ms[2];
+  long long local_ms[2];
+  for (int run = 0; run < 2; ++run) {
+    if (run == 1) {
+      std::thread([] {}).join();
+    }
+    long long sums[3];
+    shared_ms[run] = TimeMs([&] { sums[0] = CopyAndDestroy(shared_objects, rounds); });
+    atomic_ms[run] = TimeMs([&] { sums[1] = CopyAndDestroy(atomic_objects, rounds); });
+    local_ms[run] = TimeMs([&] { sums[2] = CopyAndDestroy(local_objects, rounds); });
+    if (sums[0] != sums[1] || sums[1] != sums[2]) {
+      std::cout << "The pointers disagree!\n";
+      return 1;
+    }
+  }
+  std::cout << "std::shared_ptr                " << shared_ms[0] << "\t    " << shared_ms[1] << "\n";
+  std::cout << "IntrusivePtr, AtomicRefCount   " << atomic_ms[0] << "\t    " << atomic_ms[1] << "\n";
+  std::cout << "IntrusivePtr, LocalRefCount    " << local_ms[0] << "\t    " << local_ms[1] << "\n";
+
+  return 0;
+}
@@ -0,0 +1,436 @@
+/**
+ * @file lock_order.cpp
+ * @brief Tutorial code for a mutex that, in debug builds, checks that locks
+ * are always taken in a consistent order, and reports possible deadlocks.
+ */
+
+// scoped_lock.cpp shows that std::scoped_lock can take several mutexes at
+// once without deadlocking. But most deadlocks do not come from one call
+// that takes two locks. They come from two pieces of code, often far apart,
+// that take the same two locks one after another, in opposite orders:
+//
+//   void Transfer(Account *from, Account *to) {
+//     std::scoped_lock from_lock(from->latch_);
+//     std::scoped_lock to_lock(to->latch_);
+//     ...
+//   }
+//
+// Transfer(a, b) on one thread and Transfer(b, a) on another can deadlock:
+// each thread holds the lock the other one is waiting for. This only happens
+// if both threads get between their two lock calls at the same time, so the
+// bug can hide through every test and show up under production load.
+
+// The way to catch such bugs early is to check lock ordering, the way the
+// Linux kernel's lockdep and Abseil's absl::Mutex do. Every time a thread
+// takes lock B while holding lock A, we record the edge A -> B in a global
+// lock order graph. If the graph ever has a cycle, such as A -> B and B -> A,
+// some two (or more) threads could deadlock, even if they did not this time.
+// So one run that takes both orders, even on a single thread, is enough to
+// find the bug. The report includes the stack where each edge of the cycle
+// was first recorded, since those are the two places that need fixing.
+
+// Recording the graph costs time on every lock, so CheckedMutex only checks
+// in debug builds. When NDEBUG is defined (as in CMake's Release builds),
+// CheckedMutex is a std::mutex with one extra constructor, and costs exactly
+// as much as a std::mutex.
+
+// Includes std::find and std::reverse.
+#include <algorithm>
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::free.
+#include <cstdlib>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::set.
+#include <set>
+// Includes std::ostringstream, for building reports.
+#include <sstream>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the unordered_map container library header.
+#include <unordered_map>
+// Includes std::pair.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+#ifdef __linux__
+// Includes backtrace and backtrace_symbols, for stack traces.
+#include <execinfo.h>
+#endif
+
+#ifndef NDEBUG
+
+// A function that receives each lock order report. By default, reports are
+// printed to std::cerr; a program (or a test) can install its own handler,
+// for example to abort on the first report.
+using LockOrderHandler = void (*)(const std::string &report);
+
+// The LockOrderGraph class holds the global lock order graph. There is one
+// instance, shared by all CheckedMutexes.
+class LockOrderGraph {
+ public:
+  static LockOrderGraph &Instance() {
+    static LockOrderGraph graph;
+    return graph;
+  }
+
+  void SetHandler(LockOrderHandler handler) {
+    std::scoped_lock lk(latch_);
+    handler_ = handler;
+  }
+
+  // A lock the calling thread holds.
+  struct HeldLock {
+    uint64_t id_;
+    const char *name_;
+  };
+
+  // The locks the calling thread holds, in the order it took them.
+  static std::vector<HeldLock> &Held() {
+    thread_local std::vector<HeldLock> held;
+    return held;
+  }
+
+  // Called before the calling thread blocks waiting for the lock with the
+  // given id. It records an edge from every lock the thread holds to this
+  // one, and reports a cycle if one of the new edges closes one.
+  void BeforeLock(uint64_t id, const char *name) {
+    // Edges this thread has already recorded. Each thread checks this set
+    // first, so that taking the same locks in the same order again only
+    // costs a lookup, not a trip to the shared graph.
+    thread_local std::set<std::pair<uint64_t, uint64_t>> known;
+    for (const HeldLock &held : Held()) {
+      if (held.id_ == id) {
+        Report("Lock order violation: thread is locking " + std::string(name) +
+               ", which it already holds, and will deadlock with itself.\nStack:\n" + Format(CaptureStack()));
+        continue;
+      }
+      if (known.insert({held.id_, id}).second) {
+        AddEdge(held, HeldLock{id, name});
+      }
+    }
+  }
+
+  // Called when a CheckedMutex is destroyed, so that the graph does not keep
+  // growing in programs that create many short-lived mutexes.
+  void Forget(uint64_t id) {
+    std::scoped_lock lk(latch_);
+    auto it = nodes_.find(id);
+    if (it == nodes_.end()) {
+      return;
+    }
+    for (uint64_t from : it->second.in_) {
+      nodes_[from].out_.erase(id);
+    }
+    for (const auto &[to, stack] : it->second.out_) {
+      nodes_[to].in_.erase(std::find(nodes_[to].in_.begin(), nodes_[to].in_.end(), id));
+    }
+    nodes_.erase(it);
+  }
+
+ private:
+  struct Node {
+    const char *name_ = "";
+    // Edges to locks taken while holding this one, each with the stack
+    // where the edge was first recorded.
+    std::unordered_map<uint64_t, std::vector<void *>> out_;
+    // Locks that were held while taking this one.
+    std::vector<uint64_t> in_;
+  };
+
+  void AddEdge(const HeldLock &from, const HeldLock &to) {
+    std::string report;
+    {
+      std::scoped_lock lk(latch_);
+      Node &from_node = nodes_[from.id_];
+      Node &to_node = nodes_[to.id_];
+      from_node.name_ = from.name_;
+      to_node.name_ = to.name_;
+      if (from_node.out_.count(to.id_) > 0) {
+        // Another thread recorded this edge already.
+        return;
+      }
+      // The new edge closes a cycle if `from` is reachable from `to`.
+      std::vector<uint64_t> path = FindPath(to.id_, from.id_);
+      std::vector<void *> stack = CaptureStack();
+      if (!path.empty()) {
+        std::ostringstream out;
+        out << "Lock order violation: " << from.name_ << " -> " << to.name_
+            << " closes a cycle, so threads taking these locks may deadlock.\n";
+        for (size_t i = 0; i + 1 < path.size(); ++i) {
+          const Node &node = nodes_[path[i]];
+          out << "Earlier, " << node.name_ << " -> " << nodes_[path[i + 1]].name_ << " was taken at:\n"
+              << Format(node.out_.at(path[i + 1]));
+        }
+        out << "Now, " << from.name_ << " -> " << to.name_ << " is taken at:\n" << Format(stack);
+        report = out.str();
+      }
+      from_node.out_.emplace(to.id_, std::move(stack));
+      to_node.in_.push_back(from.id_);
+    }
+    if (!report.empty()) {
+      Report(report);
+    }
+  }
+
+  // Returns a path of lock ids from `from` to `to` in the graph, or an empty
+  // vector if there is none. This is a depth-first search that remembers
+  // how it reached each node, so the path can be read back.
+  std::vector<uint64_t> FindPath(uint64_t from, uint64_t to) {
+    std::unordered_map<uint64_t, uint64_t> reached_from{{from, from}};
+    std::vector<uint64_t> stack{from};
+    while (!stack.empty()) {
+      uint64_t id = stack.back();
+      stack.pop_back();
+      if (id == to) {
+        std::vector<uint64_t> path{to};
+        while (path.back() != from) {
+          path.push_back(reached_from[path.back()]);
+        }
+        std::reverse(path.begin(), path.end());
+        return path;
+      }
+      for (const auto &[next, edge_stack] : nodes_[id].out_) {
+        if (reached_from.emplace(next, id).second) {
+          stack.push_back(next);
+        }
+      }
+    }
+    return {};
+  }
+
+  void Report(const std::string &report) {
+    LockOrderHandler handler;
+    {
+      std::scoped_lock lk(latch_);
+      handler = handler_;
+    }
+    handler(report);
+  }
+
+  static void PrintReport(const std::string &report) { std::cerr << report << std::flush; }
+
+  static std::vector<void *> CaptureStack() {
+#ifdef __linux__
+    std::vector<void *> frames(32);
+    frames.resize(backtrace(frames.data(), static_cast<int>(frames.size())));
+    return frames;
+#else
+    return {};
+#endif
+  }
+
+  // Turns a captured stack into one line per frame, leaving out the frames
+  // of the checker itself. Function names only show up if the executable
+  // exports its symbols (-rdynamic, which CMake adds for ENABLE_EXPORTS
+  // targets).
+  static std::string Format(const std::vector<void *> &frames) {
+    std::string text;
+#ifdef __linux__
+    char **symbols = backtrace_symbols(frames.data(), static_cast<int>(frames.size()));
+    if (symbols != nullptr) {
+      size_t first = 0;
+      for (size_t i = 0; i < frames.size(); ++i) {
+        std::string symbol = symbols[i];
+        if (symbol.find("LockOrderGraph") != std::string::npos || symbol.find("CheckedMutex") != std::string::npos) {
+          first = i + 1;
+        }
+      }
+      for (size_t i = first; i < frames.size(); ++i) {
+        text += std::string("    ") + symbols[i] + "\n";
+      }
+      std::free(symbols);
+    }
+#endif
+    if (text.empty()) {
+      text = "    (no stack trace on this platform)\n";
+    }
+    return text;
+  }
+
+  std::mutex latch_;
+  LockOrderHandler handler_ = &PrintReport;
+  std::unordered_map<uint64_t, Node> nodes_;
+};
+
+// The CheckedMutex class is a mutex with the same lock, unlock and try_lock
+// methods as std::mutex, so it works with std::scoped_lock and
+// std::unique_lock. The name only shows up in reports.
+class CheckedMutex {
+ public:
+  explicit CheckedMutex(const char *name = "unnamed mutex") : id_(next_id_.fetch_add(1)), name_(name) {}
+  ~CheckedMutex() { LockOrderGraph::Instance().Forget(id_); }
+  CheckedMutex(const CheckedMutex &) = delete;
+  CheckedMutex &operator=(const CheckedMutex &) = delete;
+
+  void lock() {
+    LockOrderGraph::Instance().BeforeLock(id_, name_);
+    mutex_.lock();
+    LockOrderGraph::Held().push_back({id_, name_});
+  }
+
+  // try_lock never waits, so it cannot deadlock, and records no edges. This
+  // also keeps std::scoped_lock with several mutexes from causing reports,
+  // since it uses try_lock for all but one of them.
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    LockOrderGraph::Held().push_back({id_, name_});
+    return true;
+  }
+
+  // Locks are not always released in the opposite order they were taken, so
+  // we search for this one.
+  void unlock() {
+    std::vector<LockOrderGraph::HeldLock> &held = LockOrderGraph::Held();
+    for (size_t i = held.size(); i-- > 0;) {
+      if (held[i].id_ == id_) {
+        held.erase(held.begin() + i);
+        break;
+      }
+    }
+    mutex_.unlock();
+  }
+
+ private:
+  // Ids are never reused, unlike addresses, so a new mutex never inherits a
+  // destroyed mutex's edges.
+  static inline std::atomic<uint64_t> next_id_{0};
+
+  std::mutex mutex_;
+  uint64_t id_;
+  const char *name_;
+};
+
+void SetLockOrderHandler(LockOrderHandler handler) { LockOrderGraph::Instance().SetHandler(handler); }
+
+constexpr bool kLockOrderChecks = true;
+
+#else
+
+using LockOrderHandler = void (*)(const std::string &report);
+
+// In release builds, CheckedMutex is just a std::mutex that accepts a name.
+class CheckedMutex : public std::mutex {
+ public:
+  explicit CheckedMutex(const char * /*name*/ = "unnamed mutex") {}
+};
+
+static_assert(sizeof(CheckedMutex) == sizeof(std::mutex), "release builds must not add any state");
+
+inline void SetLockOrderHandler(LockOrderHandler /*handler*/) {}
+
+constexpr bool kLockOrderChecks = false;
+
+#endif
+
+// Counts reports, so that main can show how many it got.
+std::atomic<int> reports{0};
+
+void CountAndPrintReport(const std::string &report) {
+  reports += 1;
+  std::cout << report << "\n";
+}
+
+// The Account struct and Transfer function are the example from the top of
+// the file.
+struct Account {
+  explicit Account(const char *name, int balance) : latch_(name), balance_(balance) {}
+  CheckedMutex latch_;
+  int balance_;
+};
+
+void Transfer(Account *from, Account *to, int amount) {
+  std::scoped_lock from_lock(from->latch_);
+  std::scoped_lock to_lock(to->latch_);
+  from->balance_ -= amount;
+  to->balance_ += amount;
+}
+
+// The same, but with one std::scoped_lock for both locks, which is the fix.
+void SafeTransfer(Account *from, Account *to, int amount) {
+  std::scoped_lock lk(from->latch_, to->latch_);
+  from->balance_ -= amount;
+  to->balance_ += amount;
+}
+
+// Locks and unlocks two mutexes, one inside the other, iterations times,
+// and returns how many milliseconds it took.
+template <typename Mutex>
+long long NestedLocking(size_t iterations) {
+  Mutex outer;
+  Mutex inner;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    std::scoped_lock outer_lock(outer);
+    std::scoped_lock inner_lock(inner);
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  std::cout << "Lock order checks are " << (kLockOrderChecks ? "on" : "off (NDEBUG is defined)") << ".\n";
+  SetLockOrderHandler(&CountAndPrintReport);
+
+  // We repeat the example from scoped_lock.cpp with a CheckedMutex. Taking
+  // one lock at a time never causes a report.
+  int count = 0;
+  CheckedMutex m("m");
+  auto add_count = [&] {
+    std::scoped_lock slk(m);
+    count += 1;
+  };
+  std::thread t1(add_count);
+  std::thread t2(add_count);
+  t1.join();
+  t2.join();
+  std::cout << "Printing count: " << count << std::endl;
+
+  // The transfers run one after the other, so they cannot actually
+  // deadlock, but the second one takes the locks in the opposite order, and
+  // is reported.
+  Account alice("alice", 100);
+  Account bob("bob", 100);
+  std::thread t3(Transfer, &alice, &bob, 10);
+  t3.join();
+  std::thread t4(Transfer, &bob, &alice, 20);
+  t4.join();
+  std::cout << "Reports after Transfer in both directions: " << reports << "\n";
+
+  // Cycles can be longer than two locks.
+  Account carol("carol", 100);
+  Account dave("dave", 100);
+  Account erin("erin", 100);
+  Transfer(&carol, &dave, 1);
+  Transfer(&dave, &erin, 1);
+  Transfer(&erin, &carol, 1);
+  std::cout << "Reports after carol -> dave -> erin -> carol: " << reports << "\n";
+
+  // std::scoped_lock with several mutexes takes them in a safe way, so
+  // SafeTransfer in both directions is not reported.
+  Account frank("frank", 100);
+  Account grace("grace", 100);
+  SafeTransfer(&frank, &grace, 5);
+  SafeTransfer(&grace, &frank, 5);
+  std::cout << "Reports after SafeTransfer in both directions: " << reports << "\n";
+
+  // Now the benchmark. The number of lock pairs can be passed as the first
+  // argument. In a build with NDEBUG, both columns should be the same.
+  size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  std::cout << "Nested lock pairs: " << iterations << " (times in ms)\n";
+  std::cout << "std::mutex    " << NestedLocking<std::mutex>(iterations) << "\n";
+  std::cout << "CheckedMutex  " << NestedLocking<CheckedMutex>(iterations) << "\n";
+
+  return 0;
+}
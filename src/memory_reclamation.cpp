@@ -0,0 +1,599 @@
+/**
+ * @file memory_reclamation.cpp
+ * @brief Tutorial code for epoch-based reclamation and hazard pointers, two
+ * ways to safely free memory in lock-free data structures.
+ */
+
+// None of the containers in this repository, such as the DLL in iterator.cpp,
+// can be read by one thread while another thread modifies it, unless both
+// take a lock. Locks are not the hard part of going lock-free, though;
+// freeing memory is. Suppose a reader has just loaded a pointer to a node,
+// and a writer unlinks that node and deletes it. The reader is now holding a
+// dangling pointer, and its next access reads freed memory. With a lock, the
+// writer knows no reader is looking. Without one, the writer needs some other
+// way to know when nobody can still be looking at the node.
+
+// A writer that unlinks a node therefore does not delete it right away.
+// Instead, it "retires" the node: puts it on a list of nodes to delete later,
+// once it is safe. This file shows two classic ways of deciding when that is:
+
+// 1. Epoch-based reclamation (EBR), from Keir Fraser's "Practical
+//    Lock-Freedom" (2004). There is a global epoch number. A reader "pins"
+//    itself before touching the data structure by recording the current
+//    epoch, and unpins when done. A node retired in epoch e can be deleted
+//    once every pinned thread has moved past e, which is guaranteed once the
+//    global epoch reaches e + 2. Pinning costs one store and one fence, and
+//    retiring is just a push onto a thread-local list, so EBR is very fast.
+//    Its weakness: one thread that stays pinned for a long time (or is
+//    descheduled while pinned) keeps the epoch from advancing, and no
+//    memory can be freed until it unpins.
+
+// 2. Hazard pointers (HP), from Maged Michael's "Hazard Pointers: Safe
+//    Memory Reclamation for Lock-Free Objects" (2004). Each thread has a few
+//    hazard pointer slots. Before using a node, a reader writes the node's
+//    address into one of its slots, and then checks that the node is still
+//    reachable. A retired node can be deleted once it is not in any thread's
+//    slots. A reader does a bit more work per node than with EBR, but a
+//    stalled thread can only keep the few nodes in its slots alive, so the
+//    amount of unreclaimed memory is always bounded.
+
+// Both schemes are used here to protect a Treiber stack, the simplest
+// lock-free data structure, where Pop reads the top node's next pointer
+// while another thread may be popping and freeing that same node.
+
+// Includes std::sort and std::binary_search.
+#include <algorithm>
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::runtime_error.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the vector container library header.
+#include <vector>
+
+// The most threads that can use the reclamation schemes at the same time.
+// Each thread gets a slot number below this when it first uses them, and
+// gives it back when it exits, so that a later thread can reuse it.
+constexpr size_t kMaxThreads = 128;
+
+// The ThreadSlots class hands out those slot numbers.
+class ThreadSlots {
+ public:
+  // Returns the calling thread's slot number, claiming one the first time.
+  // It throws std::runtime_error if more than kMaxThreads threads use the
+  // schemes at the same time.
+  static size_t Mine() {
+    thread_local SlotOwner owner;
+    return owner.slot_;
+  }
+
+  // One more than the highest slot number ever handed out. Scans over all
+  // threads' records only need to look this far.
+  static size_t HighWater() { return high_water_.load(std::memory_order_acquire); }
+
+ private:
+  // Claims a free slot when a thread first calls Mine, and frees it when the
+  // thread exits (thread_local objects are destroyed at thread exit).
+  struct SlotOwner {
+    SlotOwner() {
+      for (slot_ = 0; slot_ < kMaxThreads; ++slot_) {
+        bool expected = false;
+        if (!taken_[slot_].load(std::memory_order_relaxed) &&
+            taken_[slot_].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+          size_t high = high_water_.load(std::memory_order_relaxed);
+          while (high < slot_ + 1 && !high_water_.compare_exchange_weak(high, slot_ + 1)) {
+          }
+          return;
+        }
+      }
+      throw std::runtime_error("more than kMaxThreads threads are using memory reclamation");
+    }
+    ~SlotOwner() { taken_[slot_].store(false, std::memory_order_release); }
+
+    size_t slot_;
+  };
+
+  static inline std::atomic<bool> taken_[kMaxThreads] = {};
+  static inline std::atomic<size_t> high_water_{0};
+};
+
+// A retired pointer, with the function that deletes it. Storing a deleter
+// lets one list hold retired objects of different types.
+struct Retired {
+  void *ptr_;
+  void (*deleter_)(void *);
+};
+
+template <typename T>
+void DeleteAs(void *ptr) {
+  delete static_cast<T *>(ptr);
+}
+
+// The EpochManager class implements epoch-based reclamation. A thread pins
+// itself by creating an EpochManager::Guard, and may then read any object
+// protected by this manager until the Guard is destroyed.
+class EpochManager {
+ public:
+  EpochManager() = default;
+  EpochManager(const EpochManager &) = delete;
+  EpochManager &operator=(const EpochManager &) = delete;
+
+  // Deletes everything still retired. No thread may be using the manager
+  // anymore at this point.
+  ~EpochManager() {
+    for (Record &record : records_) {
+      for (Limbo &limbo : record.limbo_) {
+        Free(&limbo);
+      }
+    }
+  }
+
+  // Pins the calling thread while it exists. Guards can be nested; the thread
+  // stays pinned until the outermost one is destroyed. Protect has nothing to
+  // do for EBR, since pinning already protects everything; it exists so that
+  // data structures can use EpochManager and HazardPointerDomain the same
+  // way.
+  class Guard {
+   public:
+    explicit Guard(EpochManager *manager) : manager_(manager) { manager_->Pin(); }
+    ~Guard() { manager_->Unpin(); }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+    template <typename T>
+    T *Protect(const std::atomic<T *> &source) {
+      return source.load(std::memory_order_acquire);
+    }
+
+   private:
+    EpochManager *manager_;
+  };
+
+  // Schedules ptr to be deleted once no pinned thread can still see it. The
+  // caller must already have unlinked ptr, so that threads that pin from now
+  // on cannot find it. Every kBatch retires, the thread tries to advance the
+  // global epoch and frees what has become safe.
+  //
+  // Each thread keeps one list per epoch modulo 3. Since only objects
+  // retired in the last two epochs can still be in use, a list whose epoch
+  // is older than that can be freed as a whole, without looking at each
+  // object's epoch.
+  template <typename T>
+  void Retire(T *ptr) {
+    Record &record = records_[ThreadSlots::Mine()];
+    uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+    Limbo &limbo = record.limbo_[epoch % 3];
+    if (limbo.epoch_ != epoch) {
+      // The list holds objects from epoch - 3 or earlier.
+      Free(&limbo);
+      limbo.epoch_ = epoch;
+    }
+    limbo.retired_.push_back(Retired{ptr, &DeleteAs<T>});
+    if (++record.retires_ % kBatch == 0) {
+      TryAdvance();
+      Collect(&record);
+    }
+  }
+
+  // The number of retired objects that have not been deleted yet, summed over
+  // all threads. Only exact when no thread is retiring at the same time.
+  size_t Pending() const {
+    size_t pending = 0;
+    for (size_t i = 0; i < ThreadSlots::HighWater(); ++i) {
+      for (const Limbo &limbo : records_[i].limbo_) {
+        pending += limbo.retired_.size();
+      }
+    }
+    return pending;
+  }
+
+ private:
+  static constexpr size_t kBatch = 64;
+
+  // The objects one thread retired in one epoch.
+  struct Limbo {
+    uint64_t epoch_ = 0;
+    std::vector<Retired> retired_;
+  };
+
+  // Each thread's record sits on its own cache line, since it is written on
+  // every pin and unpin. state_ holds the epoch the thread pinned in, shifted
+  // left by one, with the lowest bit set while the thread is pinned.
+  struct alignas(64) Record {
+    std::atomic<uint64_t> state_{0};
+    int nesting_ = 0;
+    size_t retires_ = 0;
+    Limbo limbo_[3];
+  };
+
+  void Pin() {
+    Record &record = records_[ThreadSlots::Mine()];
+    if (record.nesting_++ > 0) {
+      return;
+    }
+    uint64_t epoch = global_epoch_.load(std::memory_order_relaxed);
+    // The store must be visible to other threads before we read any shared
+    // pointer, or a thread advancing the epoch could miss us. A sequentially
+    // consistent exchange is a store with a full fence.
+    record.state_.exchange((epoch << 1) | 1, std::memory_order_seq_cst);
+  }
+
+  void Unpin() {
+    Record &record = records_[ThreadSlots::Mine()];
+    if (--record.nesting_ > 0) {
+      return;
+    }
+    record.state_.store(record.state_.load(std::memory_order_relaxed) & ~uint64_t{1}, std::memory_order_release);
+  }
+
+  // Moves the global epoch forward by one if every pinned thread has already
+  // seen the current epoch.
+  void TryAdvance() {
+    uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+    for (size_t i = 0; i < ThreadSlots::HighWater(); ++i) {
+      uint64_t state = records_[i].state_.load(std::memory_order_seq_cst);
+      if ((state & 1) != 0 && (state >> 1) != epoch) {
+        return;
+      }
+    }
+    global_epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+  }
+
+  // Deletes this thread's retired objects that are at least two epochs old.
+  // A thread pinned when an object was retired in epoch e was pinned in
+  // epoch e or e - 1 (it may not have seen the latest epoch yet). The global
+  // epoch can only reach e + 2 after every pinned thread has moved to
+  // e + 1, which means each of them unpinned and pinned again since then,
+  // and so can no longer hold a pointer to the object.
+  void Collect(Record *record) {
+    uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+    for (Limbo &limbo : record->limbo_) {
+      if (limbo.epoch_ + 2 <= epoch) {
+        Free(&limbo);
+      }
+    }
+  }
+
+  static void Free(Limbo *limbo) {
+    for (Retired &retired : limbo->retired_) {
+      retired.deleter_(retired.ptr_);
+    }
+    limbo->retired_.clear();
+  }
+
+  alignas(64) std::atomic<uint64_t> global_epoch_{0};
+  Record records_[kMaxThreads];
+};
+
+// The HazardPointerDomain class implements hazard pointers. A thread reserves
+// one of its kSlotsPerThread hazard pointer slots by creating a
+// HazardPointerDomain::Guard, and uses Guard::Protect to load a pointer that
+// will not be deleted until the Guard protects something else or is
+// destroyed.
+class HazardPointerDomain {
+ public:
+  static constexpr size_t kSlotsPerThread = 2;
+
+  HazardPointerDomain() = default;
+  HazardPointerDomain(const HazardPointerDomain &) = delete;
+  HazardPointerDomain &operator=(const HazardPointerDomain &) = delete;
+
+  ~HazardPointerDomain() {
+    for (Record &record : records_) {
+      for (Retired &retired : record.retired_) {
+        retired.deleter_(retired.ptr_);
+      }
+    }
+  }
+
+  class Guard {
+   public:
+    // Reserves the next free hazard pointer slot of the calling thread. It
+    // throws std::runtime_error if the thread already uses all of them.
+    explicit Guard(HazardPointerDomain *domain) {
+      Record &record = domain->records_[ThreadSlots::Mine()];
+      if (record.used_ == kSlotsPerThread) {
+        throw std::runtime_error("no free hazard pointer slot");
+      }
+      hazard_ = &record.hazards_[record.used_++];
+      used_ = &record.used_;
+    }
+    ~Guard() {
+      hazard_->store(nullptr, std::memory_order_release);
+      --*used_;
+    }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+    // Loads source and publishes the result as a hazard. Publishing is not
+    // enough on its own: the object may have been retired, and even scanned,
+    // between our load and our store. So we load source again, and if it
+    // still holds the same pointer, the object was reachable after our
+    // hazard became visible, and any scan from then on will see the hazard.
+    template <typename T>
+    T *Protect(const std::atomic<T *> &source) {
+      T *ptr = source.load(std::memory_order_relaxed);
+      while (true) {
+        hazard_->store(ptr, std::memory_order_seq_cst);
+        T *again = source.load(std::memory_order_seq_cst);
+        if (again == ptr) {
+          return ptr;
+        }
+        ptr = again;
+      }
+    }
+
+   private:
+    std::atomic<void *> *hazard_;
+    size_t *used_;
+  };
+
+  // Schedules ptr to be deleted once no hazard pointer points to it. Once the
+  // thread has more retired objects than twice the number of hazard pointer
+  // slots in use, it scans all hazard pointers and deletes every retired
+  // object that is not among them. At least half of the retired objects are
+  // freed by each scan, so each thread holds at most that many retired
+  // objects, no matter what the other threads do.
+  template <typename T>
+  void Retire(T *ptr) {
+    Record &record = records_[ThreadSlots::Mine()];
+    record.retired_.push_back(Retired{ptr, &DeleteAs<T>});
+    if (record.retired_.size() >= 2 * kSlotsPerThread * ThreadSlots::HighWater() + kMinScan) {
+      Scan(&record);
+    }
+  }
+
+  size_t Pending() const {
+    size_t pending = 0;
+    for (size_t i = 0; i < ThreadSlots::HighWater(); ++i) {
+      pending += records_[i].retired_.size();
+    }
+    return pending;
+  }
+
+ private:
+  // Scans are not worth it for just a handful of retired objects.
+  static constexpr size_t kMinScan = 16;
+
+  struct alignas(64) Record {
+    std::atomic<void *> hazards_[kSlotsPerThread] = {};
+    size_t used_ = 0;
+    std::vector<Retired> retired_;
+  };
+
+  void Scan(Record *record) {
+    std::vector<void *> hazards;
+    for (size_t i = 0; i < ThreadSlots::HighWater(); ++i) {
+      for (const std::atomic<void *> &hazard : records_[i].hazards_) {
+        if (void *ptr = hazard.load(std::memory_order_seq_cst)) {
+          hazards.push_back(ptr);
+        }
+      }
+    }
+    std::sort(hazards.begin(), hazards.end());
+    auto keep = std::partition(record->retired_.begin(), record->retired_.end(), [&](const Retired &retired) {
+      return std::binary_search(hazards.begin(), hazards.end(), retired.ptr_);
+    });
+    for (auto it = keep; it != record->retired_.end(); ++it) {
+      it->deleter_(it->ptr_);
+    }
+    record->retired_.erase(keep, record->retired_.end());
+  }
+
+  Record records_[kMaxThreads];
+};
+
+// The TreiberStack class is a lock-free stack. Reclaimer is EpochManager or
+// HazardPointerDomain; both have a Guard with a Protect method, and a Retire
+// method, so the stack is written once for both.
+template <typename Reclaimer>
+class TreiberStack {
+ public:
+  explicit TreiberStack(Reclaimer *reclaimer) : reclaimer_(reclaimer) {}
+
+  ~TreiberStack() {
+    Node *node = head_.load();
+    while (node != nullptr) {
+      Node *next = node->next_;
+      delete node;
+      node = next;
+    }
+  }
+
+  void Push(int value) {
+    Node *node = new Node(value);
+    node->next_ = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(node->next_, node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Pops the top value into *value, or returns false if the stack is empty.
+  // Reading top->next_ is the dangerous part: without protection, another
+  // thread could pop and delete top right before we read it.
+  bool Pop(int *value) {
+    typename Reclaimer::Guard guard(reclaimer_);
+    while (true) {
+      Node *top = guard.Protect(head_);
+      if (top == nullptr) {
+        return false;
+      }
+      // The unlink must be sequentially consistent. Retiring top leads to
+      // TryAdvance reading the epoch records, or Scan reading the hazard
+      // pointers, and neither may happen before other threads can see that
+      // top is unlinked. With a weaker order, ARM or POWER could let those
+      // reads go first, and a reader's Protect could then confirm a node
+      // that is about to be freed.
+      if (head_.compare_exchange_weak(top, top->next_, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        *value = top->value_;
+        reclaimer_->Retire(top);
+        return true;
+      }
+    }
+  }
+
+  // The number of nodes that exist right now, in any stack, including
+  // retired nodes that have not been deleted yet.
+  static long long LiveNodes() { return Node::live_.load(); }
+
+ private:
+  struct Node {
+    explicit Node(int value) : value_(value) { live_.fetch_add(1, std::memory_order_relaxed); }
+    ~Node() { live_.fetch_sub(1, std::memory_order_relaxed); }
+
+    int value_;
+    Node *next_ = nullptr;
+    static inline std::atomic<long long> live_{0};
+  };
+
+  Reclaimer *reclaimer_;
+  std::atomic<Node *> head_{nullptr};
+};
+
+// Has num_threads threads push and pop ops_per_thread values each on one
+// stack. It returns how many milliseconds it took, and checks that every
+// pushed value was popped exactly once, by comparing sums.
+template <typename Reclaimer>
+long long Churn(Reclaimer *reclaimer, size_t num_threads, size_t ops_per_thread, bool *ok) {
+  TreiberStack<Reclaimer> stack(reclaimer);
+  std::atomic<long long> pushed{0};
+  std::atomic<long long> popped{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      long long local_pushed = 0;
+      long long local_popped = 0;
+      for (size_t i = 0; i < ops_per_thread; ++i) {
+        int value = static_cast<int>(t * ops_per_thread + i);
+        stack.Push(value);
+        local_pushed += value;
+        int out;
+        if (stack.Pop(&out)) {
+          local_popped += out;
+        }
+      }
+      pushed += local_pushed;
+      popped += local_popped;
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  long long ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  int out;
+  while (stack.Pop(&out)) {
+    popped += out;
+  }
+  *ok = pushed == popped;
+  return ms;
+}
+
+// Runs the same churn while one extra thread stays inside a read-side
+// critical section (an EBR pin, or a hazard pointer on the top node) the
+// whole time, like a reader that got descheduled. It returns the number of
+// retired nodes that could not be freed by the end.
+template <typename Reclaimer>
+size_t PendingWithStalledReader(Reclaimer *reclaimer, size_t ops) {
+  TreiberStack<Reclaimer> stack(reclaimer);
+  stack.Push(0);
+  std::atomic<bool> stalled{false};
+  std::atomic<bool> done{false};
+  std::thread reader([&] {
+    typename Reclaimer::Guard guard(reclaimer);
+    // With EBR, the Guard alone pins the thread. With hazard pointers, the
+    // reader holds one hazard pointer slot, but protects nothing in the stack.
+    std::atomic<int *> dummy{nullptr};
+    guard.Protect(dummy);
+    stalled = true;
+    while (!done) {
+      std::this_thread::yield();
+    }
+  });
+  while (!stalled) {
+    std::this_thread::yield();
+  }
+  for (size_t i = 0; i < ops; ++i) {
+    int out;
+    stack.Push(static_cast<int>(i));
+    stack.Pop(&out);
+  }
+  size_t pending = reclaimer->Pending();
+  done = true;
+  reader.join();
+  return pending;
+}
+
+int main(int argc, char *argv[]) {
+  // A single thread: pushes and pops go through, and retired nodes are
+  // deleted in batches.
+  {
+    EpochManager epochs;
+    TreiberStack<EpochManager> stack(&epochs);
+    for (int i = 1; i <= 3; ++i) {
+      stack.Push(i);
+    }
+    int value;
+    std::cout << "Popping from the EBR stack:";
+    while (stack.Pop(&value)) {
+      std::cout << " " << value;
+    }
+    std::cout << "\n";
+  }
+  std::cout << "Live nodes after the stack and its EpochManager are gone: "
+            << TreiberStack<EpochManager>::LiveNodes() << "\n";
+
+  // Now the checks and benchmarks. The number of push/pop pairs per thread
+  // can be passed as the first argument.
+  size_t ops = argc > 1 ? std::stoul(argv[1]) : 200000;
+  std::cout << "Each thread pushes and pops " << ops << " values (times in ms):\n";
+  std::cout << "threads  EBR  hazard pointers\n";
+  for (size_t num_threads = 1; num_threads <= 8; num_threads *= 2) {
+    bool ebr_ok = false;
+    bool hp_ok = false;
+    long long ebr_ms;
+    long long hp_ms;
+    {
+      EpochManager epochs;
+      ebr_ms = Churn(&epochs, num_threads, ops, &ebr_ok);
+    }
+    {
+      HazardPointerDomain hazards;
+      hp_ms = Churn(&hazards, num_threads, ops, &hp_ok);
+    }
+    if (!ebr_ok || !hp_ok || TreiberStack<EpochManager>::LiveNodes() != 0 ||
+        TreiberStack<HazardPointerDomain>::LiveNodes() != 0) {
+      std::cout << "Values or nodes were lost!\n";
+      return 1;
+    }
+    std::cout << num_threads << "\t " << ebr_ms << "\t" << hp_ms << "\n";
+  }
+
+  // A stalled reader keeps every node retired after it pinned alive under
+  // EBR, but only the nodes it protects under hazard pointers.
+  size_t ebr_pending;
+  size_t hp_pending;
+  {
+    EpochManager epochs;
+    ebr_pending = PendingWithStalledReader(&epochs, ops);
+  }
+  {
+    HazardPointerDomain hazards;
+    hp_pending = PendingWithStalledReader(&hazards, ops);
+  }
+  std::cout << "Unfreed nodes after " << ops << " pops with a stalled reader: EBR " << ebr_pending
+            << ", hazard pointers " << hp_pending << "\n";
+
+  return 0;
+}
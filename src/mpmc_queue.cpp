@@ -0,0 +1,466 @@
+/**
+ * @file mpmc_queue.cpp
+ * @brief Tutorial code for lock-free bounded queues that pass values between
+ * threads.
+ */
+
+// condition_variable.cpp showed how one thread can wait for another with a
+// std::mutex, a std::condition_variable and a predicate. The usual way to
+// hand work from "producer" threads to "consumer" threads is built the same
+// way: a std::queue protected by a mutex, with a condition variable to wake
+// consumers when the queue is no longer empty. Every push and every pop takes
+// the mutex, so at high rates the threads spend their time waiting for each
+// other, and every notify_one can be a system call.
+
+// A ring buffer avoids the mutex. It is a fixed-size array used in a circle:
+// producers write at a tail position, consumers read at a head position, and
+// both positions only ever increase (the slot is position % capacity).
+// - MpmcQueue allows many producers and many consumers. It follows Dmitry
+//   Vyukov's bounded MPMC queue: each slot has a sequence number that says
+//   whether the slot is ready to be written or ready to be read in the
+//   current trip around the ring. A thread claims a position with one
+//   compare-and-swap, and then works on its slot without bothering anyone
+//   else. See https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue.
+// - SpscQueue allows exactly one producer and one consumer. With only one
+//   thread on each side, no compare-and-swap is needed at all: each side owns
+//   its own position and only reads the other side's.
+// Both queues return false instead of waiting when they are full or empty.
+// BlockingQueue wraps either one and adds Push and Pop methods that wait,
+// but only go to sleep on a condition variable when the queue really is
+// full or empty, so the mutex stays off the fast path.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes the condition variable library header.
+#include <condition_variable>
+// Includes std::ptrdiff_t.
+#include <cstddef>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes placement new.
+#include <new>
+// Includes std::queue for the mutex-based queue in the benchmark.
+#include <queue>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes std::move.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// Returns the smallest power of two that is at least n and at least 2.
+inline size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t power = 2;
+  while (power < n) {
+    power *= 2;
+  }
+  return power;
+}
+
+// The MpmcQueue class is a bounded queue that any number of threads can push
+// to and pop from at the same time, without locks. The capacity is rounded
+// up to a power of two, so that the slot for a position is position & mask_.
+template <typename T>
+class MpmcQueue {
+ public:
+  using value_type = T;
+
+  explicit MpmcQueue(size_t capacity) : mask_(RoundUpToPowerOfTwo(capacity) - 1), cells_(mask_ + 1) {
+    // Slot i is ready to be written for position i.
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence_.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpmcQueue(const MpmcQueue &) = delete;
+  MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+  // Destroys the values still in the queue. No other thread may be using the
+  // queue at this point, so every claimed position has been published.
+  ~MpmcQueue() {
+    for (size_t pos = dequeue_pos_.load(); pos != enqueue_pos_.load(); ++pos) {
+      cells_[pos & mask_].Data()->~T();
+    }
+  }
+
+  // Adds value to the back of the queue. It returns false, and leaves value
+  // untouched, if the queue is full.
+  bool TryPush(T &&value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence_.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+      if (diff == 0) {
+        // The slot is free in this trip around the ring. Claim position pos;
+        // if another producer got there first, the compare-and-swap loads
+        // the new position into pos and we try again.
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // The slot still holds the value from one trip ago, which no
+        // consumer has taken yet, so the queue is full.
+        return false;
+      } else {
+        // Another producer already claimed pos; catch up.
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (cell->Data()) T(std::move(value));
+    // Publish the value: the slot is now ready to be read at position pos.
+    cell->sequence_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Removes the value at the front of the queue and moves it into *value. It
+  // returns false if the queue is empty.
+  bool TryPop(T *value) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence_.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence - (pos + 1));
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // No producer has published a value for pos yet: the queue is empty.
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    T *data = cell->Data();
+    *value = std::move(*data);
+    data->~T();
+    // The slot is now ready to be written in the next trip around the ring.
+    cell->sequence_.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // A slot holds raw storage for one T, so that T does not need a default
+  // constructor and empty slots do not hold live objects.
+  struct Cell {
+    std::atomic<size_t> sequence_;
+    alignas(T) unsigned char storage_[sizeof(T)];
+    T *Data() { return reinterpret_cast<T *>(storage_); }
+  };
+
+  const size_t mask_;
+  std::vector<Cell> cells_;
+  // Producers only touch enqueue_pos_ and consumers only touch dequeue_pos_,
+  // so each one gets its own cache line.
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+};
+
+// The SpscQueue class is a bounded queue for exactly one producer thread and
+// exactly one consumer thread. Using it from more threads is a data race.
+template <typename T>
+class SpscQueue {
+ public:
+  using value_type = T;
+
+  explicit SpscQueue(size_t capacity) : mask_(RoundUpToPowerOfTwo(capacity) - 1), slots_(mask_ + 1) {}
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  ~SpscQueue() {
+    for (size_t pos = head_.load(); pos != tail_.load(); ++pos) {
+      slots_[pos & mask_].Data()->~T();
+    }
+  }
+
+  bool TryPush(T &&value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    // The producer keeps its own copy of the consumer's position, and only
+    // reloads the real one when the queue looks full. Most pushes then do
+    // not touch the consumer's cache line at all.
+    if (tail - head_cache_ > mask_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ > mask_) {
+        return false;
+      }
+    }
+    new (slots_[tail & mask_].Data()) T(std::move(value));
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T *value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    T *data = slots_[head & mask_].Data();
+    *value = std::move(*data);
+    data->~T();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct Slot {
+    alignas(T) unsigned char storage_[sizeof(T)];
+    T *Data() { return reinterpret_cast<T *>(storage_); }
+  };
+
+  const size_t mask_;
+  std::vector<Slot> slots_;
+  // Each side's position shares a cache line with that side's cached copy of
+  // the other side's position, since the same thread uses both.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+};
+
+// The BlockingQueue class adds waiting Push and Pop methods to an MpmcQueue
+// or SpscQueue. A thread that finds the queue full or empty spins for a
+// short while, and then sleeps on a condition variable. The other side only
+// takes the mutex to wake it up if some thread is actually asleep, so as
+// long as the queue is neither full nor empty, no thread ever touches the
+// mutex.
+template <typename Queue>
+class BlockingQueue {
+ public:
+  using T = typename Queue::value_type;
+
+  explicit BlockingQueue(size_t capacity) : queue_(capacity) {}
+
+  bool TryPush(T &&value) {
+    if (!queue_.TryPush(std::move(value))) {
+      return false;
+    }
+    WakeOne(&sleeping_consumers_, &not_empty_);
+    return true;
+  }
+
+  bool TryPop(T *value) {
+    if (!queue_.TryPop(value)) {
+      return false;
+    }
+    WakeOne(&sleeping_producers_, &not_full_);
+    return true;
+  }
+
+  void Push(T value) {
+    Wait(&sleeping_producers_, &not_full_, [&] { return queue_.TryPush(std::move(value)); });
+    WakeOne(&sleeping_consumers_, &not_empty_);
+  }
+
+  // Pop needs T to be default constructible, since it creates the value
+  // before moving the front of the queue into it.
+  T Pop() {
+    T value;
+    Wait(&sleeping_consumers_, &not_empty_, [&] { return queue_.TryPop(&value); });
+    WakeOne(&sleeping_producers_, &not_full_);
+    return value;
+  }
+
+ private:
+  // Calls attempt until it succeeds. A sleeping thread announces itself in
+  // *sleepers and then tries once more before it sleeps; the other side
+  // changes the queue and then checks *sleepers. The fences make sure at
+  // least one of the two sees the other, and because the sleeper holds the
+  // mutex from its last attempt until it is inside wait, a wake-up cannot
+  // slip in between the two.
+  template <typename Attempt>
+  void Wait(std::atomic<int> *sleepers, std::condition_variable *cv, Attempt attempt) {
+    for (int spins = 0; spins < kSpins; ++spins) {
+      if (attempt()) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+    std::unique_lock lock(latch_);
+    while (true) {
+      sleepers->fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (attempt()) {
+        sleepers->fetch_sub(1);
+        return;
+      }
+      cv->wait(lock);
+      sleepers->fetch_sub(1);
+    }
+  }
+
+  void WakeOne(std::atomic<int> *sleepers, std::condition_variable *cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers->load(std::memory_order_relaxed) > 0) {
+      // Taking the mutex waits for a sleeper that has announced itself to
+      // actually be inside wait, so that the notification is not lost.
+      { std::scoped_lock lock(latch_); }
+      cv->notify_one();
+    }
+  }
+
+  // How many times a thread retries before it goes to sleep. Each retry
+  // yields the CPU, so that the other side can run even on a single core.
+  static constexpr int kSpins = 16;
+
+  Queue queue_;
+  std::mutex latch_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::atomic<int> sleeping_consumers_{0};
+  std::atomic<int> sleeping_producers_{0};
+};
+
+// The usual mutex and condition variable queue, in the style of
+// condition_variable.cpp, for comparison.
+template <typename T>
+class MutexQueue {
+ public:
+  explicit MutexQueue(size_t capacity) : capacity_(capacity) {}
+
+  void Push(T value) {
+    std::unique_lock lk(m_);
+    not_full_.wait(lk, [&] { return queue_.size() < capacity_; });
+    queue_.push(std::move(value));
+    not_empty_.notify_one();
+  }
+
+  T Pop() {
+    std::unique_lock lk(m_);
+    not_empty_.wait(lk, [&] { return !queue_.empty(); });
+    T value = std::move(queue_.front());
+    queue_.pop();
+    not_full_.notify_one();
+    return value;
+  }
+
+ private:
+  size_t capacity_;
+  std::queue<T> queue_;
+  std::mutex m_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+// Passes items values from num_producers producer threads to num_consumers
+// consumer threads through the queue, and returns how many milliseconds it
+// took. The consumers check that every value arrived exactly once by adding
+// them up.
+template <typename Queue>
+long long Throughput(Queue *queue, size_t num_producers, size_t num_consumers, size_t items) {
+  std::atomic<long long> sum{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < num_producers; ++p) {
+    threads.emplace_back([&, p] {
+      for (size_t i = p; i < items; i += num_producers) {
+        queue->Push(static_cast<long long>(i));
+      }
+    });
+  }
+  for (size_t c = 0; c < num_consumers; ++c) {
+    threads.emplace_back([&, c] {
+      long long local = 0;
+      for (size_t i = c; i < items; i += num_consumers) {
+        local += queue->Pop();
+      }
+      sum += local;
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  long long ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if (sum != static_cast<long long>(items) * static_cast<long long>(items - 1) / 2) {
+    std::cout << "Values were lost or duplicated!\n";
+  }
+  return ms;
+}
+
+// Bounces a value between two threads through two queues round_trips times,
+// and returns the average round trip in nanoseconds.
+template <typename Queue>
+long long RoundTripNs(size_t round_trips) {
+  Queue ping(64);
+  Queue pong(64);
+  std::thread echo([&] {
+    for (size_t i = 0; i < round_trips; ++i) {
+      pong.Push(ping.Pop());
+    }
+  });
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < round_trips; ++i) {
+    ping.Push(static_cast<long long>(i));
+    pong.Pop();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  echo.join();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / static_cast<long long>(round_trips);
+}
+
+int main(int argc, char *argv[]) {
+  // The non-blocking interface returns false instead of waiting.
+  MpmcQueue<std::string> names(2);
+  names.TryPush("alice");
+  names.TryPush("bob");
+  if (!names.TryPush("carol")) {
+    std::cout << "The queue is full, so carol was not added.\n";
+  }
+  std::string name;
+  while (names.TryPop(&name)) {
+    std::cout << "Popped " << name << "\n";
+  }
+
+  // We repeat condition_variable.cpp's idea with a queue: two threads each
+  // hand over one increment, and the waiter blocks until both have arrived.
+  BlockingQueue<MpmcQueue<int>> increments(16);
+  std::thread t1([&] { increments.Push(1); });
+  std::thread t2([&] { increments.Push(1); });
+  std::thread t3([&] {
+    int count = increments.Pop();
+    count += increments.Pop();
+    std::cout << "Printing count: " << count << std::endl;
+  });
+  t1.join();
+  t2.join();
+  t3.join();
+
+  // Now the benchmark. The number of values can be passed as the first
+  // argument.
+  size_t items = argc > 1 ? std::stoul(argv[1]) : 2000000;
+  constexpr size_t kCapacity = 1024;
+  std::cout << "Passing " << items << " values through a queue of " << kCapacity << " slots (times in ms):\n";
+  std::cout << "producers/consumers  mutex+condvar  MpmcQueue  SpscQueue\n";
+  for (size_t threads = 1; threads <= 4; threads *= 2) {
+    MutexQueue<long long> mutex_queue(kCapacity);
+    BlockingQueue<MpmcQueue<long long>> mpmc_queue(kCapacity);
+    long long mutex_ms = Throughput(&mutex_queue, threads, threads, items);
+    long long mpmc_ms = Throughput(&mpmc_queue, threads, threads, items);
+    std::cout << threads << "/" << threads << "\t\t     " << mutex_ms << "\t\t    " << mpmc_ms;
+    if (threads == 1) {
+      BlockingQueue<SpscQueue<long long>> spsc_queue(kCapacity);
+      std::cout << "\t       " << Throughput(&spsc_queue, 1, 1, items);
+    }
+    std::cout << "\n";
+  }
+
+  size_t round_trips = items / 20;
+  std::cout << "Average round trip between two threads: mutex+condvar " << RoundTripNs<MutexQueue<long long>>(round_trips)
+            << " ns, MpmcQueue " << RoundTripNs<BlockingQueue<MpmcQueue<long long>>>(round_trips) << " ns, SpscQueue "
+            << RoundTripNs<BlockingQueue<SpscQueue<long long>>>(round_trips) << " ns\n";
+
+  return 0;
+}
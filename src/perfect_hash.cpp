@@ -0,0 +1,375 @@
+/**
+ * @file perfect_hash.cpp
+ * @brief Tutorial code for compile-time (constexpr) perfect hash tables.
+ */
+
+// In unordered_maps.cpp, we inserted a handful of literal keys ("foo",
+// "jignesh", "spam", ...) into a std::unordered_map at runtime. Every lookup
+// into that map hashes the key, walks to a bucket, and then follows a linked
+// list of nodes on the heap until it finds a match. When the set of keys is
+// known ahead of time and never changes (command names, column names,
+// dispatch tables), we can do much better: we can pick a hash function at
+// compile time that sends every key to its own slot. This is called a
+// perfect hash function. A lookup then becomes a single hash computation,
+// a single probe into a fixed-size array, and a single key comparison. There
+// are no collisions to resolve and no heap memory involved.
+
+// This file builds on the non-type template parameters shown in
+// templated_classes.cpp (Bar<int T>). There, the template parameter was a
+// value that was printed. Here, the template parameters are the number of
+// keys and the size of the table, which lets the whole table live inside a
+// std::array whose size is fixed at compile time. Combined with constexpr,
+// the compiler itself builds the perfect hash function and fills the table,
+// so the finished table is baked into the program's read-only data.
+
+// The simplest way to find a perfect hash function is to try one seed after
+// another until one sends every key to a different slot. That works for a
+// dozen keys, but the chance that a random seed has no collisions at all
+// shrinks exponentially with the number of keys, and at a few dozen keys the
+// compiler gives up. Instead, we use "hash and displace", the idea behind
+// CHD (Belazzougui, Botelho and Dietzfelbinger, 2009) and PTHash (Pibiri and
+// Trani, 2021): the keys are first split into small buckets by their hash,
+// and each bucket gets its own small number, its "pilot", that decides where
+// its keys go. Buckets are placed one at a time, biggest first, and a bucket
+// only has to find a pilot that avoids the slots taken so far. Each bucket
+// holds a few keys, so a working pilot turns up after a few tries, and
+// building the table takes time roughly linear in the number of keys.
+
+// Includes std::array, a fixed-size array that can be used in constexpr code.
+#include <array>
+// Includes std::chrono for timing the small benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::string for the std::unordered_map comparison.
+#include <string>
+// Includes std::string_view, a non-owning view of a string that can be
+// compared and hashed in constexpr code.
+#include <string_view>
+// Includes the unordered_map container library header.
+#include <unordered_map>
+// Includes std::pair.
+#include <utility>
+
+// An xor-shift-multiply step that spreads the high bits of a 64-bit value
+// down into the low bits, which is important because we index the table with
+// the low bits only.
+constexpr uint64_t Mix(uint64_t hash) {
+  hash ^= hash >> 29;
+  hash *= 0xBF58476D1CE4E5B9ULL;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// A 64-bit FNV-1a hash of a string. This function is constexpr, so the
+// compiler can evaluate it while building the table.
+constexpr uint64_t StringHash(std::string_view key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  return Mix(hash);
+}
+
+// Returns the smallest power of two that is greater than or equal to n. We
+// use power-of-two table sizes so that the slot index can be computed with a
+// bit mask instead of a (much slower) modulo.
+constexpr size_t NextPowerOfTwo(size_t n) {
+  size_t power = 1;
+  while (power < n) {
+    power <<= 1;
+  }
+  return power;
+}
+
+// The PerfectHashMap class is a read-only map from string keys to values of
+// type V. Like Bar<int T> in templated_classes.cpp, it takes non-type template
+// parameters: N is the number of keys, and TableSize is the number of slots.
+// By default, the table has at least twice as many slots as keys, which makes
+// it easy for the constructor to find a pilot for every bucket. There are
+// about half as many buckets as keys.
+//
+// Every member function is constexpr, so a PerfectHashMap can be declared as a
+// constexpr global variable. In that case, the table is built entirely at
+// compile time, and a duplicate key is reported as a compile error rather
+// than at runtime.
+template <typename V, size_t N, size_t TableSize = NextPowerOfTwo(2 * N)>
+class PerfectHashMap {
+  static_assert(N > 0, "A perfect hash map needs at least one key.");
+  static_assert((TableSize & (TableSize - 1)) == 0, "TableSize must be a power of two.");
+  static_assert(TableSize >= N, "TableSize must be at least the number of keys.");
+
+ public:
+  // Each slot of the table holds at most one key and its value. V must be
+  // default-constructible, since the unused slots still hold a value.
+  struct Slot {
+    std::string_view key_{};
+    V value_{};
+    bool used_{false};
+  };
+
+  // The constructor groups the keys by bucket, and then places the buckets
+  // from the biggest to the smallest. For each bucket, it tries pilots 0, 1,
+  // 2, ... until one sends every key of the bucket to a distinct free slot.
+  // Big buckets go first, while most slots are still free; by the time the
+  // table fills up, only buckets with one key are left, and a single key
+  // finds a free slot within two tries on average.
+  constexpr explicit PerfectHashMap(const std::pair<std::string_view, V> (&entries)[N]) {
+    // Sort the keys by bucket (a counting sort), so that each bucket's keys
+    // are next to each other in `order`, from order[starts[b]] on.
+    std::array<uint64_t, N> hashes{};
+    std::array<size_t, kBuckets + 1> starts{};
+    for (size_t i = 0; i < N; ++i) {
+      hashes[i] = StringHash(entries[i].first);
+      ++starts[BucketOf(hashes[i]) + 1];
+    }
+    size_t max_bucket_size = 0;
+    for (size_t b = 0; b < kBuckets; ++b) {
+      max_bucket_size = starts[b + 1] > max_bucket_size ? starts[b + 1] : max_bucket_size;
+      starts[b + 1] += starts[b];
+    }
+    std::array<size_t, N> order{};
+    std::array<size_t, kBuckets> filled{};
+    for (size_t i = 0; i < N; ++i) {
+      size_t b = BucketOf(hashes[i]);
+      order[starts[b] + filled[b]++] = i;
+    }
+
+    for (size_t size = max_bucket_size; size > 0; --size) {
+      for (size_t b = 0; b < kBuckets; ++b) {
+        if (starts[b + 1] - starts[b] == size) {
+          PlaceBucket(entries, hashes, &order[starts[b]], size, b);
+        }
+      }
+    }
+  }
+
+  // Looks up a key with a single probe into the slots, after reading its
+  // bucket's pilot. It returns a pointer to the value if the key is present,
+  // and nullptr otherwise. The pointer points into the table itself, so
+  // there is no allocation and no copying.
+  constexpr const V *Find(std::string_view key) const {
+    uint64_t hash = StringHash(key);
+    const Slot &slot = slots_[SlotOf(hash, pilots_[BucketOf(hash)])];
+    if (slot.used_ && slot.key_ == key) {
+      return &slot.value_;
+    }
+    return nullptr;
+  }
+
+  // Returns whether the key is in the map.
+  constexpr bool Contains(std::string_view key) const { return Find(key) != nullptr; }
+
+  // Getter functions.
+  constexpr size_t Size() const { return N; }
+  constexpr size_t Capacity() const { return TableSize; }
+  constexpr size_t Buckets() const { return kBuckets; }
+  constexpr uint16_t Pilot(size_t bucket) const { return pilots_[bucket]; }
+
+  // Iterating through the slots lets users print or check the table. Unused
+  // slots have used_ set to false.
+  constexpr const std::array<Slot, TableSize> &Slots() const { return slots_; }
+
+ private:
+  static constexpr size_t kMask = TableSize - 1;
+  static constexpr size_t kBuckets = NextPowerOfTwo((N + 1) / 2);
+  // Pilots are stored in 16 bits. With the default TableSize, no bucket
+  // comes anywhere near needing this many tries.
+  static constexpr uint32_t kMaxPilot = 65535;
+
+  // The bucket comes from the high bits of the hash, and the slot from the
+  // hash mixed with the pilot, so the two are independent.
+  static constexpr size_t BucketOf(uint64_t hash) { return (hash >> 40) & (kBuckets - 1); }
+  static constexpr size_t SlotOf(uint64_t hash, uint64_t pilot) {
+    return Mix(hash + pilot * 0x9E3779B97F4A7C15ULL) & kMask;
+  }
+
+  // Finds the first pilot that sends the `size` keys in keys[] to distinct
+  // free slots, and puts them there. Two equal keys have equal hashes, so
+  // they always end up in the same bucket, which is where we look for them;
+  // comparing every pair of keys instead would make building a big table
+  // quadratic.
+  constexpr void PlaceBucket(const std::pair<std::string_view, V> (&entries)[N], const std::array<uint64_t, N> &hashes,
+                             const size_t *keys, size_t size, size_t bucket) {
+    for (size_t i = 0; i < size; ++i) {
+      for (size_t j = i + 1; j < size; ++j) {
+        if (hashes[keys[i]] == hashes[keys[j]] && entries[keys[i]].first == entries[keys[j]].first) {
+          throw "PerfectHashMap: duplicate key";
+        }
+      }
+    }
+    for (uint32_t pilot = 0; pilot <= kMaxPilot; ++pilot) {
+      bool fits = true;
+      for (size_t i = 0; fits && i < size; ++i) {
+        size_t slot = SlotOf(hashes[keys[i]], pilot);
+        fits = !slots_[slot].used_;
+        for (size_t j = 0; fits && j < i; ++j) {
+          fits = SlotOf(hashes[keys[j]], pilot) != slot;
+        }
+      }
+      if (fits) {
+        for (size_t i = 0; i < size; ++i) {
+          Slot &slot = slots_[SlotOf(hashes[keys[i]], pilot)];
+          slot.key_ = entries[keys[i]].first;
+          slot.value_ = entries[keys[i]].second;
+          slot.used_ = true;
+        }
+        pilots_[bucket] = static_cast<uint16_t>(pilot);
+        return;
+      }
+    }
+    // Only possible if two keys have the same 64-bit hash, or the table is
+    // nearly full.
+    throw "PerfectHashMap: no pilot found for a bucket; use a larger TableSize";
+  }
+
+  std::array<uint16_t, kBuckets> pilots_{};
+  std::array<Slot, TableSize> slots_{};
+};
+
+// This helper function lets the compiler deduce N from the number of entries
+// in a braced list, so users only have to spell out the value type. This is
+// the same idea as std::make_pair and std::make_unique.
+template <typename V, size_t N>
+constexpr PerfectHashMap<V, N> MakePerfectHashMap(const std::pair<std::string_view, V> (&entries)[N]) {
+  return PerfectHashMap<V, N>(entries);
+}
+
+// These are the same keys and values that unordered_maps.cpp inserts into its
+// std::unordered_map. Since the table is constexpr, the compiler has already
+// found the pilots and filled in the slots by the time the program runs.
+constexpr auto kFoodMap = MakePerfectHashMap<int>({
+    {"foo", 2}, {"jignesh", 445}, {"spam", 15}, {"eggs", 2}, {"garlic rice", 3}, {"bacon", 5},
+});
+
+// Because lookups are constexpr too, we can even check the table at compile
+// time. If any of these checks fail, the program will not compile.
+static_assert(*kFoodMap.Find("jignesh") == 445);
+static_assert(!kFoodMap.Contains("pancakes"));
+
+// A perfect hash map is a natural fit for a dispatch table that maps command
+// names to handler functions. Function pointers can be stored in a constexpr
+// table just like ints.
+int HandleGet(int arg) { return arg; }
+int HandlePut(int arg) { return arg + 1; }
+int HandleDelete(int arg) { return -arg; }
+int HandleScan(int arg) { return arg * 2; }
+
+using Handler = int (*)(int);
+
+constexpr auto kCommandTable = MakePerfectHashMap<Handler>({
+    {"GET", HandleGet}, {"PUT", HandlePut}, {"DELETE", HandleDelete}, {"SCAN", HandleScan},
+});
+
+// Column-name lookup, as a query planner does when it resolves the names in
+// a SQL query: every column of the eight TPC-H tables, mapped to its position
+// in its table. With 61 keys, this is far past the point where searching for
+// one collision-free seed would still finish at compile time.
+constexpr auto kTpchColumns = MakePerfectHashMap<int>({
+    {"p_partkey", 0}, {"p_name", 1}, {"p_mfgr", 2}, {"p_brand", 3}, {"p_type", 4}, {"p_size", 5},
+    {"p_container", 6}, {"p_retailprice", 7}, {"p_comment", 8},
+    {"s_suppkey", 0}, {"s_name", 1}, {"s_address", 2}, {"s_nationkey", 3}, {"s_phone", 4}, {"s_acctbal", 5},
+    {"s_comment", 6},
+    {"ps_partkey", 0}, {"ps_suppkey", 1}, {"ps_availqty", 2}, {"ps_supplycost", 3}, {"ps_comment", 4},
+    {"c_custkey", 0}, {"c_name", 1}, {"c_address", 2}, {"c_nationkey", 3}, {"c_phone", 4}, {"c_acctbal", 5},
+    {"c_mktsegment", 6}, {"c_comment", 7},
+    {"o_orderkey", 0}, {"o_custkey", 1}, {"o_orderstatus", 2}, {"o_totalprice", 3}, {"o_orderdate", 4},
+    {"o_orderpriority", 5}, {"o_clerk", 6}, {"o_shippriority", 7}, {"o_comment", 8},
+    {"l_orderkey", 0}, {"l_partkey", 1}, {"l_suppkey", 2}, {"l_linenumber", 3}, {"l_quantity", 4},
+    {"l_extendedprice", 5}, {"l_discount", 6}, {"l_tax", 7}, {"l_returnflag", 8}, {"l_linestatus", 9},
+    {"l_shipdate", 10}, {"l_commitdate", 11}, {"l_receiptdate", 12}, {"l_shipinstruct", 13}, {"l_shipmode", 14},
+    {"l_comment", 15},
+    {"n_nationkey", 0}, {"n_name", 1}, {"n_regionkey", 2}, {"n_comment", 3},
+    {"r_regionkey", 0}, {"r_name", 1}, {"r_comment", 2},
+});
+
+static_assert(*kTpchColumns.Find("l_shipdate") == 10);
+static_assert(!kTpchColumns.Contains("l_shipdates"));
+
+int main() {
+  // Looking up a key works like std::unordered_map::find, except that it
+  // returns a pointer to the value instead of an iterator.
+  if (const int *value = kFoodMap.Find("spam"); value != nullptr) {
+    std::cout << "Found key spam with value " << *value << std::endl;
+  }
+
+  // Keys that are not in the table hash to some slot, but the key stored in
+  // that slot (if any) will not match, so Find returns nullptr.
+  if (kFoodMap.Find("pancakes") == nullptr) {
+    std::cout << "Key pancakes does not exist in the perfect hash map.\n";
+  }
+
+  // Let's print the table to see where each key landed. Each used slot holds
+  // exactly one key, so no lookup ever needs to look at a second slot.
+  std::cout << "Pilots found at compile time:";
+  for (size_t b = 0; b < kFoodMap.Buckets(); ++b) {
+    std::cout << " " << kFoodMap.Pilot(b);
+  }
+  std::cout << "\n";
+  std::cout << "Printing the slots of the perfect hash map ("
+            << kFoodMap.Size() << " keys, " << kFoodMap.Capacity() << " slots):\n";
+  for (size_t i = 0; i < kFoodMap.Capacity(); ++i) {
+    const auto &slot = kFoodMap.Slots()[i];
+    if (slot.used_) {
+      std::cout << "  slot " << i << ": (" << slot.key_ << ", " << slot.value_ << ")\n";
+    }
+  }
+
+  // Dispatching a command is a single lookup followed by a function call.
+  for (std::string_view command : {"GET", "PUT", "DELETE", "SCAN", "MERGE"}) {
+    if (const Handler *handler = kCommandTable.Find(command); handler != nullptr) {
+      std::cout << command << "(10) returned " << (*handler)(10) << "\n";
+    } else {
+      std::cout << command << " is not a known command.\n";
+    }
+  }
+
+  std::cout << "The TPC-H column table has " << kTpchColumns.Size() << " keys in " << kTpchColumns.Capacity()
+            << " slots; o_orderdate is column " << *kTpchColumns.Find("o_orderdate") << " of orders.\n";
+
+  // Finally, a small benchmark. We look up the same keys many times in both
+  // the perfect hash map and an equivalent std::unordered_map. The sum is
+  // printed so that the compiler cannot optimize the loops away.
+  const std::string_view probes[] = {"foo", "jignesh", "spam", "eggs", "garlic rice", "bacon", "pancakes"};
+  const std::unordered_map<std::string, int> std_map = {
+      {"foo", 2}, {"jignesh", 445}, {"spam", 15}, {"eggs", 2}, {"garlic rice", 3}, {"bacon", 5},
+  };
+  constexpr int kIterations = 1000000;
+
+  auto start = std::chrono::steady_clock::now();
+  long perfect_sum = 0;
+  for (int i = 0; i < kIterations; ++i) {
+    for (std::string_view probe : probes) {
+      if (const int *value = kFoodMap.Find(probe); value != nullptr) {
+        perfect_sum += *value;
+      }
+    }
+  }
+  auto perfect_time = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  long std_sum = 0;
+  for (int i = 0; i < kIterations; ++i) {
+    for (std::string_view probe : probes) {
+      // std::unordered_map<std::string, int> only accepts std::string keys in
+      // C++17, so each lookup has to build a std::string first.
+      auto it = std_map.find(std::string(probe));
+      if (it != std_map.end()) {
+        std_sum += it->second;
+      }
+    }
+  }
+  auto std_time = std::chrono::steady_clock::now() - start;
+
+  std::cout << "PerfectHashMap:     "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(perfect_time).count()
+            << " ms (sum " << perfect_sum << ")\n";
+  std::cout << "std::unordered_map: "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std_time).count()
+            << " ms (sum " << std_sum << ")\n";
+
+  return 0;
+}
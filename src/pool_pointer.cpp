@@ -0,0 +1,338 @@
+/**
+ * @file pool_pointer.cpp
+ * @brief Tutorial code for extending the Pointer<T> class from
+ * spring2024/s24_my_ptr.cpp with allocator and logging policies, so that
+ * objects can come from an object pool, with no extra space per pointer.
+ */
+
+// The Pointer<T> class in spring2024/s24_my_ptr.cpp is a simple version of
+// std::unique_ptr. It allocates with `new T` and frees with `delete`, and
+// prints a line on every construction and destruction. That is great for
+// seeing what is going on, but in code that creates and destroys many small
+// objects, every Pointer then costs one trip to malloc, one to free, and two
+// writes to std::cout.
+
+// Here, Pointer gets two more template parameters, the way std::unique_ptr
+// has a Deleter parameter and std::vector has an Allocator parameter:
+// - Allocator decides where objects come from and go back to. The default,
+//   NewDeleteAllocator, uses new and delete like before. PoolAllocator takes
+//   objects from an ObjectPool, which hands out slots from big slabs of
+//   memory and keeps freed slots on a free list for reuse, so malloc is only
+//   called once per slab.
+// - Logging decides what happens on construction and destruction. NoLogging
+//   does nothing (and compiles to nothing), and CoutLogging prints like the
+//   original Pointer did.
+
+// An allocator may need state, like which pool to use, so Pointer has to
+// store one. But most allocators are empty classes, and in C++ even an empty
+// member takes at least one byte (plus padding, so 8 bytes next to a
+// pointer). The trick is the empty base optimization (EBO): an empty base
+// class takes no space at all. So Pointer inherits from its Allocator
+// instead of having one as a member, and a Pointer with an empty allocator
+// is exactly as big as a raw pointer. std::unique_ptr stores its deleter
+// the same way.
+
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::unique_ptr, for comparison.
+#include <memory>
+// Includes placement new.
+#include <new>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes std::is_empty_v.
+#include <type_traits>
+// Includes the utility header for std::move and std::forward.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// The ObjectPool class hands out memory for objects of type T from slabs of
+// kSlabSize slots each. A freed slot is put on a free list, which is threaded
+// through the free slots themselves, and handed out again before any new
+// slab is allocated. The pool is not thread-safe.
+template <typename T, size_t kSlabSize = 256>
+class ObjectPool {
+ public:
+  ObjectPool() = default;
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  // Frees the slabs, unless objects are still alive, in which case the slabs
+  // are leaked rather than freed out from under those objects.
+  ~ObjectPool() {
+    if (live_ != 0) {
+      return;
+    }
+    for (Slot *slab : slabs_) {
+      delete[] slab;
+    }
+  }
+
+  // Constructs a T in a free slot.
+  template <typename... Args>
+  T *New(Args &&...args) {
+    if (free_ == nullptr) {
+      Grow();
+    }
+    Slot *slot = free_;
+    free_ = slot->next_;
+    T *object;
+    try {
+      object = new (slot->storage_) T(std::forward<Args>(args)...);
+    } catch (...) {
+      slot->next_ = free_;
+      free_ = slot;
+      throw;
+    }
+    ++live_;
+    return object;
+  }
+
+  // Destroys an object from New, and puts its slot on the free list.
+  void Delete(T *object) {
+    object->~T();
+    Slot *slot = reinterpret_cast<Slot *>(object);
+    slot->next_ = free_;
+    free_ = slot;
+    --live_;
+  }
+
+  size_t Live() const { return live_; }
+  size_t Capacity() const { return slabs_.size() * kSlabSize; }
+
+ private:
+  // A slot holds either an object or, while it is free, the next free slot.
+  union Slot {
+    Slot *next_;
+    alignas(T) unsigned char storage_[sizeof(T)];
+  };
+
+  void Grow() {
+    Slot *slab = new Slot[kSlabSize];
+    slabs_.push_back(slab);
+    for (size_t i = 0; i < kSlabSize; ++i) {
+      slab[i].next_ = free_;
+      free_ = &slab[i];
+    }
+  }
+
+  Slot *free_ = nullptr;
+  size_t live_ = 0;
+  std::vector<Slot *> slabs_;
+};
+
+// An allocator that uses new and delete. It is empty.
+template <typename T>
+struct NewDeleteAllocator {
+  template <typename... Args>
+  T *Allocate(Args &&...args) {
+    return new T(std::forward<Args>(args)...);
+  }
+  void Deallocate(T *ptr) { delete ptr; }
+};
+
+// An allocator that uses the calling thread's ObjectPool<T>. It is empty too;
+// the pool is found through a thread_local variable. Since each thread has
+// its own pool, an object must be freed by the thread that allocated it.
+template <typename T>
+struct PoolAllocator {
+  static ObjectPool<T> &Pool() {
+    thread_local ObjectPool<T> pool;
+    return pool;
+  }
+  template <typename... Args>
+  T *Allocate(Args &&...args) {
+    return Pool().New(std::forward<Args>(args)...);
+  }
+  void Deallocate(T *ptr) { Pool().Delete(ptr); }
+};
+
+// An allocator that uses a given ObjectPool<T>, for example one per request
+// or per query. It is not empty, so Pointers that use it are bigger.
+template <typename T>
+class PoolRefAllocator {
+ public:
+  explicit PoolRefAllocator(ObjectPool<T> *pool) : pool_(pool) {}
+  template <typename... Args>
+  T *Allocate(Args &&...args) {
+    return pool_->New(std::forward<Args>(args)...);
+  }
+  void Deallocate(T *ptr) { pool_->Delete(ptr); }
+
+ private:
+  ObjectPool<T> *pool_;
+};
+
+// Logging policies. They only have static member functions, so they take no
+// space and need not be stored at all.
+struct NoLogging {
+  template <typename T>
+  static void Created(const T & /*value*/) {}
+  template <typename T>
+  static void Freed(const T & /*value*/) {}
+};
+
+struct CoutLogging {
+  template <typename T>
+  static void Created(const T &value) {
+    std::cout << "New object on the heap: " << value << std::endl;
+  }
+  template <typename T>
+  static void Freed(const T &value) {
+    std::cout << "Freed: " << value << std::endl;
+  }
+};
+
+// The Pointer class from spring2024/s24_my_ptr.cpp, with Allocator and
+// Logging parameters. Pointer inherits from Allocator privately: it is not an
+// Allocator, it just stores one for free when the Allocator is empty.
+template <typename T, typename Allocator = NewDeleteAllocator<T>, typename Logging = NoLogging>
+class Pointer : private Allocator {
+ public:
+  explicit Pointer(Allocator allocator = Allocator()) : Pointer(T{}, std::move(allocator)) {}
+  explicit Pointer(T val, Allocator allocator = Allocator()) : Allocator(std::move(allocator)) {
+    ptr_ = Allocator::Allocate(std::move(val));
+    Logging::Created(*ptr_);
+  }
+  ~Pointer() { Free(); }
+
+  // Copy constructor and copy assignment operator are deleted, like before.
+  Pointer(const Pointer &) = delete;
+  Pointer &operator=(const Pointer &) = delete;
+
+  // The move operations also move the allocator, since the object has to go
+  // back to where it came from.
+  Pointer(Pointer &&another) noexcept : Allocator(std::move(another.GetAllocator())), ptr_(another.ptr_) {
+    another.ptr_ = nullptr;
+  }
+  Pointer &operator=(Pointer &&another) noexcept {
+    if (ptr_ == another.ptr_) {
+      return *this;
+    }
+    Free();
+    GetAllocator() = std::move(another.GetAllocator());
+    ptr_ = another.ptr_;
+    another.ptr_ = nullptr;
+    return *this;
+  }
+
+  T &operator*() { return *ptr_; }
+  T *operator->() { return ptr_; }
+  explicit operator bool() const { return ptr_ != nullptr; }
+
+  T get_val() { return *ptr_; }
+  void set_val(T val) { *ptr_ = val; }
+
+ private:
+  Allocator &GetAllocator() { return *this; }
+
+  void Free() {
+    if (ptr_) {
+      Logging::Freed(*ptr_);
+      Allocator::Deallocate(ptr_);
+      ptr_ = nullptr;
+    }
+  }
+
+  T *ptr_;
+};
+
+// With an empty allocator, a Pointer is as small as a raw pointer.
+static_assert(std::is_empty_v<PoolAllocator<int>>);
+static_assert(sizeof(Pointer<int, PoolAllocator<int>>) == sizeof(int *));
+
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Simulates a workload that creates and destroys many small objects: it keeps
+// a window of live objects and replaces one of them at each step, like a
+// cache or a queue of in-flight requests. make(i) creates a pointer to i.
+// It returns the sum of the values it replaced, so that the compiler cannot
+// skip the work.
+template <typename Make>
+long long Churn(size_t steps, size_t window, Make make) {
+  using Ptr = decltype(make(0));
+  std::vector<Ptr> live;
+  for (size_t i = 0; i < window; ++i) {
+    live.push_back(make(static_cast<long long>(i)));
+  }
+  long long sum = 0;
+  size_t index = 0;
+  for (size_t i = 0; i < steps; ++i) {
+    // A simple scrambled order, so that objects are not freed in the order
+    // they were created.
+    index = (index * 1103515245 + 12345) % window;
+    sum += *live[index];
+    live[index] = make(static_cast<long long>(i));
+  }
+  return sum;
+}
+
+int main(int argc, char *argv[]) {
+  // With CoutLogging, Pointer behaves like the one in s24_my_ptr.cpp.
+  {
+    Pointer<int, NewDeleteAllocator<int>, CoutLogging> p1(4);
+    std::cout << "Hi from p1 " << p1.get_val() << std::endl;
+    p1.set_val(10);
+    Pointer<int, NewDeleteAllocator<int>, CoutLogging> p4 = std::move(p1);
+    std::cout << "Hi from p4 " << p4.get_val() << std::endl;
+  }
+
+  // The same with a pool. Freed objects' slots are reused.
+  {
+    Pointer<int, PoolAllocator<int>, CoutLogging> p5(5);
+    {
+      Pointer<int, PoolAllocator<int>, CoutLogging> p6(6);
+    }
+    Pointer<int, PoolAllocator<int>, CoutLogging> p7(7);
+    std::cout << "Pool has " << PoolAllocator<int>::Pool().Live() << " live objects and room for "
+              << PoolAllocator<int>::Pool().Capacity() << std::endl;
+  }
+
+  // A Pointer with a stateful allocator needs room for the allocator.
+  ObjectPool<int> request_pool;
+  Pointer<int, PoolRefAllocator<int>> p8(8, PoolRefAllocator<int>(&request_pool));
+  std::cout << "sizeof(Pointer<int>) = " << sizeof(Pointer<int>)
+            << ", sizeof(Pointer<int, PoolAllocator<int>>) = " << sizeof(Pointer<int, PoolAllocator<int>>)
+            << ", sizeof(Pointer<int, PoolRefAllocator<int>>) = " << sizeof(Pointer<int, PoolRefAllocator<int>>)
+            << std::endl;
+
+  // Now the benchmark. The number of replacements can be passed as the first
+  // argument.
+  size_t steps = argc > 1 ? std::stoul(argv[1]) : 10000000;
+  const size_t window = 10000;
+  long long sums[4];
+  long long unique_ms = TimeMs([&] {
+    sums[0] = Churn(steps, window, [](long long i) { return std::make_unique<long long>(i); });
+  });
+  long long new_ms = TimeMs([&] {
+    sums[1] = Churn(steps, window, [](long long i) { return Pointer<long long>(i); });
+  });
+  long long pool_ms = TimeMs([&] {
+    sums[2] = Churn(steps, window, [](long long i) { return Pointer<long long, PoolAllocator<long long>>(i); });
+  });
+  ObjectPool<long long> pool;
+  long long pool_ref_ms = TimeMs([&] {
+    sums[3] = Churn(steps, window, [&](long long i) {
+      return Pointer<long long, PoolRefAllocator<long long>>(i, PoolRefAllocator<long long>(&pool));
+    });
+  });
+  if (sums[0] != sums[1] || sums[1] != sums[2] || sums[2] != sums[3]) {
+    std::cout << "The pointers disagree!\n";
+    return 1;
+  }
+  std::cout << steps << " replacements in a window of " << window << " objects (times in ms):\n";
+  std::cout << "std::unique_ptr               " << unique_ms << "\n";
+  std::cout << "Pointer, new/delete           " << new_ms << "\n";
+  std::cout << "Pointer, PoolAllocator        " << pool_ms << "\n";
+  std::cout << "Pointer, PoolRefAllocator     " << pool_ref_ms << "\n";
+
+  return 0;
+}
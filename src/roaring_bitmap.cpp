@@ -0,0 +1,777 @@
+/**
+ * @file roaring_bitmap.cpp
+ * @brief Tutorial code for a compressed "roaring" bitmap set of integers.
+ */
+
+// sets.cpp stores integers in a std::set<int>. That works well for a few
+// elements, but each element costs a whole tree node: the int, three
+// pointers, a color, and malloc's own bookkeeping, which adds up to 40 or
+// more bytes per element. Databases often need sets of millions of row IDs
+// (for example, "all rows where color = red"), and at that size the memory
+// use and the cost of intersecting two such sets both become a problem.
+
+// A bitmap (one bit per possible value) is tiny for dense sets and makes set
+// algebra very fast, since AND and OR work on 64 values at a time. But a
+// plain bitmap over all 32-bit integers is 512 MB, which is wasteful for a
+// sparse set. A roaring bitmap gets the best of both worlds. It splits the
+// 32-bit space into chunks of 65536 values, keyed by the upper 16 bits, and
+// stores the lower 16 bits of each chunk in whichever container is smallest:
+//   1. An array container is a sorted array of 16-bit values. It is used for
+//      sparse chunks with at most 4096 values (2 bytes per value).
+//   2. A bitmap container is 65536 bits (8 KB). It is used for dense chunks
+//      with more than 4096 values (at most 8 KB / 4096 = 2 bytes per value).
+//   3. A run container is a list of (start, length) pairs. It is used for
+//      chunks made of long runs of consecutive values, like ranges of row IDs.
+// You can read more about roaring bitmaps at https://roaringbitmap.org/.
+
+// In this file, we implement a roaring bitmap with insertion, lookup,
+// removal, cardinality, union, intersection, difference, and serialization to
+// and from a byte string. The bitmap-to-bitmap operations use AVX2 SIMD
+// instructions when the CPU supports them.
+
+// Includes std::lower_bound, std::set_union and friends.
+#include <algorithm>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint16_t and uint64_t.
+#include <cstdint>
+// Includes std::memcpy.
+#include <cstring>
+// Includes std::greater_equal.
+#include <functional>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::back_inserter.
+#include <iterator>
+// Includes std::mt19937 for generating random row IDs.
+#include <random>
+// Includes the set container library header for the benchmark.
+#include <set>
+// Includes std::runtime_error.
+#include <stdexcept>
+// Includes std::string, which we use as a byte buffer for serialization.
+#include <string>
+// Includes the vector container library header.
+#include <vector>
+
+// The SIMD intrinsics are only available on x86 CPUs. On other CPUs (such as
+// Apple Silicon), we fall back to plain 64-bit loops.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ROARING_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+constexpr int kBitmapWords = 65536 / 64;
+constexpr uint32_t kMaxArraySize = 4096;
+
+enum class SetOp { kUnion, kIntersection, kDifference };
+
+// Combines two 8 KB bitmaps word by word, and returns the number of bits set
+// in the result. This scalar version works on any CPU.
+uint32_t BitmapOpScalar(const uint64_t *a, const uint64_t *b, uint64_t *out, SetOp op) {
+  uint32_t cardinality = 0;
+  for (int i = 0; i < kBitmapWords; ++i) {
+    uint64_t word = op == SetOp::kUnion ? (a[i] | b[i]) : op == SetOp::kIntersection ? (a[i] & b[i]) : (a[i] & ~b[i]);
+    out[i] = word;
+    cardinality += __builtin_popcountll(word);
+  }
+  return cardinality;
+}
+
+#ifdef ROARING_HAS_AVX2
+// Counts the bits in a 256-bit vector. AVX2 has no popcount instruction, so
+// we use a 16-entry lookup table of popcounts for each 4-bit nibble, and
+// _mm256_shuffle_epi8 to look up 32 nibbles at a time. _mm256_sad_epu8 then
+// adds up the byte counts into four 64-bit sums.
+__attribute__((target("avx2"))) inline __m256i PopcountAvx2(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2,
+                                          2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0F);
+  __m256i low = _mm256_and_si256(v, low_mask);
+  __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+  return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+// The AVX2 version of BitmapOpScalar processes 256 bits per instruction. The
+// target attribute lets the compiler use AVX2 in this function only, so the
+// rest of the program still runs on CPUs without AVX2.
+__attribute__((target("avx2"))) uint32_t BitmapOpAvx2(const uint64_t *a, const uint64_t *b, uint64_t *out, SetOp op) {
+  __m256i total = _mm256_setzero_si256();
+  for (int i = 0; i < kBitmapWords; i += 4) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    __m256i word = op == SetOp::kUnion          ? _mm256_or_si256(va, vb)
+                   : op == SetOp::kIntersection ? _mm256_and_si256(va, vb)
+                                                : _mm256_andnot_si256(vb, va);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), word);
+    total = _mm256_add_epi64(total, PopcountAvx2(word));
+  }
+  uint64_t sums[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums), total);
+  return static_cast<uint32_t>(sums[0] + sums[1] + sums[2] + sums[3]);
+}
+#endif
+
+// Picks the fastest available version at runtime. The CPU check is done once
+// and cached in a static local variable.
+uint32_t BitmapOp(const uint64_t *a, const uint64_t *b, uint64_t *out, SetOp op) {
+#ifdef ROARING_HAS_AVX2
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    return BitmapOpAvx2(a, b, out, op);
+  }
+#endif
+  return BitmapOpScalar(a, b, out, op);
+}
+
+// Helpers for appending and reading little-endian integers in a byte string.
+// We assume the machine itself is little-endian, which is true for x86 and
+// ARM computers you are likely to use.
+template <typename T>
+void AppendRaw(std::string *out, const T *data, size_t count) {
+  out->append(reinterpret_cast<const char *>(data), count * sizeof(T));
+}
+
+template <typename T>
+void ReadRaw(const std::string &in, size_t *offset, T *data, size_t count) {
+  if (*offset + count * sizeof(T) > in.size()) {
+    throw std::runtime_error("RoaringBitmap: serialized data is truncated");
+  }
+  std::memcpy(data, in.data() + *offset, count * sizeof(T));
+  *offset += count * sizeof(T);
+}
+
+// The RoaringBitmap class is a set of uint32_t values. keys_[i] holds the
+// upper 16 bits shared by every value in containers_[i], and keys_ is sorted.
+class RoaringBitmap {
+ public:
+  // Adds a value to the set.
+  void Add(uint32_t value) {
+    Container &container = GetOrCreate(static_cast<uint16_t>(value >> 16));
+    container.Add(static_cast<uint16_t>(value & 0xFFFF));
+  }
+
+  // Adds every value in [lo, hi). Chunks that the range covers completely
+  // become a single run, so adding a huge range is cheap.
+  void AddRange(uint32_t lo, uint32_t hi) {
+    uint64_t start = lo;
+    while (start < hi) {
+      uint16_t key = static_cast<uint16_t>(start >> 16);
+      uint64_t chunk_end = std::min<uint64_t>(hi, (static_cast<uint64_t>(key) + 1) << 16);
+      Container &container = GetOrCreate(key);
+      uint64_t chunk_start = static_cast<uint64_t>(key) << 16;
+      container.AddRange(static_cast<uint32_t>(start - chunk_start), static_cast<uint32_t>(chunk_end - chunk_start));
+      start = chunk_end;
+    }
+  }
+
+  // Removes a value from the set. It returns whether the value was present.
+  bool Remove(uint32_t value) {
+    int index = FindContainer(static_cast<uint16_t>(value >> 16));
+    if (index < 0 || !containers_[index].Remove(static_cast<uint16_t>(value & 0xFFFF))) {
+      return false;
+    }
+    if (containers_[index].cardinality_ == 0) {
+      keys_.erase(keys_.begin() + index);
+      containers_.erase(containers_.begin() + index);
+    }
+    return true;
+  }
+
+  bool Contains(uint32_t value) const {
+    int index = FindContainer(static_cast<uint16_t>(value >> 16));
+    return index >= 0 && containers_[index].Contains(static_cast<uint16_t>(value & 0xFFFF));
+  }
+
+  // Every container caches its own cardinality, so this is just a sum over
+  // the containers rather than a count over every value.
+  uint64_t Cardinality() const {
+    uint64_t total = 0;
+    for (const Container &container : containers_) {
+      total += container.cardinality_;
+    }
+    return total;
+  }
+
+  // Converts every container to a run container if that is smaller. Call this
+  // once a bitmap has been built, for example before serializing it.
+  void RunOptimize() {
+    for (Container &container : containers_) {
+      container.RunOptimize();
+    }
+  }
+
+  // Returns all values in increasing order.
+  std::vector<uint32_t> ToVector() const {
+    std::vector<uint32_t> values;
+    values.reserve(Cardinality());
+    for (size_t i = 0; i < containers_.size(); ++i) {
+      uint32_t high = static_cast<uint32_t>(keys_[i]) << 16;
+      containers_[i].ForEach([&values, high](uint16_t low) { values.push_back(high | low); });
+    }
+    return values;
+  }
+
+  // Returns approximately how many bytes the set uses.
+  size_t SizeInBytes() const {
+    size_t bytes = keys_.size() * (sizeof(uint16_t) + sizeof(Container));
+    for (const Container &container : containers_) {
+      bytes += container.array_.size() * sizeof(uint16_t) + container.bitmap_.size() * sizeof(uint64_t);
+    }
+    return bytes;
+  }
+
+  // The three set operations return a new bitmap. Containers with the same
+  // key are combined; containers that only appear in one input are copied
+  // (for union and difference) or skipped (for intersection).
+  static RoaringBitmap Union(const RoaringBitmap &a, const RoaringBitmap &b) { return Combine(a, b, SetOp::kUnion); }
+  static RoaringBitmap Intersection(const RoaringBitmap &a, const RoaringBitmap &b) {
+    return Combine(a, b, SetOp::kIntersection);
+  }
+  static RoaringBitmap Difference(const RoaringBitmap &a, const RoaringBitmap &b) {
+    return Combine(a, b, SetOp::kDifference);
+  }
+
+  // Serializes the set into a byte string. The format is:
+  //   uint32_t number of containers, then for each container:
+  //   uint16_t key, uint8_t container type, uint32_t element count, and the
+  //   container's data (16-bit values, 64-bit words, or 16-bit run pairs).
+  std::string Serialize() const {
+    std::string out;
+    uint32_t count = static_cast<uint32_t>(containers_.size());
+    AppendRaw(&out, &count, 1);
+    for (size_t i = 0; i < containers_.size(); ++i) {
+      const Container &container = containers_[i];
+      uint8_t type = static_cast<uint8_t>(container.type_);
+      uint32_t size = static_cast<uint32_t>(container.type_ == ContainerType::kBitmap ? container.bitmap_.size()
+                                                                                      : container.array_.size());
+      AppendRaw(&out, &keys_[i], 1);
+      AppendRaw(&out, &type, 1);
+      AppendRaw(&out, &size, 1);
+      if (container.type_ == ContainerType::kBitmap) {
+        AppendRaw(&out, container.bitmap_.data(), size);
+      } else {
+        AppendRaw(&out, container.array_.data(), size);
+      }
+    }
+    return out;
+  }
+
+  // Rebuilds a set from the output of Serialize. It throws
+  // std::runtime_error if the data is malformed.
+  static RoaringBitmap Deserialize(const std::string &in) {
+    RoaringBitmap result;
+    size_t offset = 0;
+    uint32_t count = 0;
+    ReadRaw(in, &offset, &count, 1);
+    for (uint32_t i = 0; i < count; ++i) {
+      uint16_t key = 0;
+      uint8_t type = 0;
+      uint32_t size = 0;
+      ReadRaw(in, &offset, &key, 1);
+      ReadRaw(in, &offset, &type, 1);
+      ReadRaw(in, &offset, &size, 1);
+      if (type > static_cast<uint8_t>(ContainerType::kRun) || (!result.keys_.empty() && key <= result.keys_.back())) {
+        throw std::runtime_error("RoaringBitmap: serialized data is corrupt");
+      }
+      Container container;
+      container.type_ = static_cast<ContainerType>(type);
+      // The size is checked before anything is allocated, and the contents
+      // after they are read, since the other member functions rely on them.
+      if (!Container::IsValidSize(container.type_, size)) {
+        throw std::runtime_error("RoaringBitmap: serialized data is corrupt");
+      }
+      if (container.type_ == ContainerType::kBitmap) {
+        container.bitmap_.resize(size);
+        ReadRaw(in, &offset, container.bitmap_.data(), size);
+      } else {
+        container.array_.resize(size);
+        ReadRaw(in, &offset, container.array_.data(), size);
+      }
+      if (!container.IsValid()) {
+        throw std::runtime_error("RoaringBitmap: serialized data is corrupt");
+      }
+      container.RecomputeCardinality();
+      result.keys_.push_back(key);
+      result.containers_.push_back(std::move(container));
+    }
+    return result;
+  }
+
+ private:
+  enum class ContainerType : uint8_t { kArray, kBitmap, kRun };
+
+  // A container holds the lower 16 bits of the values in one chunk. Array and
+  // run containers use array_, and bitmap containers use bitmap_. For a run
+  // container, array_ holds pairs of (start, length - 1), so that a run that
+  // covers the whole chunk still fits in 16 bits.
+  struct Container {
+    ContainerType type_{ContainerType::kArray};
+    uint32_t cardinality_{0};
+    std::vector<uint16_t> array_;
+    std::vector<uint64_t> bitmap_;
+
+    bool Contains(uint16_t low) const {
+      switch (type_) {
+        case ContainerType::kArray: return std::binary_search(array_.begin(), array_.end(), low);
+        case ContainerType::kBitmap: return (bitmap_[low >> 6] >> (low & 63)) & 1;
+        case ContainerType::kRun: {
+          size_t runs = RunsStartingAtOrBefore(low);
+          return runs > 0 && low - array_[2 * (runs - 1)] <= array_[2 * (runs - 1) + 1];
+        }
+      }
+      return false;
+    }
+
+    // Returns the number of runs that start at or before `low`, so the run
+    // that could contain it is the one before that.
+    size_t RunsStartingAtOrBefore(uint16_t low) const {
+      size_t lo = 0;
+      size_t hi = array_.size() / 2;
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (array_[2 * mid] <= low) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      return lo;
+    }
+
+    void Add(uint16_t low) {
+      if (type_ == ContainerType::kRun) {
+        AddToRuns(low);
+        return;
+      }
+      if (type_ == ContainerType::kArray) {
+        auto it = std::lower_bound(array_.begin(), array_.end(), low);
+        if (it != array_.end() && *it == low) {
+          return;
+        }
+        array_.insert(it, low);
+        if (++cardinality_ > kMaxArraySize) {
+          ConvertToBitmap();
+        }
+        return;
+      }
+      uint64_t &word = bitmap_[low >> 6];
+      uint64_t bit = 1ULL << (low & 63);
+      cardinality_ += (word & bit) == 0;
+      word |= bit;
+    }
+
+    // Adds a value to a run container without converting it: the value
+    // extends the run that ends right before it or starts right after it
+    // (joining the two if it fills the gap between them), or becomes a new
+    // run of length one. RunOptimize decides later whether runs are still
+    // the smallest representation.
+    void AddToRuns(uint16_t low) {
+      size_t runs = RunsStartingAtOrBefore(low);
+      size_t next = 2 * runs;
+      bool extends_previous = false;
+      if (runs > 0) {
+        uint32_t previous_end = static_cast<uint32_t>(array_[next - 2]) + array_[next - 1];
+        if (low <= previous_end) {
+          return;
+        }
+        extends_previous = low == previous_end + 1;
+      }
+      bool extends_next = next < array_.size() && array_[next] == low + 1;
+      if (extends_previous && extends_next) {
+        array_[next - 1] = static_cast<uint16_t>(array_[next - 1] + array_[next + 1] + 2);
+        array_.erase(array_.begin() + next, array_.begin() + next + 2);
+      } else if (extends_previous) {
+        ++array_[next - 1];
+      } else if (extends_next) {
+        array_[next] = low;
+        ++array_[next + 1];
+      } else {
+        array_.insert(array_.begin() + next, {low, 0});
+      }
+      ++cardinality_;
+    }
+
+    // Adds every value in [lo, hi), where hi may be 65536.
+    void AddRange(uint32_t lo, uint32_t hi) {
+      if (cardinality_ == 0) {
+        // An empty container becomes a single run.
+        type_ = ContainerType::kRun;
+        array_ = {static_cast<uint16_t>(lo), static_cast<uint16_t>(hi - lo - 1)};
+        cardinality_ = hi - lo;
+        return;
+      }
+      ConvertToBitmap();
+      for (uint32_t low = lo; low < hi; ++low) {
+        bitmap_[low >> 6] |= 1ULL << (low & 63);
+      }
+      RecomputeCardinality();
+      Shrink();
+    }
+
+    bool Remove(uint16_t low) {
+      if (!Contains(low)) {
+        return false;
+      }
+      if (type_ == ContainerType::kRun) {
+        ConvertToBitmap();
+      }
+      if (type_ == ContainerType::kArray) {
+        array_.erase(std::lower_bound(array_.begin(), array_.end(), low));
+      } else {
+        bitmap_[low >> 6] &= ~(1ULL << (low & 63));
+      }
+      --cardinality_;
+      Shrink();
+      return true;
+    }
+
+    template <typename Fn>
+    void ForEach(Fn fn) const {
+      switch (type_) {
+        case ContainerType::kArray:
+          for (uint16_t low : array_) {
+            fn(low);
+          }
+          break;
+        case ContainerType::kBitmap:
+          for (int i = 0; i < kBitmapWords; ++i) {
+            // Visit the set bits one at a time: __builtin_ctzll finds the
+            // lowest set bit, and word & (word - 1) clears it.
+            for (uint64_t word = bitmap_[i]; word != 0; word &= word - 1) {
+              fn(static_cast<uint16_t>(i * 64 + __builtin_ctzll(word)));
+            }
+          }
+          break;
+        case ContainerType::kRun:
+          for (size_t i = 0; i < array_.size(); i += 2) {
+            for (uint32_t low = array_[i]; low <= static_cast<uint32_t>(array_[i]) + array_[i + 1]; ++low) {
+              fn(static_cast<uint16_t>(low));
+            }
+          }
+          break;
+      }
+    }
+
+    // Whether a serialized container of this type may have this many
+    // elements in array_ or bitmap_. Empty containers are never stored, an
+    // array holds at most kMaxArraySize values, and a run container holds
+    // pairs of at most 32768 runs (every other value of the chunk).
+    static bool IsValidSize(ContainerType type, uint32_t size) {
+      switch (type) {
+        case ContainerType::kArray: return size > 0 && size <= kMaxArraySize;
+        case ContainerType::kBitmap: return size == kBitmapWords;
+        case ContainerType::kRun: return size > 0 && size % 2 == 0 && size <= 65536;
+      }
+      return false;
+    }
+
+    // Whether the contents are what this class would have written: array
+    // values strictly increasing, a bitmap with at least one bit set, and
+    // runs sorted, not overlapping, and ending at or before 0xFFFF.
+    bool IsValid() const {
+      switch (type_) {
+        case ContainerType::kArray:
+          return std::adjacent_find(array_.begin(), array_.end(), std::greater_equal<uint16_t>()) == array_.end();
+        case ContainerType::kBitmap:
+          return std::any_of(bitmap_.begin(), bitmap_.end(), [](uint64_t word) { return word != 0; });
+        case ContainerType::kRun: {
+          int64_t previous_end = -1;
+          for (size_t i = 0; i < array_.size(); i += 2) {
+            int64_t end = static_cast<int64_t>(array_[i]) + array_[i + 1];
+            if (array_[i] <= previous_end || end > 0xFFFF) {
+              return false;
+            }
+            previous_end = end;
+          }
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void RecomputeCardinality() {
+      cardinality_ = 0;
+      if (type_ == ContainerType::kArray) {
+        cardinality_ = static_cast<uint32_t>(array_.size());
+      } else if (type_ == ContainerType::kBitmap) {
+        for (uint64_t word : bitmap_) {
+          cardinality_ += __builtin_popcountll(word);
+        }
+      } else {
+        for (size_t i = 0; i < array_.size(); i += 2) {
+          cardinality_ += array_[i + 1] + 1U;
+        }
+      }
+    }
+
+    void ConvertToBitmap() {
+      if (type_ == ContainerType::kBitmap) {
+        return;
+      }
+      std::vector<uint64_t> bitmap(kBitmapWords, 0);
+      ForEach([&bitmap](uint16_t low) { bitmap[low >> 6] |= 1ULL << (low & 63); });
+      bitmap_ = std::move(bitmap);
+      array_.clear();
+      array_.shrink_to_fit();
+      type_ = ContainerType::kBitmap;
+    }
+
+    // Turns a bitmap container that has become sparse back into an array.
+    void Shrink() {
+      if (type_ == ContainerType::kBitmap && cardinality_ <= kMaxArraySize) {
+        std::vector<uint16_t> array;
+        array.reserve(cardinality_);
+        ForEach([&array](uint16_t low) { array.push_back(low); });
+        array_ = std::move(array);
+        bitmap_.clear();
+        bitmap_.shrink_to_fit();
+        type_ = ContainerType::kArray;
+      }
+    }
+
+    // Switches to a run container if that would be smaller than an array or
+    // bitmap, and back if not. A run costs 4 bytes, an array value costs 2
+    // bytes, and a bitmap always costs 8 KB; without runs, a container is an
+    // array up to kMaxArraySize values and a bitmap above that.
+    void RunOptimize() {
+      std::vector<uint16_t> runs;
+      int64_t previous = -2;
+      ForEach([&runs, &previous](uint16_t low) {
+        if (low == previous + 1) {
+          ++runs.back();
+        } else {
+          runs.push_back(low);
+          runs.push_back(0);
+        }
+        previous = low;
+      });
+      size_t without_runs_bytes = cardinality_ <= kMaxArraySize ? cardinality_ * 2 : kBitmapWords * 8;
+      if (runs.size() * 2 < without_runs_bytes) {
+        array_ = std::move(runs);
+        bitmap_.clear();
+        bitmap_.shrink_to_fit();
+        type_ = ContainerType::kRun;
+      } else if (type_ == ContainerType::kRun) {
+        ConvertToBitmap();
+        Shrink();
+      }
+    }
+  };
+
+  int FindContainer(uint16_t key) const {
+    auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+    return it != keys_.end() && *it == key ? static_cast<int>(it - keys_.begin()) : -1;
+  }
+
+  Container &GetOrCreate(uint16_t key) {
+    auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+    size_t index = it - keys_.begin();
+    if (it == keys_.end() || *it != key) {
+      keys_.insert(it, key);
+      containers_.insert(containers_.begin() + index, Container{});
+    }
+    return containers_[index];
+  }
+
+  // Combines two containers with the same key. Two arrays are merged
+  // directly. An array intersected with (or minus) a bitmap only needs to
+  // test each array value against the bitmap. Every other case goes through
+  // the SIMD bitmap kernel, after converting run and array containers into
+  // temporary bitmaps.
+  static Container CombineContainers(const Container &a, const Container &b, SetOp op) {
+    Container result;
+    if (a.type_ == ContainerType::kArray && b.type_ == ContainerType::kArray) {
+      auto out = std::back_inserter(result.array_);
+      if (op == SetOp::kUnion) {
+        std::set_union(a.array_.begin(), a.array_.end(), b.array_.begin(), b.array_.end(), out);
+      } else if (op == SetOp::kIntersection) {
+        std::set_intersection(a.array_.begin(), a.array_.end(), b.array_.begin(), b.array_.end(), out);
+      } else {
+        std::set_difference(a.array_.begin(), a.array_.end(), b.array_.begin(), b.array_.end(), out);
+      }
+      result.RecomputeCardinality();
+      if (result.cardinality_ > kMaxArraySize) {
+        result.ConvertToBitmap();
+      }
+      return result;
+    }
+
+    if (a.type_ == ContainerType::kArray && op != SetOp::kUnion) {
+      for (uint16_t low : a.array_) {
+        if (b.Contains(low) == (op == SetOp::kIntersection)) {
+          result.array_.push_back(low);
+        }
+      }
+      result.RecomputeCardinality();
+      return result;
+    }
+
+    Container left = a;
+    Container right = b;
+    left.ConvertToBitmap();
+    right.ConvertToBitmap();
+    result.type_ = ContainerType::kBitmap;
+    result.bitmap_.resize(kBitmapWords);
+    result.cardinality_ = BitmapOp(left.bitmap_.data(), right.bitmap_.data(), result.bitmap_.data(), op);
+    result.Shrink();
+    return result;
+  }
+
+  static RoaringBitmap Combine(const RoaringBitmap &a, const RoaringBitmap &b, SetOp op) {
+    RoaringBitmap result;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.keys_.size() || j < b.keys_.size()) {
+      bool take_a = j == b.keys_.size() || (i < a.keys_.size() && a.keys_[i] < b.keys_[j]);
+      bool take_b = i == a.keys_.size() || (j < b.keys_.size() && b.keys_[j] < a.keys_[i]);
+      if (take_a) {
+        if (op != SetOp::kIntersection) {
+          result.keys_.push_back(a.keys_[i]);
+          result.containers_.push_back(a.containers_[i]);
+        }
+        ++i;
+      } else if (take_b) {
+        if (op == SetOp::kUnion) {
+          result.keys_.push_back(b.keys_[j]);
+          result.containers_.push_back(b.containers_[j]);
+        }
+        ++j;
+      } else {
+        Container combined = CombineContainers(a.containers_[i], b.containers_[j], op);
+        if (combined.cardinality_ > 0) {
+          result.keys_.push_back(a.keys_[i]);
+          result.containers_.push_back(std::move(combined));
+        }
+        ++i;
+        ++j;
+      }
+    }
+    return result;
+  }
+
+  std::vector<uint16_t> keys_;
+  std::vector<Container> containers_;
+};
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many microseconds it took.
+template <typename Fn>
+long long TimeUs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We start with the same kind of set as sets.cpp: the integers 1 through
+  // 10, added one at a time.
+  RoaringBitmap small;
+  for (uint32_t i = 1; i <= 10; ++i) {
+    small.Add(i);
+  }
+  if (small.Contains(5)) {
+    std::cout << "Element 5 is in the set." << std::endl;
+  }
+  small.Remove(5);
+  if (!small.Contains(5)) {
+    std::cout << "Element 5 is not in the set." << std::endl;
+  }
+  std::cout << "Printing the elements of the roaring bitmap:\n";
+  for (uint32_t value : small.ToVector()) {
+    std::cout << value << " ";
+  }
+  std::cout << "\n";
+
+  // Now let's build two posting lists of row IDs. `dense` holds a few long
+  // ranges of rows, and `sparse` holds random rows. The size can be passed as
+  // the first argument.
+  uint32_t n = argc > 1 ? static_cast<uint32_t>(std::stoul(argv[1])) : 1000000;
+  RoaringBitmap dense;
+  std::set<int> dense_set;
+  for (uint32_t start = 0; start < 8 * n; start += 4 * n / 5) {
+    dense.AddRange(start, start + n / 4);
+    for (uint32_t i = start; i < start + n / 4; ++i) {
+      dense_set.insert(static_cast<int>(i));
+    }
+  }
+  RoaringBitmap sparse;
+  std::set<int> sparse_set;
+  std::mt19937 rng(445);
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t row = rng() % (8 * n);
+    sparse.Add(row);
+    sparse_set.insert(static_cast<int>(row));
+  }
+  std::cout << "dense has " << dense.Cardinality() << " rows in " << dense.SizeInBytes() << " bytes, sparse has "
+            << sparse.Cardinality() << " rows in " << sparse.SizeInBytes() << " bytes ("
+            << static_cast<double>(sparse.SizeInBytes()) / sparse.Cardinality() << " bytes per row).\n";
+
+  // Set algebra on roaring bitmaps versus std::set_intersection and friends
+  // on std::set. The results must have the same size.
+  RoaringBitmap both;
+  std::vector<int> both_std;
+  long long roaring_us = TimeUs([&] { both = RoaringBitmap::Intersection(dense, sparse); });
+  long long std_us = TimeUs([&] {
+    std::set_intersection(dense_set.begin(), dense_set.end(), sparse_set.begin(), sparse_set.end(),
+                          std::back_inserter(both_std));
+  });
+  std::cout << "Intersection: roaring " << roaring_us << " us, std::set " << std_us << " us (sizes "
+            << both.Cardinality() << " vs " << both_std.size() << ")\n";
+
+  RoaringBitmap either;
+  std::vector<int> either_std;
+  roaring_us = TimeUs([&] { either = RoaringBitmap::Union(dense, sparse); });
+  std_us = TimeUs([&] {
+    std::set_union(dense_set.begin(), dense_set.end(), sparse_set.begin(), sparse_set.end(),
+                   std::back_inserter(either_std));
+  });
+  std::cout << "Union:        roaring " << roaring_us << " us, std::set " << std_us << " us (sizes "
+            << either.Cardinality() << " vs " << either_std.size() << ")\n";
+
+  RoaringBitmap only_sparse;
+  std::vector<int> only_sparse_std;
+  roaring_us = TimeUs([&] { only_sparse = RoaringBitmap::Difference(sparse, dense); });
+  std_us = TimeUs([&] {
+    std::set_difference(sparse_set.begin(), sparse_set.end(), dense_set.begin(), dense_set.end(),
+                        std::back_inserter(only_sparse_std));
+  });
+  std::cout << "Difference:   roaring " << roaring_us << " us, std::set " << std_us << " us (sizes "
+            << only_sparse.Cardinality() << " vs " << only_sparse_std.size() << ")\n";
+
+  // Finally, serialize the union and read it back. Running RunOptimize first
+  // stores the long ranges as runs, which makes the serialized form smaller.
+  either.RunOptimize();
+  std::string bytes = either.Serialize();
+  RoaringBitmap restored = RoaringBitmap::Deserialize(bytes);
+  std::cout << "Serialized the union into " << bytes.size() << " bytes; the restored set has "
+            << restored.Cardinality() << " rows and "
+            << (restored.ToVector() == either.ToVector() ? "matches" : "does not match") << " the original.\n";
+
+  // Deserialize checks the data instead of trusting it. Here is a run
+  // container with a start but no length, and an array container whose
+  // values are out of order.
+  auto corrupt_container = [](uint8_t type, std::vector<uint16_t> values) {
+    std::string corrupt;
+    uint32_t count = 1;
+    uint16_t key = 0;
+    uint32_t size = static_cast<uint32_t>(values.size());
+    AppendRaw(&corrupt, &count, 1);
+    AppendRaw(&corrupt, &key, 1);
+    AppendRaw(&corrupt, &type, 1);
+    AppendRaw(&corrupt, &size, 1);
+    AppendRaw(&corrupt, values.data(), values.size());
+    return corrupt;
+  };
+  for (const std::string &corrupt : {corrupt_container(2, {7}), corrupt_container(0, {9, 3})}) {
+    try {
+      RoaringBitmap::Deserialize(corrupt);
+      std::cout << "Deserialize accepted corrupt data.\n";
+    } catch (const std::runtime_error &e) {
+      std::cout << "Caught: " << e.what() << "\n";
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,275 @@
+/**
+ * @file seqlock.cpp
+ * @brief Tutorial code for a sequence lock (seqlock), which lets readers read a
+ * small value without writing to shared memory.
+ */
+
+// In rwlock.cpp, read_value takes a std::shared_lock just to read one int.
+// Taking a shared lock writes to the lock's reader count, so even though the
+// readers only want to look at count, they all write to the same cache line,
+// and that cache line has to move between cores for every read.
+// big_reader_lock.cpp spreads those writes over many cache lines. A seqlock
+// gets rid of them entirely.
+
+// A seqlock protects a value with a sequence number that only writers change:
+// - A writer makes the sequence number odd, updates the value, and then makes
+//   the sequence number even again.
+// - A reader reads the sequence number, copies the value, and reads the
+//   sequence number again. If both reads are the same even number, no writer
+//   was active while the value was copied, so the copy is consistent.
+//   Otherwise, the reader simply tries again.
+// Readers never write anything shared, so any number of them can read at the
+// same time without slowing each other down. The catches are that a reader
+// may have to retry while writers are busy, and that the value is copied on
+// every read, so seqlocks are meant for small values that are read far more
+// often than they are written: counters, configuration, or a snapshot of
+// statistics. The Linux kernel uses one for the current time.
+
+// There is one subtle point for C++. A reader may copy the value at the same
+// time as a writer changes it. The reader throws such a copy away, but in
+// C++, reading memory that another thread is writing at the same time is a
+// data race, and the program's behavior is undefined, even if the result is
+// never used. So the value is stored as an array of std::atomic words that
+// are read and written with relaxed atomics, as described in Hans Boehm's
+// "Can Seqlocks Get Along With Programming Language Memory Models?" (2012).
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::memcpy.
+#include <cstring>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes the shared mutex library header.
+#include <shared_mutex>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes std::is_trivially_copyable.
+#include <type_traits>
+// Includes the vector container library header.
+#include <vector>
+
+// The Seqlock class holds a value of type T. Any number of threads may call
+// Load at the same time, and any number of threads may call Store; writers
+// are serialized with each other. T must be trivially copyable (a plain
+// struct of numbers, for example), since it is copied byte by byte.
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable_v<T>, "Seqlock values are copied byte by byte");
+
+ public:
+  explicit Seqlock(const T &value = T{}) { StoreWords(value); }
+
+  // Returns a consistent copy of the value. It retries while a writer is
+  // active, so it may spin if writers never stop.
+  T Load() const {
+    uint64_t words[kWords];
+    for (int attempt = 1;; ++attempt) {
+      uint64_t before = sequence_.load(std::memory_order_acquire);
+      if (before % 2 == 1) {
+        // A writer is in the middle of an update. If it takes long, it may
+        // not be running at all, so we give it our CPU now and then.
+        if (attempt % 64 == 0) {
+          std::this_thread::yield();
+        } else {
+          Pause();
+        }
+        continue;
+      }
+      for (size_t i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      // The acquire fence keeps the second read of the sequence number from
+      // moving before the reads of the words above. If we read any word that
+      // a writer stored, we are then guaranteed to see that writer's odd
+      // sequence number (or a later one) here.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == before) {
+        T value;
+        std::memcpy(&value, words, sizeof(T));
+        return value;
+      }
+    }
+  }
+
+  // Replaces the value.
+  void Store(const T &value) {
+    uint64_t sequence = BeginWrite();
+    StoreWords(value);
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Replaces the value with update(old value), as one atomic step with
+  // respect to other writers. This is how to do read-modify-write updates
+  // like incrementing a field.
+  template <typename Fn>
+  void Update(Fn update) {
+    uint64_t sequence = BeginWrite();
+    T value;
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    }
+    std::memcpy(&value, words, sizeof(T));
+    StoreWords(update(value));
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+ private:
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  // Makes the sequence number odd, which also acts as the writers' lock: a
+  // writer can only move the sequence number from even to odd, so only one
+  // writer at a time gets past this point. It returns the even sequence
+  // number from before the write.
+  uint64_t BeginWrite() {
+    uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    while (true) {
+      if (sequence % 2 == 0 &&
+          sequence_.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+        break;
+      }
+      // Another writer holds the lock; on a single core, it cannot finish
+      // until we give up the CPU.
+      std::this_thread::yield();
+      sequence = sequence_.load(std::memory_order_relaxed);
+    }
+    // The release fence keeps the word stores that follow from moving before
+    // the odd sequence number, so a reader that sees any of them also sees
+    // that a write is in progress.
+    std::atomic_thread_fence(std::memory_order_release);
+    return sequence;
+  }
+
+  void StoreWords(const T &value) {
+    uint64_t words[kWords] = {};
+    std::memcpy(words, &value, sizeof(T));
+    for (size_t i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+  }
+
+  std::atomic<uint64_t> sequence_{0};
+  std::atomic<uint64_t> words_[kWords];
+};
+
+// A statistics snapshot, the kind of value a seqlock is good for. Its fields
+// always satisfy sum == count * (count + 1) / 2 and max == count, so a reader
+// can tell if it ever sees a torn copy.
+struct Stats {
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+// Runs num_readers reader threads that each read the snapshot
+// reads_per_thread times, while one writer updates it writes times. It
+// returns how many milliseconds it took, and sets *torn if any reader saw an
+// inconsistent snapshot.
+template <typename Read, typename Write>
+long long RunReaders(size_t num_readers, size_t reads_per_thread, size_t writes, Read read, Write write,
+                     bool *torn) {
+  std::atomic<bool> any_torn{false};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_readers; ++i) {
+    threads.emplace_back([&] {
+      for (size_t j = 0; j < reads_per_thread; ++j) {
+        Stats stats = read();
+        if (stats.sum_ != stats.count_ * (stats.count_ + 1) / 2 || stats.max_ != stats.count_) {
+          any_torn = true;
+        }
+      }
+    });
+  }
+  threads.emplace_back([&] {
+    for (size_t i = 0; i < writes; ++i) {
+      write();
+      std::this_thread::yield();
+    }
+  });
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  *torn = any_torn;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Adds one more item to a snapshot.
+Stats AddOne(Stats stats) {
+  stats.count_ += 1;
+  stats.sum_ += stats.count_;
+  stats.max_ = stats.count_;
+  return stats;
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from rwlock.cpp with a Seqlock<int>: readers never
+  // take a lock, and writers add 3.
+  Seqlock<int> count(0);
+  auto read_value = [&] { std::cout << "Reading value " + std::to_string(count.Load()) + "\n" << std::flush; };
+  auto write_value = [&] { count.Update([](int value) { return value + 3; }); };
+  std::thread t1(read_value);
+  std::thread t2(write_value);
+  std::thread t3(read_value);
+  std::thread t4(read_value);
+  std::thread t5(write_value);
+  std::thread t6(read_value);
+  t1.join();
+  t2.join();
+  t3.join();
+  t4.join();
+  t5.join();
+  t6.join();
+
+  // Now the benchmark. Each reader reads the snapshot the number of times
+  // passed as the first argument, while one writer keeps updating it.
+  size_t reads = argc > 1 ? std::stoul(argv[1]) : 200000;
+  size_t writes = reads / 100;
+  std::cout << "Each reader reads " << reads << " times while a writer writes " << writes
+            << " times (times in ms):\n";
+  std::cout << "readers  shared_mutex  Seqlock\n";
+  for (size_t num_readers = 1; num_readers <= 64; num_readers *= 2) {
+    Stats shared_stats{0, 0, 0};
+    std::shared_mutex m;
+    bool shared_torn = false;
+    long long shared_ms = RunReaders(
+        num_readers, reads, writes,
+        [&] {
+          std::shared_lock lk(m);
+          return shared_stats;
+        },
+        [&] {
+          std::unique_lock lk(m);
+          shared_stats = AddOne(shared_stats);
+        },
+        &shared_torn);
+
+    Seqlock<Stats> seqlock_stats(Stats{0, 0, 0});
+    bool seqlock_torn = false;
+    long long seqlock_ms = RunReaders(
+        num_readers, reads, writes, [&] { return seqlock_stats.Load(); },
+        [&] { seqlock_stats.Update(AddOne); }, &seqlock_torn);
+
+    if (shared_torn || seqlock_torn) {
+      std::cout << "A reader saw a torn snapshot!\n";
+      return 1;
+    }
+    std::cout << num_readers << "\t " << shared_ms << "\t\t" << seqlock_ms << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,403 @@
+/**
+ * @file small_vector.cpp
+ * @brief Tutorial code for a vector with inline storage for its first few
+ * elements.
+ */
+
+// std::vector always stores its elements in a heap allocation, even when it
+// only holds two or three elements. In move_constructors.cpp, every Person
+// owns a std::vector<std::string> of nicknames, so creating a Person with two
+// nicknames calls malloc for the vector on top of everything else. When you
+// have millions of records that each hold a short list, those small
+// allocations add up, both in time spent in the allocator and in memory
+// scattered all over the heap.
+
+// A "small vector" reserves room for N elements inside the object itself. As
+// long as the vector holds at most N elements, they live in that inline
+// buffer and no heap allocation happens at all. Once it grows past N, it
+// "spills" to the heap and behaves like a normal std::vector from then on.
+// LLVM's SmallVector and Boost's small_vector are well-known examples. In this
+// file, we implement SmallVector<T, N> with the commonly used parts of the
+// std::vector API, and count heap allocations to show the difference.
+
+// Includes std::rotate and the range version of std::move.
+#include <algorithm>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::size_t.
+#include <cstddef>
+// Includes the header for uint32_t.
+#include <cstdint>
+// Includes std::malloc and std::free.
+#include <cstdlib>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::initializer_list for list initialization.
+#include <initializer_list>
+// Includes placement new and operator new/delete, which we replace below.
+#include <new>
+// Includes std::out_of_range, thrown by at.
+#include <stdexcept>
+// Includes the C++ string library.
+#include <string>
+// Includes std::is_nothrow_move_constructible.
+#include <type_traits>
+// Includes std::move and std::forward.
+#include <utility>
+// Includes the vector container library header for comparison.
+#include <vector>
+
+// To see how many heap allocations each container makes, this program
+// replaces the global operator new and operator delete with versions that
+// count calls. Every heap allocation made by new, std::vector,
+// std::string, and SmallVector in this program goes through these functions.
+static size_t allocation_count = 0;
+
+void *operator new(size_t size) {
+  ++allocation_count;
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+// The SmallVector class is a dynamic array of T that stores up to N elements
+// inside the object. The method names match std::vector, so it can be used as
+// a drop-in replacement in most code.
+template <typename T, size_t N>
+class SmallVector {
+  static_assert(N > 0, "SmallVector needs room for at least one inline element");
+
+ public:
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  SmallVector() : data_(InlineData()), size_(0), capacity_(N) {}
+
+  SmallVector(std::initializer_list<T> values) : SmallVector() {
+    reserve(values.size());
+    for (const T &value : values) {
+      emplace_back(value);
+    }
+  }
+
+  SmallVector(size_t count, const T &value) : SmallVector() {
+    reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      emplace_back(value);
+    }
+  }
+
+  SmallVector(const SmallVector &other) : SmallVector() {
+    reserve(other.size_);
+    for (const T &value : other) {
+      emplace_back(value);
+    }
+  }
+
+  // The move constructor is where SmallVector differs most from std::vector.
+  // If other has spilled to the heap, we simply take its buffer, just like
+  // std::vector does. If other is still inline, its elements live inside
+  // other itself, so we have to move them one by one into our own inline
+  // buffer.
+  SmallVector(SmallVector &&other) noexcept(std::is_nothrow_move_constructible_v<T>) : SmallVector() {
+    MoveFrom(std::move(other));
+  }
+
+  SmallVector &operator=(const SmallVector &other) {
+    if (this != &other) {
+      clear();
+      reserve(other.size_);
+      for (const T &value : other) {
+        emplace_back(value);
+      }
+    }
+    return *this;
+  }
+
+  SmallVector &operator=(SmallVector &&other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+    if (this != &other) {
+      clear();
+      ReleaseHeap();
+      MoveFrom(std::move(other));
+    }
+    return *this;
+  }
+
+  ~SmallVector() {
+    clear();
+    ReleaseHeap();
+  }
+
+  // Element access. at checks the index and throws std::out_of_range, while
+  // operator[] does not check, like std::vector.
+  T &operator[](size_t i) { return data_[i]; }
+  const T &operator[](size_t i) const { return data_[i]; }
+  T &at(size_t i) {
+    CheckIndex(i);
+    return data_[i];
+  }
+  const T &at(size_t i) const {
+    CheckIndex(i);
+    return data_[i];
+  }
+  T &front() { return data_[0]; }
+  const T &front() const { return data_[0]; }
+  T &back() { return data_[size_ - 1]; }
+  const T &back() const { return data_[size_ - 1]; }
+  T *data() { return data_; }
+  const T *data() const { return data_; }
+
+  iterator begin() { return data_; }
+  iterator end() { return data_ + size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+  // Returns whether the elements are still stored in the inline buffer.
+  bool is_inline() const { return data_ == InlineData(); }
+
+  // Makes sure there is room for new_capacity elements. Like std::vector,
+  // reserve never shrinks the capacity.
+  void reserve(size_t new_capacity) {
+    if (new_capacity > capacity_) {
+      Reallocate(new_capacity);
+    }
+  }
+
+  void push_back(const T &value) { emplace_back(value); }
+  void push_back(T &&value) { emplace_back(std::move(value)); }
+
+  template <typename... Args>
+  T &emplace_back(Args &&...args) {
+    if (size_ == capacity_) {
+      // We construct the new element in the new buffer before moving the old
+      // elements over. The arguments may refer to an element of this vector
+      // (for example v.push_back(v[0])), and that element must still be
+      // alive while we copy from it.
+      size_t new_capacity = capacity_ * 2;
+      T *new_data = Allocate(new_capacity);
+      new (new_data + size_) T(std::forward<Args>(args)...);
+      MoveElements(new_data);
+      ReleaseHeap();
+      data_ = new_data;
+      capacity_ = new_capacity;
+    } else {
+      new (data_ + size_) T(std::forward<Args>(args)...);
+    }
+    return data_[size_++];
+  }
+
+  void pop_back() { data_[--size_].~T(); }
+
+  // Inserts value before pos and returns an iterator to the new element.
+  iterator insert(const_iterator pos, T value) {
+    size_t index = pos - data_;
+    emplace_back(std::move(value));
+    std::rotate(data_ + index, data_ + size_ - 1, data_ + size_);
+    return data_ + index;
+  }
+
+  // Removes the elements in [first, last) and returns an iterator to the
+  // element after the removed ones.
+  iterator erase(const_iterator first, const_iterator last) {
+    T *dest = data_ + (first - data_);
+    T *src = data_ + (last - data_);
+    T *new_end = std::move(src, end(), dest);
+    while (end() != new_end) {
+      pop_back();
+    }
+    return dest;
+  }
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+  void resize(size_t new_size, const T &value = T()) {
+    while (size_ > new_size) {
+      pop_back();
+    }
+    if (size_ < new_size) {
+      // Like emplace_back, value may refer to an element of this vector
+      // (v.resize(n, v[0])), which reserve would move. So we copy it before
+      // reserving, as libstdc++ does.
+      T copy(value);
+      reserve(new_size);
+      while (size_ < new_size) {
+        emplace_back(copy);
+      }
+    }
+  }
+
+  // Destroys all elements. Like std::vector, the capacity stays the same, so
+  // a vector that has spilled to the heap keeps its heap buffer.
+  void clear() {
+    while (size_ > 0) {
+      pop_back();
+    }
+  }
+
+ private:
+  T *InlineData() { return reinterpret_cast<T *>(inline_); }
+  const T *InlineData() const { return reinterpret_cast<const T *>(inline_); }
+
+  static T *Allocate(size_t capacity) { return static_cast<T *>(::operator new(capacity * sizeof(T))); }
+
+  void CheckIndex(size_t i) const {
+    if (i >= size_) {
+      throw std::out_of_range("SmallVector index " + std::to_string(i) + " is out of range");
+    }
+  }
+
+  // Moves every element into new_data and destroys the originals. The size
+  // does not change.
+  void MoveElements(T *new_data) {
+    for (size_t i = 0; i < size_; ++i) {
+      new (new_data + i) T(std::move(data_[i]));
+      data_[i].~T();
+    }
+  }
+
+  void Reallocate(size_t new_capacity) {
+    T *new_data = Allocate(new_capacity);
+    MoveElements(new_data);
+    ReleaseHeap();
+    data_ = new_data;
+    capacity_ = new_capacity;
+  }
+
+  // Frees the heap buffer, if there is one, and goes back to the inline
+  // buffer. The elements must already have been destroyed or moved out.
+  void ReleaseHeap() {
+    if (!is_inline()) {
+      ::operator delete(data_);
+      data_ = InlineData();
+      capacity_ = N;
+    }
+  }
+
+  // Takes the elements of other. This vector must be empty and inline
+  // beforehand. Afterwards, other is empty.
+  void MoveFrom(SmallVector &&other) {
+    if (other.is_inline()) {
+      for (size_t i = 0; i < other.size_; ++i) {
+        new (data_ + i) T(std::move(other.data_[i]));
+      }
+      size_ = other.size_;
+      other.clear();
+    } else {
+      data_ = other.data_;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.data_ = other.InlineData();
+      other.size_ = 0;
+      other.capacity_ = N;
+    }
+  }
+
+  // The inline buffer is raw memory with the size and alignment of N
+  // elements. Using an array of T instead would construct N elements up
+  // front, which is wasteful and requires T to be default constructible.
+  alignas(T) unsigned char inline_[N * sizeof(T)];
+  T *data_;
+  size_t size_;
+  size_t capacity_;
+};
+
+// A Person like the one in move_constructors.cpp, with the list of nicknames
+// stored in a container of our choice.
+template <typename NicknameList>
+struct Person {
+  uint32_t age_;
+  NicknameList nicknames_;
+};
+
+// Creates count people with one to three nicknames each, and returns the
+// number of nicknames as a checksum. Short nicknames fit in std::string's own
+// inline buffer (the "small string optimization"), so the only allocations
+// left are the ones made by the containers.
+template <typename NicknameList>
+size_t BuildPeople(size_t count) {
+  std::vector<Person<NicknameList>> people;
+  people.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    Person<NicknameList> person;
+    person.age_ = static_cast<uint32_t>(i % 100);
+    person.nicknames_.push_back("ted");
+    if (i % 2 == 0) {
+      person.nicknames_.push_back("theo");
+    }
+    if (i % 3 == 0) {
+      person.nicknames_.push_back("teddy");
+    }
+    people.push_back(std::move(person));
+  }
+  size_t total = 0;
+  for (const Person<NicknameList> &person : people) {
+    total += person.nicknames_.size();
+  }
+  return total;
+}
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many milliseconds it took.
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // SmallVector is used just like std::vector.
+  SmallVector<int, 4> int_vector = {0, 1, 2, 3};
+  std::cout << "int_vector holds " << int_vector.size() << " elements, inline: " << int_vector.is_inline() << "\n";
+  int_vector.push_back(4);
+  int_vector.emplace_back(5);
+  std::cout << "After two more elements, inline: " << int_vector.is_inline()
+            << ", capacity: " << int_vector.capacity() << "\n";
+  int_vector.erase(int_vector.begin() + 2, int_vector.begin() + 4);
+  int_vector.insert(int_vector.begin(), -1);
+  std::cout << "Printing the elements of int_vector after erase and insert:\n";
+  for (int value : int_vector) {
+    std::cout << value << " ";
+  }
+  std::cout << "\n";
+  try {
+    int_vector.at(100);
+  } catch (const std::out_of_range &e) {
+    std::cout << "Caught: " << e.what() << "\n";
+  }
+
+  // Moving an inline SmallVector moves its elements one by one, while moving
+  // a spilled one just takes the heap buffer, like std::vector.
+  SmallVector<std::string, 2> names = {"alice", "bob"};
+  SmallVector<std::string, 2> moved_names = std::move(names);
+  std::cout << "moved_names[1] is " << moved_names[1] << ", names now holds " << names.size() << " elements\n";
+  // Growing from one of the vector's own elements is safe, even when that
+  // moves the elements from the inline buffer to the heap.
+  moved_names.resize(5, moved_names[0]);
+  std::cout << "After resize(5, moved_names[0]), moved_names[4] is " << moved_names[4] << "\n";
+
+  // Now the benchmark. Most people have fewer than four nicknames, so a
+  // SmallVector<std::string, 4> never needs a heap allocation. The number of
+  // people can be passed as the first argument.
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  size_t vector_total = 0;
+  size_t small_total = 0;
+  size_t before = allocation_count;
+  long long vector_ms = TimeMs([&] { vector_total = BuildPeople<std::vector<std::string>>(n); });
+  size_t vector_allocations = allocation_count - before;
+  before = allocation_count;
+  long long small_ms = TimeMs([&] { small_total = BuildPeople<SmallVector<std::string, 4>>(n); });
+  size_t small_allocations = allocation_count - before;
+  std::cout << "Building " << n << " people (" << vector_total << " and " << small_total << " nicknames):\n";
+  std::cout << "std::vector:    " << vector_allocations << " allocations, " << vector_ms << " ms\n";
+  std::cout << "SmallVector<4>: " << small_allocations << " allocations, " << small_ms << " ms\n";
+
+  return 0;
+}
@@ -0,0 +1,391 @@
+/**
+ * @file snapshot.cpp
+ * @brief Tutorial code for an RCU-style snapshot holder, which lets many
+ * threads read the current version of an object without touching a shared
+ * reference count, while writers replace it.
+ */
+
+// shared_ptr.cpp shows how several std::shared_ptrs can own the same object.
+// That makes std::shared_ptr the natural way to publish read-mostly data,
+// like a configuration or a routing table, to many threads: a writer builds
+// a new version and swaps it in, and each reader keeps the version it got
+// alive for as long as it uses it. But each reader's copy of the
+// std::shared_ptr increments and later decrements the same reference count,
+// and those atomic writes to one cache line are what limits how many reads
+// per second many cores can do. On top of that, the swap itself needs a lock
+// or std::atomic_load/std::atomic_store, which libstdc++ implements with a
+// (hashed) mutex.
+
+// Read-copy-update (RCU), as used all over the Linux kernel, avoids both
+// costs. Readers access the current version through a plain pointer,
+// inside a read-side critical section. A writer publishes a new version by
+// swapping the pointer, and then waits for a "grace period": until every
+// reader that was inside a critical section when the pointer was swapped has
+// left it. After that, no reader can still be using the old version, and it
+// can be freed.
+
+// For a reader to enter and leave a critical section, it writes the current
+// grace period number to its own slot, which is on its own cache line, and
+// later clears it. That is three memory accesses and no loops, so reads are
+// wait-free, and readers on different cores never write to the same cache
+// line. Writers do all the waiting, which is the right trade-off for data
+// that is read millions of times per second and replaced a few times per
+// hour.
+
+// Versions are still held by std::shared_ptr, so a reader that needs a
+// version for longer than a critical section (for example, to hand it to
+// another thread) can take a std::shared_ptr to it, paying for one
+// reference count increment.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes fixed-width integer types like uint64_t.
+#include <cstdint>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::shared_ptr functionality.
+#include <memory>
+// Includes the mutex library header.
+#include <mutex>
+// Includes the shared mutex library header.
+#include <shared_mutex>
+// Includes std::logic_error and std::runtime_error.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the utility header for std::move.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// The most threads that can read Snapshots at the same time.
+constexpr size_t kMaxReaders = 128;
+
+// The ReaderSlots class gives each thread a slot number below kMaxReaders,
+// which it uses in every Snapshot. A thread claims a slot the first time it
+// reads a Snapshot, and frees it when it exits.
+class ReaderSlots {
+ public:
+  static size_t Mine() {
+    thread_local SlotOwner owner;
+    return owner.slot_;
+  }
+
+  // One more than the highest slot number ever handed out.
+  static size_t HighWater() { return high_water_.load(std::memory_order_acquire); }
+
+ private:
+  struct SlotOwner {
+    SlotOwner() {
+      for (slot_ = 0; slot_ < kMaxReaders; ++slot_) {
+        bool expected = false;
+        if (!taken_[slot_].load(std::memory_order_relaxed) &&
+            taken_[slot_].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+          size_t high = high_water_.load(std::memory_order_relaxed);
+          while (high < slot_ + 1 && !high_water_.compare_exchange_weak(high, slot_ + 1)) {
+          }
+          return;
+        }
+      }
+      throw std::runtime_error("more than kMaxReaders threads are reading snapshots");
+    }
+    ~SlotOwner() { taken_[slot_].store(false, std::memory_order_release); }
+
+    size_t slot_;
+  };
+
+  static inline std::atomic<bool> taken_[kMaxReaders] = {};
+  static inline std::atomic<size_t> high_water_{0};
+};
+
+// The Snapshot class holds the current version of a T. Any number of
+// threads may read it at the same time as writers publish new versions.
+// Writers are serialized with each other.
+template <typename T>
+class Snapshot {
+ public:
+  explicit Snapshot(std::shared_ptr<const T> initial) : current_(new Version{std::move(initial)}) {}
+
+  // No thread may be reading the snapshot anymore at this point.
+  ~Snapshot() { delete current_.load(); }
+
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  // The ReadGuard class is a read-side critical section. The version it
+  // points to stays alive until the guard is destroyed, even if a writer
+  // publishes a new one in the meantime. Guards can be nested, but a thread
+  // must not publish while it holds one, since it would wait for itself.
+  class ReadGuard {
+   public:
+    explicit ReadGuard(const Snapshot *snapshot) : slot_(&snapshot->readers_[ReaderSlots::Mine()]) {
+      if (slot_->nesting_++ == 0) {
+        // This load is sequentially consistent like the rest, which is what
+        // WaitForReaders relies on: if we see a writer's new grace period,
+        // we see its new current_ too.
+        uint64_t period = snapshot->grace_period_.load(std::memory_order_seq_cst);
+        // The slot must be visible to writers before we load current_, or a
+        // writer could swap current_, miss our slot, and free the version we
+        // are about to load. A sequentially consistent exchange is a store
+        // with a full fence. It is a read-modify-write, but on the reader's
+        // own cache line, so it does not slow down other readers.
+        slot_->period_.exchange((period << 1) | 1, std::memory_order_seq_cst);
+      }
+      version_ = snapshot->current_.load(std::memory_order_seq_cst);
+    }
+
+    ~ReadGuard() {
+      if (--slot_->nesting_ == 0) {
+        slot_->period_.store(0, std::memory_order_release);
+      }
+    }
+
+    ReadGuard(const ReadGuard &) = delete;
+    ReadGuard &operator=(const ReadGuard &) = delete;
+
+    const T &operator*() const { return *version_->value_; }
+    const T *operator->() const { return version_->value_.get(); }
+
+    // Returns a std::shared_ptr that keeps this version alive after the
+    // guard is gone. This is the only read operation that increments a
+    // reference count.
+    std::shared_ptr<const T> Share() const { return version_->value_; }
+
+   private:
+    typename Snapshot::ReaderSlot *slot_;
+    const typename Snapshot::Version *version_;
+  };
+
+  ReadGuard Read() const { return ReadGuard(this); }
+
+  // Makes value the current version, then waits for a grace period and drops
+  // the snapshot's reference to the old version. The old version is freed
+  // then, unless a reader still holds a std::shared_ptr to it from Share.
+  void Publish(std::shared_ptr<const T> value) {
+    std::scoped_lock lk(writer_latch_);
+    PublishLocked(std::move(value));
+  }
+
+  // Publishes update(current version), as one atomic step with respect to
+  // other writers. update gets the current version by const reference and
+  // returns the new version, typically a modified copy.
+  template <typename Fn>
+  void Update(Fn update) {
+    std::scoped_lock lk(writer_latch_);
+    PublishLocked(std::make_shared<const T>(update(static_cast<const T &>(*current_.load()->value_))));
+  }
+
+ private:
+  // A version is a heap object holding the std::shared_ptr, so that readers
+  // can get at the std::shared_ptr through one atomic pointer.
+  struct Version {
+    std::shared_ptr<const T> value_;
+  };
+
+  // Each reader's slot is on its own cache line. period_ holds the grace
+  // period number the reader entered in, shifted left by one, with the
+  // lowest bit set; it is 0 while the reader is outside critical sections.
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> period_{0};
+    int nesting_ = 0;
+  };
+
+  void PublishLocked(std::shared_ptr<const T> value) {
+    if (readers_[ReaderSlots::Mine()].nesting_ > 0) {
+      throw std::logic_error("a thread cannot publish while it holds a ReadGuard");
+    }
+    Version *old = current_.exchange(new Version{std::move(value)}, std::memory_order_seq_cst);
+    WaitForReaders();
+    delete old;
+  }
+
+  // Starts a new grace period and waits for every reader that entered its
+  // critical section before it began. A reader that entered before may have
+  // loaded the old version. A reader that enters after loads the grace
+  // period number after our exchange above, and since all of these
+  // operations are sequentially consistent, its load of current_ comes after
+  // the exchange too, so it can only see the new version.
+  void WaitForReaders() {
+    uint64_t period = grace_period_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    for (size_t i = 0; i < ReaderSlots::HighWater(); ++i) {
+      for (int attempt = 1;; ++attempt) {
+        uint64_t state = readers_[i].period_.load(std::memory_order_seq_cst);
+        if ((state & 1) == 0 || (state >> 1) >= period) {
+          break;
+        }
+        // Readers' critical sections are short, but the reader may not be
+        // running. Sleeping is fine: writers are rare.
+        if (attempt < 64) {
+          std::this_thread::yield();
+        } else {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+      }
+    }
+  }
+
+  alignas(64) std::atomic<Version *> current_;
+  std::atomic<uint64_t> grace_period_{0};
+  std::mutex writer_latch_;
+  mutable ReaderSlot readers_[kMaxReaders];
+};
+
+// Basic point class, as in shared_ptr.cpp.
+class Point {
+ public:
+  Point() : x_(0), y_(0) {}
+  Point(int x, int y) : x_(x), y_(y) {}
+  inline int GetX() const { return x_; }
+  inline int GetY() const { return y_; }
+  inline void SetX(int x) { x_ = x; }
+  inline void SetY(int y) { y_ = y; }
+
+ private:
+  int x_;
+  int y_;
+};
+
+// A routing table maps each destination to a next hop. Every version of the
+// table the benchmark publishes has next_hop[d] == d + version for all d, so
+// readers can tell if they ever see a half-updated table.
+struct RoutingTable {
+  RoutingTable(size_t size, int version) : version_(version), next_hop_(size) {
+    for (size_t d = 0; d < size; ++d) {
+      next_hop_[d] = static_cast<int>(d) + version;
+    }
+  }
+  int version_;
+  std::vector<int> next_hop_;
+};
+
+// Runs num_readers threads that each look up reads_per_thread routes with
+// lookup(destination), which returns false if it saw an inconsistent table,
+// while one writer publishes versions new tables with publish(version). It
+// returns how many milliseconds it took, and sets *torn if any lookup failed.
+template <typename Lookup, typename Publish>
+long long RunLookups(size_t num_readers, size_t reads_per_thread, int versions, size_t table_size, Lookup lookup,
+                     Publish publish, bool *torn) {
+  std::atomic<bool> any_torn{false};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_readers; ++i) {
+    threads.emplace_back([&, i] {
+      for (size_t j = 0; j < reads_per_thread; ++j) {
+        if (!lookup((i * 7919 + j) % table_size)) {
+          any_torn = true;
+        }
+      }
+    });
+  }
+  std::thread writer([&] {
+    for (int version = 1; version <= versions; ++version) {
+      publish(version);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  // Only the readers are timed; the writer mostly sleeps.
+  long long ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  writer.join();
+  *torn = any_torn;
+  return ms;
+}
+
+int main(int argc, char *argv[]) {
+  // A Snapshot<Point> starts out with (2, 3). Readers print the version they
+  // see, while a writer publishes a modified copy, like modify_ptr_via_ref
+  // in shared_ptr.cpp does in place.
+  Snapshot<Point> point(std::make_shared<const Point>(2, 3));
+  auto read_point = [&] {
+    auto p = point.Read();
+    std::cout << "Reading point (" + std::to_string(p->GetX()) + ", " + std::to_string(p->GetY()) + ")\n"
+              << std::flush;
+  };
+  auto write_point = [&] {
+    point.Update([](const Point &old) {
+      Point updated = old;
+      updated.SetX(15);
+      updated.SetY(645);
+      return updated;
+    });
+  };
+  std::thread t1(read_point);
+  std::thread t2(write_point);
+  std::thread t3(read_point);
+  t1.join();
+  t2.join();
+  t3.join();
+
+  // Share keeps a version alive after it has been replaced.
+  std::shared_ptr<const Point> kept = point.Read().Share();
+  point.Publish(std::make_shared<const Point>(0, 0));
+  std::cout << "Kept version is still (" << kept->GetX() << ", " << kept->GetY() << "), use count "
+            << kept.use_count() << "\n";
+
+  // Now the benchmark. Each reader does the number of lookups passed as the
+  // first argument, while a writer publishes new tables.
+  size_t reads = argc > 1 ? std::stoul(argv[1]) : 200000;
+  const size_t table_size = 1024;
+  const int versions = 20;
+  std::cout << "Each reader looks up " << reads << " routes while " << versions
+            << " tables are published (times in ms):\n";
+  std::cout << "readers  shared_mutex  atomic shared_ptr  Snapshot\n";
+  for (size_t num_readers = 1; num_readers <= 64; num_readers *= 2) {
+    auto consistent = [](const RoutingTable &table, size_t d) {
+      return table.next_hop_[d] == static_cast<int>(d) + table.version_;
+    };
+
+    // A std::shared_ptr guarded by a std::shared_mutex; readers copy it.
+    std::shared_ptr<const RoutingTable> locked_table = std::make_shared<const RoutingTable>(table_size, 0);
+    std::shared_mutex m;
+    bool locked_torn = false;
+    long long locked_ms = RunLookups(
+        num_readers, reads, versions, table_size,
+        [&](size_t d) {
+          std::shared_ptr<const RoutingTable> table;
+          {
+            std::shared_lock lk(m);
+            table = locked_table;
+          }
+          return consistent(*table, d);
+        },
+        [&](int version) {
+          auto table = std::make_shared<const RoutingTable>(table_size, version);
+          std::unique_lock lk(m);
+          locked_table = std::move(table);
+        },
+        &locked_torn);
+
+    // A std::shared_ptr read and written with std::atomic_load and
+    // std::atomic_store.
+    std::shared_ptr<const RoutingTable> atomic_table = std::make_shared<const RoutingTable>(table_size, 0);
+    bool atomic_torn = false;
+    long long atomic_ms = RunLookups(
+        num_readers, reads, versions, table_size,
+        [&](size_t d) { return consistent(*std::atomic_load(&atomic_table), d); },
+        [&](int version) { std::atomic_store(&atomic_table, std::make_shared<const RoutingTable>(table_size, version)); },
+        &atomic_torn);
+
+    Snapshot<RoutingTable> snapshot_table(std::make_shared<const RoutingTable>(table_size, 0));
+    bool snapshot_torn = false;
+    long long snapshot_ms = RunLookups(
+        num_readers, reads, versions, table_size, [&](size_t d) { return consistent(*snapshot_table.Read(), d); },
+        [&](int version) { snapshot_table.Publish(std::make_shared<const RoutingTable>(table_size, version)); },
+        &snapshot_torn);
+
+    if (locked_torn || atomic_torn || snapshot_torn) {
+      std::cout << "A reader saw an inconsistent table!\n";
+      return 1;
+    }
+    std::cout << num_readers << "\t " << locked_ms << "\t\t" << atomic_ms << "\t\t   " << snapshot_ms << "\n";
+  }
+
+  return 0;
+}
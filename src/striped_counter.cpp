@@ -0,0 +1,180 @@
+/**
+ * @file striped_counter.cpp
+ * @brief Tutorial code for a counter that many threads can increment without
+ * fighting over a single lock or cache line.
+ */
+
+// In mutex.cpp, scoped_lock.cpp and condition_variable.cpp, every thread
+// increments one global int count while holding one std::mutex. That is
+// correct, but it does not scale: only one thread can increment at a time,
+// and the cache line that holds the mutex and the count has to travel from
+// core to core on every increment. Replacing the mutex with a single
+// std::atomic<int> removes the lock, but not the travelling cache line, so
+// it still gets slower as more threads share it.
+
+// A striped (or sharded) counter gives each thread its own slot to increment.
+// Each slot sits on its own 64-byte cache line, so threads on different cores
+// never write to the same cache line. A read adds up all of the slots.
+// Increments become fast and scalable, and reads become slower, which is the
+// right trade-off for counters that are bumped constantly and read rarely,
+// such as metrics.
+
+// This design follows the Linux kernel's percpu_counter. When a slot has
+// grown by more than a batch size since it was last flushed, the thread adds
+// the difference to a shared global total. That gives us two kinds of reads:
+// - ReadApproximate only loads the global total. It is a single load, but it
+//   can be off by up to (batch - 1) for every slot.
+// - ReadExact adds up every slot, so it counts every increment that finished
+//   before the read started.
+// percpu_counter moves each slot's delta into the total under a spinlock,
+// and its exact read takes that lock, because a delta that is on its way
+// from a slot to the total is in neither place for a moment. Here, a slot
+// keeps its full count instead of a delta, and only remembers how much of it
+// has been flushed. The exact read never looks at the global total, so a
+// flush can never be half-done from its point of view, and neither Add nor
+// ReadExact ever waits.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header, for the benchmark.
+#include <mutex>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the vector container library header.
+#include <vector>
+
+// The StripedCounter class is a 64-bit counter that supports concurrent Add
+// calls from any number of threads without locking. Threads are spread over
+// num_slots slots; if there are more threads than slots, some threads share
+// a slot, which is still correct, just slower.
+class StripedCounter {
+ public:
+  explicit StripedCounter(size_t num_slots = 64, long long batch = 1024) : slots_(num_slots), batch_(batch) {}
+
+  // Adds delta to the counter. This is lock-free: it is one atomic add on the
+  // calling thread's own cache line, plus, about once every batch
+  // increments, a flush of the slot into the global total.
+  void Add(long long delta = 1) {
+    Slot &slot = slots_[ThreadId() % slots_.size()];
+    long long count = slot.count_.fetch_add(delta, std::memory_order_relaxed) + delta;
+    long long flushed = slot.flushed_.load(std::memory_order_relaxed);
+    if (count - flushed >= batch_ || count - flushed <= -batch_) {
+      Flush(&slot, flushed, count);
+    }
+  }
+
+  // Returns the global total without looking at the slots. The result lags
+  // the true value by at most num_slots * (batch - 1) in either direction.
+  long long ReadApproximate() const { return global_.load(std::memory_order_relaxed); }
+
+  // Returns the sum of every slot's count. Flushes only change how much of a
+  // slot counts as flushed, never the slot's count, so they cannot make this
+  // count anything twice or not at all.
+  long long ReadExact() const {
+    long long total = 0;
+    for (const Slot &slot : slots_) {
+      total += slot.count_.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+ private:
+  // Each slot takes a whole cache line, so that two threads incrementing
+  // neighboring slots do not slow each other down (false sharing).
+  // count_ is everything ever added to the slot, and flushed_ is how much of
+  // that the global total already includes.
+  struct alignas(64) Slot {
+    std::atomic<long long> count_{0};
+    std::atomic<long long> flushed_{0};
+  };
+
+  // Returns a small number that identifies the calling thread. Each thread
+  // gets the next number the first time it calls this function.
+  static size_t ThreadId() {
+    static std::atomic<size_t> next_id{0};
+    thread_local size_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  // Adds count - flushed to the global total, and marks count as flushed.
+  // Threads that share a slot may try to flush it at the same time; the
+  // compare-exchange lets exactly one of them add the difference, so the
+  // global total always equals the sum of the slots' flushed_ values. A
+  // thread that loses has nothing left to do: its increment was part of the
+  // winner's count, or will be part of a later flush.
+  void Flush(Slot *slot, long long flushed, long long count) {
+    if (slot->flushed_.compare_exchange_strong(flushed, count, std::memory_order_relaxed)) {
+      global_.fetch_add(count - flushed, std::memory_order_relaxed);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  const long long batch_;
+  // The global total also sits on its own cache line, away from slots_.
+  alignas(64) std::atomic<long long> global_{0};
+};
+
+// Increments a shared counter num_threads * increments times, split evenly
+// across num_threads threads, and returns how many milliseconds it took.
+template <typename Increment>
+long long RunThreads(size_t num_threads, size_t increments, Increment increment) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&] {
+      for (size_t j = 0; j < increments; ++j) {
+        increment();
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from mutex.cpp with a StripedCounter instead of a
+  // mutex-protected int.
+  StripedCounter count;
+  std::thread t1([&] { count.Add(); });
+  std::thread t2([&] { count.Add(); });
+  t1.join();
+  t2.join();
+  std::cout << "Printing count: " << count.ReadExact() << " (the approximate read says " << count.ReadApproximate()
+            << ", since neither thread has flushed yet)" << std::endl;
+
+  // Now the benchmark. Each thread does the same number of increments, which
+  // can be passed as the first argument.
+  size_t increments = argc > 1 ? std::stoul(argv[1]) : 200000;
+  std::cout << "Each thread increments " << increments << " times (times in ms):\n";
+  std::cout << "threads  mutex  atomic  striped\n";
+  for (size_t num_threads = 1; num_threads <= 64; num_threads *= 2) {
+    int mutex_count = 0;
+    std::mutex m;
+    long long mutex_ms = RunThreads(num_threads, increments, [&] {
+      std::scoped_lock lock(m);
+      mutex_count += 1;
+    });
+    std::atomic<long long> atomic_count{0};
+    long long atomic_ms =
+        RunThreads(num_threads, increments, [&] { atomic_count.fetch_add(1, std::memory_order_relaxed); });
+    StripedCounter striped_count;
+    long long striped_ms = RunThreads(num_threads, increments, [&] { striped_count.Add(); });
+
+    long long expected = static_cast<long long>(num_threads * increments);
+    if (mutex_count != expected || atomic_count.load() != expected || striped_count.ReadExact() != expected) {
+      std::cout << "Count mismatch with " << num_threads << " threads!\n";
+      return 1;
+    }
+    std::cout << num_threads << "\t " << mutex_ms << "\t" << atomic_ms << "\t" << striped_ms << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,404 @@
+/**
+ * @file thread_local_pool.cpp
+ * @brief Tutorial code for a thread-local object pool, which recycles small
+ * objects through per-thread free lists and a global pool of batches.
+ */
+
+// The IntPtrManager class in wrapper_class.cpp allocates an int with new in
+// every constructor and frees it with delete in its destructor. That is the
+// right way to write a wrapper class, but a program that creates and destroys
+// many of them spends much of its time in malloc and free. pool_pointer.cpp
+// shows an ObjectPool that recycles objects, but only within one thread: an
+// object has to be freed by the thread that allocated it, which is often not
+// how programs work (think of a producer thread that creates requests, and a
+// consumer thread that destroys them).
+
+// ThreadLocalPool<T> works from any thread, using the design of the "magazine"
+// layer from Bonwick and Adams' "Magazines and Vmem" (2001), which is also
+// how tcmalloc and jemalloc's thread caches work:
+// - Each thread has its own free list of objects. Allocating and freeing
+//   objects only touches that list, so there is no locking and no sharing
+//   between threads on the fast path.
+// - When a thread's free list is empty, it takes a whole batch of kBatchSize
+//   free objects from a global pool, which is protected by a mutex. When its
+//   free list gets too long (because the thread frees more objects than it
+//   allocates, like the consumer above), it gives a batch back. So the mutex
+//   is taken at most once per kBatchSize operations.
+// - When the global pool is empty too, the thread allocates a new slab of
+//   kBatchSize objects with one call to new.
+// Memory is never given back to the system while the program runs, which is
+// what makes it safe for any thread to free any object: all slabs live as
+// long as the global pool.
+
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes the mutex library header.
+#include <mutex>
+// Includes placement new.
+#include <new>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes the utility header for std::move, std::forward and std::swap.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+// The ThreadLocalPool class allocates objects of type T. All its members are
+// static: there is one global pool per type, and one free list per type per
+// thread.
+template <typename T, size_t kBatchSize = 256>
+class ThreadLocalPool {
+ public:
+  // Constructs a T in a free block.
+  template <typename... Args>
+  static T *New(Args &&...args) {
+    Block *block = Local().Pop();
+    try {
+      return new (block->storage_) T(std::forward<Args>(args)...);
+    } catch (...) {
+      Local().Push(block);
+      throw;
+    }
+  }
+
+  // Destroys an object from New. Any thread may do this.
+  static void Delete(T *object) {
+    object->~T();
+    Local().Push(reinterpret_cast<Block *>(object));
+  }
+
+  // Counters that show how often the slow paths are taken.
+  struct Stats {
+    size_t slabs_;
+    size_t batches_taken_;
+    size_t batches_returned_;
+  };
+
+  static Stats GetStats() {
+    Global &global = GetGlobal();
+    std::scoped_lock lk(global.latch_);
+    return Stats{global.slabs_.size(), global.batches_taken_, global.batches_returned_};
+  }
+
+ private:
+  // A block holds either an object or, while it is free, the next free block.
+  union Block {
+    Block *next_;
+    alignas(T) unsigned char storage_[sizeof(T)];
+  };
+
+  // A batch is a chain of kBatchSize free blocks, linked through next_, so
+  // moving it between a thread and the global pool is just moving one
+  // pointer.
+  struct Global {
+    ~Global() {
+      for (Block *slab : slabs_) {
+        delete[] slab;
+      }
+    }
+
+    std::mutex latch_;
+    std::vector<Block *> batches_;
+    std::vector<Block *> slabs_;
+    size_t batches_taken_ = 0;
+    size_t batches_returned_ = 0;
+  };
+
+  // A thread's free list. It keeps at most 2 * kBatchSize blocks: when it
+  // would get more, it returns kBatchSize of them, so that it still has
+  // kBatchSize left for the next allocations. Returning all of them would
+  // make a thread that alternates between allocating and freeing at the
+  // boundary take and return a batch every time.
+  class LocalCache {
+   public:
+    // A thread returns all its free blocks when it exits.
+    ~LocalCache() {
+      while (count_ >= kBatchSize) {
+        ReturnBatch();
+      }
+      if (count_ > 0) {
+        // The rest become a short batch of their own. Batches are only ever
+        // used one block at a time, so their lengths do not have to be
+        // exact, but no batch is ever longer than kBatchSize.
+        Global &global = GetGlobal();
+        std::scoped_lock lk(global.latch_);
+        global.batches_.push_back(head_);
+        ++global.batches_returned_;
+      }
+    }
+
+    Block *Pop() {
+      if (head_ == nullptr) {
+        Refill();
+      }
+      Block *block = head_;
+      head_ = block->next_;
+      --count_;
+      return block;
+    }
+
+    void Push(Block *block) {
+      block->next_ = head_;
+      head_ = block;
+      if (++count_ >= 2 * kBatchSize) {
+        ReturnBatch();
+      }
+    }
+
+   private:
+    // Takes a batch from the global pool, or allocates a new slab. A batch
+    // returned by an exiting thread may be shorter than kBatchSize, so we
+    // count its blocks.
+    void Refill() {
+      Global &global = GetGlobal();
+      {
+        std::scoped_lock lk(global.latch_);
+        if (!global.batches_.empty()) {
+          head_ = global.batches_.back();
+          global.batches_.pop_back();
+          ++global.batches_taken_;
+        }
+      }
+      if (head_ != nullptr) {
+        count_ = 0;
+        for (Block *block = head_; block != nullptr; block = block->next_) {
+          ++count_;
+        }
+        return;
+      }
+      Block *slab = new Block[kBatchSize];
+      {
+        std::scoped_lock lk(global.latch_);
+        global.slabs_.push_back(slab);
+      }
+      for (size_t i = 0; i < kBatchSize; ++i) {
+        slab[i].next_ = i + 1 < kBatchSize ? &slab[i + 1] : nullptr;
+      }
+      head_ = slab;
+      count_ = kBatchSize;
+    }
+
+    // Unlinks the first kBatchSize blocks and gives them to the global pool.
+    void ReturnBatch() {
+      Block *batch = head_;
+      Block *last = head_;
+      for (size_t i = 1; i < kBatchSize; ++i) {
+        last = last->next_;
+      }
+      head_ = last->next_;
+      last->next_ = nullptr;
+      count_ -= kBatchSize;
+      Global &global = GetGlobal();
+      std::scoped_lock lk(global.latch_);
+      global.batches_.push_back(batch);
+      ++global.batches_returned_;
+    }
+
+    Block *head_ = nullptr;
+    size_t count_ = 0;
+  };
+
+  static Global &GetGlobal() {
+    static Global global;
+    return global;
+  }
+
+  // GetGlobal is called first, so that the global pool is constructed before
+  // (and therefore destroyed after) this thread's cache.
+  static LocalCache &Local() {
+    GetGlobal();
+    thread_local LocalCache cache;
+    return cache;
+  }
+};
+
+// The IntPtrManager class from wrapper_class.cpp, with its int coming from
+// ThreadLocalPool<int> instead of new and delete. Everything else is the
+// same.
+class PooledIntManager {
+ public:
+  PooledIntManager() : ptr_(ThreadLocalPool<int>::New(0)) {}
+  PooledIntManager(int val) : ptr_(ThreadLocalPool<int>::New(val)) {}
+  ~PooledIntManager() {
+    if (ptr_) {
+      ThreadLocalPool<int>::Delete(ptr_);
+    }
+  }
+
+  PooledIntManager(PooledIntManager &&other) : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+  PooledIntManager &operator=(PooledIntManager &&other) {
+    if (ptr_ == other.ptr_) {
+      return *this;
+    }
+    if (ptr_) {
+      ThreadLocalPool<int>::Delete(ptr_);
+    }
+    ptr_ = other.ptr_;
+    other.ptr_ = nullptr;
+    return *this;
+  }
+
+  PooledIntManager(const PooledIntManager &) = delete;
+  PooledIntManager &operator=(const PooledIntManager &) = delete;
+
+  void SetVal(int val) { *ptr_ = val; }
+  int GetVal() const { return *ptr_; }
+
+ private:
+  int *ptr_;
+};
+
+// The original IntPtrManager, for comparison.
+class IntPtrManager {
+ public:
+  IntPtrManager() : ptr_(new int(0)) {}
+  IntPtrManager(int val) : ptr_(new int(val)) {}
+  ~IntPtrManager() { delete ptr_; }
+
+  IntPtrManager(IntPtrManager &&other) : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+  IntPtrManager &operator=(IntPtrManager &&other) {
+    std::swap(ptr_, other.ptr_);
+    return *this;
+  }
+
+  IntPtrManager(const IntPtrManager &) = delete;
+  IntPtrManager &operator=(const IntPtrManager &) = delete;
+
+  void SetVal(int val) { *ptr_ = val; }
+  int GetVal() const { return *ptr_; }
+
+ private:
+  int *ptr_;
+};
+
+template <typename Fn>
+long long TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Has num_threads threads each keep a window of managers and replace one at
+// each of steps steps. It returns the sum of the replaced values across all
+// threads, so that the compiler cannot skip the work.
+template <typename Manager>
+long long Churn(size_t num_threads, size_t steps, size_t window) {
+  std::atomic<long long> total{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] {
+      std::vector<Manager> live;
+      for (size_t i = 0; i < window; ++i) {
+        live.emplace_back(static_cast<int>(i));
+      }
+      long long sum = 0;
+      size_t index = 0;
+      for (size_t i = 0; i < steps; ++i) {
+        index = (index * 1103515245 + 12345) % window;
+        sum += live[index].GetVal();
+        live[index] = Manager(static_cast<int>(i));
+      }
+      total += sum;
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return total;
+}
+
+// A producer thread creates managers and hands them to a consumer thread in
+// chunks, and the consumer destroys them. Every object is freed by a
+// different thread than the one that created it.
+template <typename Manager>
+long long ProducerConsumer(size_t count) {
+  const size_t chunk_size = 1024;
+  std::mutex m;
+  std::vector<std::vector<Manager>> chunks;
+  std::atomic<bool> done{false};
+  long long sum = 0;
+  std::thread consumer([&] {
+    while (true) {
+      std::vector<std::vector<Manager>> taken;
+      {
+        std::scoped_lock lk(m);
+        std::swap(taken, chunks);
+      }
+      for (std::vector<Manager> &chunk : taken) {
+        for (Manager &manager : chunk) {
+          sum += manager.GetVal();
+        }
+      }
+      if (taken.empty()) {
+        if (done) {
+          std::scoped_lock lk(m);
+          if (chunks.empty()) {
+            return;
+          }
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+  });
+  std::vector<Manager> chunk;
+  for (size_t i = 0; i < count; ++i) {
+    chunk.emplace_back(static_cast<int>(i));
+    if (chunk.size() == chunk_size || i + 1 == count) {
+      std::scoped_lock lk(m);
+      chunks.push_back(std::move(chunk));
+      chunk.clear();
+    }
+  }
+  done = true;
+  consumer.join();
+  return sum;
+}
+
+int main(int argc, char *argv[]) {
+  // We repeat the example from wrapper_class.cpp with a PooledIntManager.
+  PooledIntManager a(445);
+  std::cout << "1. Value of a is " << a.GetVal() << std::endl;
+  a.SetVal(645);
+  std::cout << "2. Value of a is " << a.GetVal() << std::endl;
+  PooledIntManager b(std::move(a));
+  std::cout << "Value of b is " << b.GetVal() << std::endl;
+
+  // Now the benchmarks. The number of replacements per thread can be passed
+  // as the first argument.
+  size_t steps = argc > 1 ? std::stoul(argv[1]) : 2000000;
+  const size_t window = 4096;
+  std::cout << "Each thread replaces " << steps << " objects in a window of " << window << " (times in ms):\n";
+  std::cout << "threads  IntPtrManager  PooledIntManager\n";
+  for (size_t num_threads = 1; num_threads <= 8; num_threads *= 2) {
+    long long sums[2];
+    long long new_ms = TimeMs([&] { sums[0] = Churn<IntPtrManager>(num_threads, steps, window); });
+    long long pool_ms = TimeMs([&] { sums[1] = Churn<PooledIntManager>(num_threads, steps, window); });
+    if (sums[0] != sums[1]) {
+      std::cout << "The managers disagree!\n";
+      return 1;
+    }
+    std::cout << num_threads << "\t " << new_ms << "\t\t" << pool_ms << "\n";
+  }
+
+  long long handoff_sums[2];
+  long long new_ms = TimeMs([&] { handoff_sums[0] = ProducerConsumer<IntPtrManager>(steps); });
+  long long pool_ms = TimeMs([&] { handoff_sums[1] = ProducerConsumer<PooledIntManager>(steps); });
+  if (handoff_sums[0] != handoff_sums[1]) {
+    std::cout << "The managers disagree!\n";
+    return 1;
+  }
+  ThreadLocalPool<int>::Stats stats = ThreadLocalPool<int>::GetStats();
+  std::cout << "Producer to consumer, " << steps << " objects: IntPtrManager " << new_ms << " ms, PooledIntManager "
+            << pool_ms << " ms\n";
+  std::cout << "The pool allocated " << stats.slabs_ << " slabs, and moved " << stats.batches_taken_ << " batches to "
+            << "threads and " << stats.batches_returned_ << " back\n";
+
+  return 0;
+}
@@ -0,0 +1,493 @@
+/**
+ * @file thread_pool.cpp
+ * @brief Tutorial code for a work-stealing thread pool.
+ */
+
+// The concurrency examples (mutex.cpp, rwlock.cpp, scoped_lock.cpp and
+// condition_variable.cpp) create a new std::thread for every piece of work
+// and join it afterwards. Creating and joining a thread asks the operating
+// system to set up and tear down a whole thread, stack included, which takes
+// tens of microseconds. When the work itself is shorter than that, most of
+// the time goes into managing threads.
+
+// A thread pool creates a fixed set of worker threads once, and hands them
+// small tasks to run. The simplest pool has one shared queue of tasks
+// protected by a mutex, but then every worker fights over that mutex. A
+// work-stealing pool gives every worker its own double-ended queue (deque)
+// instead:
+// - A worker pushes the tasks it creates onto the bottom of its own deque and
+//   pops them from the bottom again, newest first. This is cheap, since no
+//   other thread uses that end, and the newest task is the one whose data is
+//   most likely still in the cache.
+// - A worker with nothing to do "steals" the oldest task from the top of
+//   another worker's deque. Old tasks tend to be big (for example, half of a
+//   loop that has not been split yet), so one steal brings a lot of work.
+// The deque is the lock-free Chase-Lev deque, following the C++ version in
+// "Correct and Efficient Work-Stealing for Weak Memory Models" by Le, Pop,
+// Cohen and Zappa Nardelli (PPoPP 2013).
+
+// Includes std::max.
+#include <algorithm>
+// Includes std::atomic.
+#include <atomic>
+// Includes std::chrono for timing the benchmark in main.
+#include <chrono>
+// Includes the condition variable library header.
+#include <condition_variable>
+// Includes fixed-width integer types like int64_t.
+#include <cstdint>
+// Includes std::deque for the queue of tasks submitted from outside the pool.
+#include <deque>
+// Includes std::function, which stores the tasks.
+#include <functional>
+// Includes std::future and std::packaged_task.
+#include <future>
+// Includes std::cout (printing) for demo purposes.
+#include <iostream>
+// Includes std::unique_ptr and std::shared_ptr.
+#include <memory>
+// Includes the mutex library header.
+#include <mutex>
+// Includes std::runtime_error.
+#include <stdexcept>
+// Includes std::string and std::stoul.
+#include <string>
+// Includes the thread library header.
+#include <thread>
+// Includes std::invoke_result_t.
+#include <type_traits>
+// Includes std::move and std::forward.
+#include <utility>
+// Includes the vector container library header.
+#include <vector>
+
+#ifdef __linux__
+// Includes pthread_setaffinity_np and cpu_set_t, for pinning workers to
+// cores.
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// A task is a function to run, allocated on the heap so that the deques only
+// need to hold a pointer.
+struct Task {
+  std::function<void()> fn_;
+};
+
+// The ChaseLevDeque class is a deque of Task pointers. Only one thread, the
+// owner, may call Push and Pop. Any thread may call Steal at any time.
+class ChaseLevDeque {
+ public:
+  explicit ChaseLevDeque(int64_t capacity = 256) : array_(new Array(capacity)) {
+    arrays_.emplace_back(array_.load(std::memory_order_relaxed));
+  }
+
+  // Adds a task to the bottom. Only the owner may call this.
+  void Push(Task *task) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Array *array = array_.load(std::memory_order_relaxed);
+    if (bottom - top > array->capacity_ - 1) {
+      array = Grow(array, top, bottom);
+    }
+    array->Put(bottom, task);
+    // The release store publishes the slot, and the task it points to, to
+    // any thief that sees the new bottom_.
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  // Removes the newest task from the bottom, or returns nullptr if the deque
+  // is empty. Only the owner may call this. The owner first claims the
+  // bottom slot by moving bottom_ down, and then checks top_. If only one
+  // task was left, a thief may be taking it at the same moment, so the owner
+  // races the thieves for it with a compare-and-swap on top_.
+  Task *Pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *array = array_.load(std::memory_order_relaxed);
+    // The paper uses a relaxed store followed by a sequentially consistent
+    // fence here. A sequentially consistent exchange gives the same
+    // guarantee (and the same instruction on x86), and thread sanitizers
+    // understand it, whereas they do not model fences.
+    bottom_.exchange(bottom, std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_seq_cst);
+    if (top > bottom) {
+      // The deque was empty.
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    Task *task = array->Get(bottom);
+    if (top == bottom) {
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        // A thief got the last task.
+        task = nullptr;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // Removes the oldest task from the top, or returns nullptr if the deque is
+  // empty or another thread took the task first. Any thread may call this.
+  Task *Steal() {
+    int64_t top = top_.load(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+    if (top >= bottom) {
+      return nullptr;
+    }
+    Task *task = array_.load(std::memory_order_acquire)->Get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return task;
+  }
+
+  // Returns whether the deque looked empty at some point during the call.
+  bool Empty() const {
+    return bottom_.load(std::memory_order_acquire) <= top_.load(std::memory_order_acquire);
+  }
+
+ private:
+  // A circular array of task pointers. The capacity is a power of two, so
+  // that the slot for index i is i & (capacity_ - 1).
+  struct Array {
+    explicit Array(int64_t capacity) : capacity_(capacity), slots_(new std::atomic<Task *>[capacity]) {}
+    Task *Get(int64_t i) const { return slots_[i & (capacity_ - 1)].load(std::memory_order_relaxed); }
+    void Put(int64_t i, Task *task) { slots_[i & (capacity_ - 1)].store(task, std::memory_order_relaxed); }
+
+    int64_t capacity_;
+    std::unique_ptr<std::atomic<Task *>[]> slots_;
+  };
+
+  // Copies the tasks into an array twice as large. A thief may still be
+  // reading from the old array, so the old array is only freed when the
+  // deque is destroyed.
+  Array *Grow(Array *old_array, int64_t top, int64_t bottom) {
+    auto *array = new Array(old_array->capacity_ * 2);
+    for (int64_t i = top; i < bottom; ++i) {
+      array->Put(i, old_array->Get(i));
+    }
+    arrays_.emplace_back(array);
+    array_.store(array, std::memory_order_release);
+    return array;
+  }
+
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  std::atomic<Array *> array_;
+  // Every array this deque has used, so that they are freed in the end.
+  std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+// The ThreadPool class runs tasks on a fixed set of worker threads. Tasks
+// submitted by a worker go onto that worker's own deque; tasks submitted by
+// any other thread go onto a shared queue that workers check when their own
+// deque is empty.
+class ThreadPool {
+ public:
+  // Starts num_threads workers. If pin_threads is true, worker i is pinned to
+  // core i (modulo the number of cores), so that the operating system does
+  // not move it, and its cached data, to another core. Pinning is only
+  // supported on Linux, and is ignored elsewhere.
+  explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency(), bool pin_threads = false)
+      : deques_(num_threads == 0 ? 1 : num_threads) {
+    for (size_t i = 0; i < deques_.size(); ++i) {
+      workers_.emplace_back([this, i] { WorkerLoop(i); });
+      if (pin_threads) {
+        Pin(&workers_.back(), i);
+      }
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Runs every task that has been submitted, then stops the workers.
+  ~ThreadPool() {
+    {
+      std::scoped_lock lock(latch_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t NumThreads() const { return workers_.size(); }
+
+  // Runs fn(args...) on the pool, and returns a std::future for its result.
+  // Exceptions thrown by fn are stored in the future and rethrown by get().
+  // Waiting on the future from inside a task blocks that worker; use
+  // ParallelFor for nested parallelism instead.
+  template <typename Fn, typename... Args>
+  auto Submit(Fn &&fn, Args &&...args) -> std::future<std::invoke_result_t<Fn, Args...>> {
+    using Result = std::invoke_result_t<Fn, Args...>;
+    // std::function needs a copyable function, and std::packaged_task can
+    // only be moved, so we keep the packaged_task in a shared_ptr.
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+        std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
+    std::future<Result> future = task->get_future();
+    Schedule(new Task{[task] { (*task)(); }});
+    return future;
+  }
+
+  // Calls fn(i) for every i in [begin, end), in parallel, and returns once
+  // all calls have finished. The calling thread runs tasks too while it
+  // waits, so ParallelFor can be called from inside a task. fn must not
+  // throw, since there is no future to carry the exception back.
+  //
+  // The range is split in halves recursively: a worker keeps the left half
+  // and pushes the right half onto its deque, where idle workers can steal
+  // it. How far to split is decided at run time, the way TBB's
+  // auto_partitioner does it. Each piece carries a depth, the number of
+  // times it may still be split, which starts out at enough for about two
+  // pieces per worker. If all workers are busy, nothing is stolen, and each
+  // worker runs its few big pieces with no further overhead. But a piece that
+  // is stolen shows that some worker ran out of work, so the thief gets
+  // kStolenDepth more levels of splitting, and the rest of that piece is
+  // spread out too. Uneven iterations therefore get split finely where they
+  // are slow, and nowhere else. No piece is split below grain iterations.
+  template <typename Fn>
+  void ParallelFor(size_t begin, size_t end, Fn fn, size_t grain = 1) {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max<size_t>(1, grain);
+    int initial_depth = 1;
+    while ((size_t{1} << initial_depth) < 2 * NumThreads()) {
+      ++initial_depth;
+    }
+    std::atomic<size_t> remaining{end - begin};
+    std::function<void(size_t, size_t, int)> run_range = [&](size_t lo, size_t hi, int depth) {
+      while (hi - lo > grain && depth > 0) {
+        size_t mid = lo + (hi - lo) / 2;
+        --depth;
+        std::thread::id owner = std::this_thread::get_id();
+        Schedule(new Task{[&run_range, mid, hi, depth, owner] {
+          bool stolen = std::this_thread::get_id() != owner;
+          run_range(mid, hi, stolen ? depth + kStolenDepth : depth);
+        }});
+        hi = mid;
+      }
+      for (size_t i = lo; i < hi; ++i) {
+        fn(i);
+      }
+      remaining.fetch_sub(hi - lo, std::memory_order_release);
+    };
+    run_range(begin, end, initial_depth);
+    while (remaining.load(std::memory_order_acquire) > 0) {
+      if (!RunOneTask()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  // How many more times a stolen ParallelFor piece may be split: two levels
+  // turn it into four pieces, so other idle workers can join in.
+  static constexpr int kStolenDepth = 2;
+
+  // Which pool and worker the current thread belongs to, if any.
+  struct WorkerIdentity {
+    ThreadPool *pool_ = nullptr;
+    size_t index_ = 0;
+  };
+  static WorkerIdentity &CurrentWorker() {
+    thread_local WorkerIdentity identity;
+    return identity;
+  }
+
+  void Schedule(Task *task) {
+    WorkerIdentity &me = CurrentWorker();
+    if (me.pool_ == this) {
+      deques_[me.index_].Push(task);
+    } else {
+      std::scoped_lock lock(latch_);
+      injected_.push_back(task);
+    }
+    // Wake a sleeping worker, if there is one. The fence pairs with the one
+    // in WorkerLoop: either the sleeper sees the new task when it checks one
+    // last time, or we see the sleeper here. Taking latch_ makes sure the
+    // sleeper is really waiting before we notify it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+      { std::scoped_lock lock(latch_); }
+      wake_.notify_one();
+    }
+  }
+
+  // Finds a task and runs it. It looks in the calling worker's own deque
+  // first, then in the shared queue, and then tries to steal from the other
+  // workers, starting with the next one, so that thieves spread out. It
+  // returns false if it found no task.
+  bool RunOneTask() {
+    WorkerIdentity &me = CurrentWorker();
+    bool is_worker = me.pool_ == this;
+    Task *task = is_worker ? deques_[me.index_].Pop() : nullptr;
+    if (task == nullptr) {
+      task = TakeInjected();
+    }
+    for (size_t i = 1; task == nullptr && i <= deques_.size(); ++i) {
+      task = deques_[(me.index_ + i) % deques_.size()].Steal();
+    }
+    if (task == nullptr) {
+      return false;
+    }
+    task->fn_();
+    delete task;
+    return true;
+  }
+
+  Task *TakeInjected() {
+    std::scoped_lock lock(latch_);
+    if (injected_.empty()) {
+      return nullptr;
+    }
+    Task *task = injected_.front();
+    injected_.pop_front();
+    return task;
+  }
+
+  // Returns whether any deque or the shared queue has a task. Must be called
+  // with latch_ held.
+  bool HasWork() const {
+    if (!injected_.empty()) {
+      return true;
+    }
+    for (const ChaseLevDeque &deque : deques_) {
+      if (!deque.Empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerLoop(size_t index) {
+    CurrentWorker() = WorkerIdentity{this, index};
+    while (true) {
+      // Look for work a few times before going to sleep, since new tasks
+      // often arrive in bursts.
+      bool ran = false;
+      for (int attempt = 0; attempt < 16 && !ran; ++attempt) {
+        ran = RunOneTask();
+        if (!ran) {
+          std::this_thread::yield();
+        }
+      }
+      if (ran) {
+        continue;
+      }
+      std::unique_lock lock(latch_);
+      sleepers_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!HasWork()) {
+        if (stopping_) {
+          sleepers_.fetch_sub(1, std::memory_order_relaxed);
+          return;
+        }
+        wake_.wait(lock);
+      }
+      sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  static void Pin(std::thread *thread, size_t index) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % std::max(1U, std::thread::hardware_concurrency()), &cpus);
+    pthread_setaffinity_np(thread->native_handle(), sizeof(cpus), &cpus);
+#else
+    (void)thread;
+    (void)index;
+#endif
+  }
+
+  std::vector<ChaseLevDeque> deques_;
+  std::vector<std::thread> workers_;
+  // latch_ protects injected_ and stopping_, and is used with wake_ to put
+  // idle workers to sleep.
+  std::mutex latch_;
+  std::condition_variable wake_;
+  std::deque<Task *> injected_;
+  bool stopping_ = false;
+  std::atomic<int> sleepers_{0};
+};
+
+// A small helper for timing the benchmark. It runs a function and returns how
+// many microseconds it took.
+template <typename Fn>
+long long TimeUs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  ThreadPool pool;
+
+  // We repeat the example from mutex.cpp, with two tasks on the pool instead
+  // of two new threads.
+  int count = 0;
+  std::mutex m;
+  auto add_count = [&] {
+    std::scoped_lock slk(m);
+    count += 1;
+  };
+  std::future<void> f1 = pool.Submit(add_count);
+  std::future<void> f2 = pool.Submit(add_count);
+  f1.get();
+  f2.get();
+  std::cout << "Printing count: " << count << std::endl;
+
+  // Futures carry results and exceptions back to the caller.
+  std::future<int> sum = pool.Submit([](int a, int b) { return a + b; }, 40, 5);
+  std::future<int> failed = pool.Submit([]() -> int { throw std::runtime_error("task failed"); });
+  std::cout << "40 + 5 = " << sum.get() << "\n";
+  try {
+    failed.get();
+  } catch (const std::runtime_error &e) {
+    std::cout << "Caught: " << e.what() << "\n";
+  }
+
+  // Now the benchmark. The number of tasks can be passed as the first
+  // argument. Each task does a small amount of work.
+  size_t num_tasks = argc > 1 ? std::stoul(argv[1]) : 20000;
+  std::atomic<long long> total{0};
+  auto small_task = [&] {
+    long long local = 0;
+    for (int i = 0; i < 1000; ++i) {
+      local += i;
+    }
+    total += local;
+  };
+  long long thread_us = TimeUs([&] {
+    for (size_t i = 0; i < num_tasks; ++i) {
+      std::thread t(small_task);
+      t.join();
+    }
+  });
+  long long pool_us = TimeUs([&] {
+    std::vector<std::future<void>> futures;
+    futures.reserve(num_tasks);
+    for (size_t i = 0; i < num_tasks; ++i) {
+      futures.push_back(pool.Submit(small_task));
+    }
+    for (std::future<void> &future : futures) {
+      future.get();
+    }
+  });
+  long long parallel_for_us = TimeUs([&] { pool.ParallelFor(0, num_tasks, [&](size_t) { small_task(); }); });
+  std::cout << "Running " << num_tasks << " small tasks on " << pool.NumThreads() << " workers:\n";
+  std::cout << "One std::thread per task: " << thread_us << " us (" << thread_us * 1000 / num_tasks
+            << " ns per task)\n";
+  std::cout << "ThreadPool::Submit:       " << pool_us << " us (" << pool_us * 1000 / num_tasks << " ns per task)\n";
+  std::cout << "ThreadPool::ParallelFor:  " << parallel_for_us << " us (" << parallel_for_us * 1000 / num_tasks
+            << " ns per task)\n";
+  if (total != 3 * static_cast<long long>(num_tasks) * 499500) {
+    std::cout << "Some tasks did not run!\n";
+    return 1;
+  }
+
+  return 0;
+}